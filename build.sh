@@ -85,7 +85,7 @@ OBJ_FILES=(build/entry.o)
 for src in "${KERNEL_SOURCES[@]}"; do
     obj_name="build/$(basename "${src%.c}").o"
     echo "  Compiling $src..."
-    gcc -m64 -ffreestanding -O2 -c "$src" -o "$obj_name" \
+    gcc -m64 -ffreestanding -O2 -mno-red-zone -c "$src" -o "$obj_name" \
         -Iinclude -nostdinc -fno-stack-protector -fno-pic -fno-pie
     OBJ_FILES+=("$obj_name")
 done
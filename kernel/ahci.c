@@ -2,15 +2,99 @@
 #include "include/lib.h"
 #include "include/pci.h"
 #include "include/mm.h"
+#include "include/idt.h"
+#include "include/timer.h"
+#include "include/blkdev.h"
+#include "include/iostat.h"
 
 #define AHCI_CLASS 0x01
 #define AHCI_SUBCLASS 0x06
-#define AHCI_DEBUG 1
+#define AHCI_DEBUG 0 // Port probe details; iostat covers the I/O path
+
+#define ATA_CMD_READ_DMA           0xC8
+#define ATA_CMD_WRITE_DMA          0xCA
+#define ATA_CMD_IDENTIFY           0xEC
+#define ATA_CMD_DSM                0x06
+#define ATA_CMD_FLUSH_CACHE        0xE7
+#define ATA_DSM_TRIM               0x01
+#define ATA_TRIM_RANGE_MAX         0xFFFF // Sectors per range entry
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT  0x3D
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+#define ATA_DEV_BUSY 0x80
+#define ATA_DEV_DRQ  0x08
+
+#define HBA_CAP_CCCS  (1 << 7)
+#define HBA_GHC_IE    (1 << 1)
+#define HBA_CCC_EN    (1 << 0)
+#define HBA_PxCMD_ST  (1 << 0)
+#define HBA_PxCMD_SUD (1 << 1)
+#define HBA_PxCMD_FRE (1 << 4)
+#define HBA_PxCMD_FR  (1 << 14)
+#define HBA_PxCMD_CR  (1 << 15)
+#define HBA_PxIS_TFES (1 << 30)
+
+// D2H register, PIO setup, DMA setup, set device bits, descriptor
+// processed and all error interrupts
+#define HBA_PxIE_DEFAULT 0x7C00002F
+// The completion part of it, left to the coalescing interrupt on
+// coalesced ports
+#define HBA_PxIE_COMPLETION 0x0000002F
+
+// Adaptive coalescing starts once a port has this many commands in
+// flight; below that the interrupt per command is what keeps latency down
+#define AHCI_CCC_MIN_DEPTH 4
+
+#define AHCI_MAX_PRD_BYTES (4 * 1024 * 1024)
+#define AHCI_MAX_CMD_SECTORS 65536 // LBA48 count, 0 in the FIS means 65536
+#define AHCI_CMD_TABLE_SIZE (sizeof(hba_cmd_table_t) + AHCI_MAX_PRDS * 16)
+#define AHCI_CMD_TIMEOUT_MS 5000
+
+// Port bring-up timing (AHCI 1.3.1 sections 10.1.2 and 10.4.2)
+#define AHCI_ENGINE_STOP_US    500000   // PxCMD.CR / PxCMD.FR must clear
+#define AHCI_COMRESET_HOLD_US  1000     // PxSCTL.DET=1 held at least 1 ms
+#define AHCI_PRESENCE_US       20000    // No device presence by then = empty port
+#define AHCI_LINK_US           1000000  // Present device must establish the link
+#define AHCI_READY_US          10000000 // Spin-up until BSY clears
+
+typedef struct {
+    uint32_t free_slots;   // Bit set = slot can take a new command
+    uint32_t busy_slots;   // Bit set = issued and not yet reaped
+    uint32_t failed_slots; // Busy slots that completed with an error
+    volatile uint32_t irq_status; // PxIS bits collected by the interrupt handler
+    ahci_io_t* slot_io[32];       // Command occupying each busy slot
+    uint64_t slot_start[32];      // Tick it was issued at
+    ahci_io_t* queue_head;        // Waiting for a free slot
+    ahci_io_t* queue_tail;
+    uint8_t queue_depth;
+    uint8_t ncq;           // Use READ/WRITE FPDMA QUEUED
+    uint8_t spl;           // 512-byte units per logical sector
+    uint32_t max_sectors;  // Per command, in 512-byte units
+    uint8_t ccc_count;     // Completions worth coalescing at the current depth
+    ahci_device_info_t info;
+} ahci_port_state_t;
 
 static hba_mem_t* hba = NULL;
 static uint32_t abar = 0;
 static int ports[32] = {0};
 static int port_count = 0;
+static ahci_port_state_t port_state[32];
+static uint8_t pci_bus, pci_slot, pci_func;
+static int ahci_irq_vector = 0; // 0 = completions are polled
+static int ahci_drive_blkdev[32];    // Block device id of each drive
+
+// Command completion coalescing. The HBA has a single completion count
+// and timeout; ccc_ports picks the ports it applies to.
+static int ccc_mode = AHCI_CCC_OFF;
+static uint8_t ccc_max_count = 8;      // Fixed count, or the adaptive ceiling
+static uint16_t ccc_timeout_ms = 1;
+static uint32_t ccc_ports = 0;         // As programmed
+static uint8_t ccc_count = 0;
+static uint32_t ccc_irq_bit = 0;       // IS bit the coalescing interrupt uses
 
 static int find_ahci_controller() {
     for (int bus = 0; bus < 256; bus++) {
@@ -45,6 +129,9 @@ static int find_ahci_controller() {
 
                     abar = pci_read_dword(bus, slot, func, 0x24);
                     abar &= ~0xF;
+                    pci_bus = bus;
+                    pci_slot = slot;
+                    pci_func = func;
 
                     print("ABAR: ");
                     print_hex(abar);
@@ -116,55 +203,10 @@ static int check_port_type(hba_port_t* port) {
     }
 }
 
-static void port_reset(int port_num) {
-    hba_port_t* port = &hba->ports[port_num];
-    
-    print("Resetting port ");
-    print_hex(port_num);
-    print("\n");
-
-    port->cmd &= ~0x01;
-    int timeout = 1000000;
-    while ((port->cmd & 0x4000) && timeout-- > 0) {
-        io_wait();
-    }
-    if (timeout <= 0) {
-        print("Warning: Port stop timeout\n");
-    }
-
-    port->ie = 0;
-
-    port->is = 0xFFFFFFFF;
-
-    uint32_t sctl = port->sctl;
-    port->sctl = (sctl & ~0xF) | 0x01;
-    msleep(1000);
-    
-    port->sctl = sctl & ~0xF;
-    msleep(1000);
-
-    timeout = 5000000;
-    while (timeout-- > 0) {
-        uint32_t ssts = port->ssts;
-        uint8_t det = ssts & 0xF;
-        uint8_t ipm = (ssts >> 8) & 0xF;
-        
-        if (det == 3 && ipm == 1) {
-            print("Port ");
-            print_hex(port_num);
-            print(" ready: DET=3, IPM=1\n");
-            return;
-        }
-        io_wait();
-    }
-    
-    print("Port reset timeout: SSTS=");
-    print_hex(port->ssts);
-    print(" (DET=");
-    print_hex(port->ssts & 0xF);
-    print(", IPM=");
-    print_hex((port->ssts >> 8) & 0xF);
-    print(")\n");
+static void port_set_queue(ahci_port_state_t* ps, int depth, int ncq) {
+    ps->ncq = ncq;
+    ps->queue_depth = depth;
+    ps->free_slots = depth == 32 ? 0xFFFFFFFF : (1u << depth) - 1;
 }
 
 static void port_init(int port_num) {
@@ -177,21 +219,42 @@ static void port_init(int port_num) {
     while (port->cmd & (1 << 15) || port->cmd & (1 << 14));
 
     void* clb_ptr = kmalloc_aligned(1024, 1024);
-    port->clb = (uint64_t)(uintptr_t)clb_ptr;
-    port->clbu = (uint64_t)(uintptr_t)clb_ptr >> 32;
+    port->clb = (uint64_t)(unsigned long)clb_ptr;
+    port->clbu = (uint64_t)(unsigned long)clb_ptr >> 32;
     memset(clb_ptr, 0, 1024);
 
     void* fb_ptr = kmalloc_aligned(256, 256);
-    port->fb = (uint32_t)(uintptr_t)fb_ptr;
+    port->fb = (uint32_t)(unsigned long)fb_ptr;
     port->fbu = (uint32_t)((uint64_t)fb_ptr >> 32);
     memset(fb_ptr, 0, 256);
 
-    hba_cmd_header_t* cmd_list = (hba_cmd_header_t*)(uintptr_t)port->clb;
+    hba_cmd_header_t* cmd_list = (hba_cmd_header_t*)(unsigned long)port->clb;
     for (int i = 0; i < 32; i++) {
-        void* ctba_ptr = kmalloc_aligned(256, 256);
-        cmd_list[i].ctba = (uint32_t)(uintptr_t)ctba_ptr;
+        void* ctba_ptr = kmalloc_aligned(AHCI_CMD_TABLE_SIZE, 128);
+        cmd_list[i].ctba = (uint32_t)(unsigned long)ctba_ptr;
         cmd_list[i].ctbau = (uint32_t)((uint64_t)ctba_ptr >> 32);
-        memset(ctba_ptr, 0, 256);
+        memset(ctba_ptr, 0, AHCI_CMD_TABLE_SIZE);
+    }
+
+    // Assumed until IDENTIFY says otherwise: 512-byte LBA48 sectors, one
+    // command at a time
+    ahci_port_state_t* ps = &port_state[port_num];
+    ps->busy_slots = 0;
+    ps->failed_slots = 0;
+    port_set_queue(ps, 1, 0);
+    ps->spl = 1;
+    ps->max_sectors = AHCI_MAX_CMD_SECTORS;
+    memset(&ps->info, 0, sizeof(ps->info));
+    ps->info.logical_sector_size = 512;
+    ps->info.physical_sector_size = 512;
+    ps->info.max_transfer = AHCI_MAX_CMD_SECTORS;
+    ps->info.lba48 = 1;
+    ps->info.rotational = 1;
+
+    port->is = 0xFFFFFFFF;
+    ps->irq_status = 0;
+    if (ahci_irq_vector) {
+        port->ie = (ccc_ports >> port_num) & 1 ? HBA_PxIE_DEFAULT & ~HBA_PxIE_COMPLETION : HBA_PxIE_DEFAULT;
     }
 
     port->cmd |= (1 << 4);
@@ -199,103 +262,128 @@ static void port_init(int port_num) {
     port->cmd |= 0x01;
 }
 
-static int is_m2_port(int port_num) {
-    hba_port_t* port = &hba->ports[port_num];
-
-    uint32_t sstatus = port->ssts;
-    uint8_t det = sstatus & 0xF;
-    uint8_t ipm = (sstatus >> 8) & 0xF;
-    uint8_t spd = (sstatus >> 4) & 0xF;
-    
-    print("Checking port ");
-    print_hex(port_num);
-    print(" for M.2 characteristics:\n");
-    print("  SStatus: ");
-    print_hex(sstatus);
-    print(" (DET=");
-    print_hex(det);
-    print(", IPM=");
-    print_hex(ipm);
-    print(", SPD=");
-    print_hex(spd);
-    print(")\n");
-
-    if (spd >= 3) {
-        print("  High speed detected (SPD=");
-        print_hex(spd);
-        print("), likely M.2\n");
-        return 0;
+static void print_us(uint64_t us) {
+    char num_buf[12];
+    if (us >= 10000) {
+        itoa((int)(us / 1000), num_buf, 10);
+        print(num_buf);
+        print(" ms");
+    } else {
+        itoa((int)us, num_buf, 10);
+        print(num_buf);
+        print(" us");
     }
+}
 
-    print("  Signature: ");
-    print_hex(port->sig);
-    print("\n");
-
-    if (port->sig == 0xEB140101 || port->sig == 0x00000101) {
-        print("  Known M.2 signature detected\n");
-        return 0;
+// Clears a PxCMD bit on every port in the mask, then waits for the
+// matching running bit to drop on all of them.
+static void ports_clear_cmd(uint32_t mask, uint32_t bit, uint32_t running) {
+    for (uint32_t m = mask; m; m &= m - 1) {
+        hba->ports[__builtin_ctz(m)].cmd &= ~bit;
     }
 
-    uint32_t sctl = port->sctl;
-    print("  SControl: ");
-    print_hex(sctl);
-    print("\n");
-
-    if ((sctl & 0xF) == 0x1) {
-        print("  M.2-like SControl configuration detected\n");
-        return 0;
+    uint64_t start = timer_us();
+    for (uint32_t m = mask; m; m &= m - 1) {
+        hba_port_t* port = &hba->ports[__builtin_ctz(m)];
+        while ((port->cmd & running) && timer_us() - start < AHCI_ENGINE_STOP_US) {
+            asm volatile ("pause");
+        }
     }
+}
 
-    if (port_num >= 4 && port_num <= 6) {
-        print("  Port number in typical M.2 range (4-6)\n");
-        return 0;
+// Resets every implemented port at the same time and waits for all of
+// them together: COMRESET is held for the 1 ms the spec asks for, ports
+// without a device are dropped once presence detection has had its
+// chance, and each port counts as done the moment its link comes up and
+// the device clears BSY. Returns the mask of ports with a ready device.
+static uint32_t ports_bring_up(uint32_t pi) {
+    static uint64_t link_us[32];
+    static uint64_t ready_us[32];
+
+    ports_clear_cmd(pi, HBA_PxCMD_ST, HBA_PxCMD_CR);
+    ports_clear_cmd(pi, HBA_PxCMD_FRE, HBA_PxCMD_FR);
+
+    for (uint32_t m = pi; m; m &= m - 1) {
+        hba_port_t* port = &hba->ports[__builtin_ctz(m)];
+        port->ie = 0;
+        port->is = 0xFFFFFFFF;
+        port->serr = 0xFFFFFFFF;
+        if (hba->cap & (1 << 27)) {
+            port->cmd |= HBA_PxCMD_SUD;
+        }
+        port->sctl = (port->sctl & ~0xF) | 0x01;
     }
-    
-    print("  Port does not appear to be M.2\n");
-    return 1;
-}
 
-static void init_m2_port(int port_num) {
-    hba_port_t* port = &hba->ports[port_num];
-    
-    print("Initializing M.2 port ");
-    print_hex(port_num);
-    print("\n");
+    udelay(AHCI_COMRESET_HOLD_US);
 
-    port->cmd &= ~0x01;  // Clear FRE
-    int timeout = 1000000;
-    while ((port->cmd & 0x4000) && timeout-- > 0) {
-        io_wait();
+    uint64_t start = timer_us();
+    for (uint32_t m = pi; m; m &= m - 1) {
+        hba_port_t* port = &hba->ports[__builtin_ctz(m)];
+        port->sctl &= ~0xF;
     }
 
-    port->ie = 0;
-    port->is = 0xFFFFFFFF;
+    uint32_t pending = pi;
+    uint32_t linked = 0;
+    while (pending) {
+        uint64_t now = timer_us() - start;
+        for (uint32_t m = pending; m; m &= m - 1) {
+            int port_num = __builtin_ctz(m);
+            hba_port_t* port = &hba->ports[port_num];
+            uint8_t det = port->ssts & 0xF;
+
+            if (det == 3) {
+                link_us[port_num] = now;
+                port->serr = 0xFFFFFFFF;
+                linked |= 1u << port_num;
+                pending &= ~(1u << port_num);
+            } else if ((det == 0 && now > AHCI_PRESENCE_US) || now > AHCI_LINK_US) {
+                pending &= ~(1u << port_num);
+            }
+        }
+        asm volatile ("pause");
+    }
 
-    uint32_t sctl = port->sctl;
-    port->sctl = (sctl & ~0xF) | 0x01;
-    msleep(5000);
-    
-    port->sctl = sctl & ~0xF;
-    msleep(5000);
-    
-    port->cmd |= 0x01;
+    pending = linked;
+    uint32_t ready = 0;
+    while (pending) {
+        uint64_t now = timer_us() - start;
+        for (uint32_t m = pending; m; m &= m - 1) {
+            int port_num = __builtin_ctz(m);
+            hba_port_t* port = &hba->ports[port_num];
+
+            if (!(port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ))) {
+                ready_us[port_num] = now;
+                ready |= 1u << port_num;
+                pending &= ~(1u << port_num);
+            } else if (now > AHCI_READY_US) {
+                pending &= ~(1u << port_num);
+            }
+        }
+        asm volatile ("pause");
+    }
 
-    timeout = 10000000;
-    while (timeout-- > 0) {
-        uint32_t ssts = port->ssts;
-        uint8_t det = ssts & 0xF;
-        uint8_t ipm = (ssts >> 8) & 0xF;
-        
-        if (det == 3 && ipm == 1) {
-            print("M.2 port ");
-            print_hex(port_num);
-            print(" ready\n");
-            return;
+    for (uint32_t m = pi; m; m &= m - 1) {
+        int port_num = __builtin_ctz(m);
+        print("Port ");
+        print_hex(port_num);
+        if (ready & (1u << port_num)) {
+            print(": link up in ");
+            print_us(link_us[port_num]);
+            print(", Gen ");
+            print_hex((hba->ports[port_num].ssts >> 4) & 0xF);
+            print(", device ready in ");
+            print_us(ready_us[port_num]);
+        } else if (linked & (1u << port_num)) {
+            print(": link up, device stayed busy, TFD=");
+            print_hex(hba->ports[port_num].tfd);
+        } else {
+            print(": no link, SSTS=");
+            print_hex(hba->ports[port_num].ssts);
         }
-        io_wait();
+        print("\n");
     }
-    
-    print("M.2 port initialization timeout\n");
+
+    return ready;
 }
 
 void check_controller_capabilities() {
@@ -432,297 +520,1335 @@ int is_port_ready(int port_num) {
     return 0;
 }
 
-static int find_cmd_slot(hba_port_t* port) {
-    uint32_t slots = (port->sact | port->ci);
-    for (int i = 0; i < 32; i++) {
-        if (!(slots & (1 << i))) {
-            return i;
-        }
+static int slot_alloc(ahci_port_state_t* ps) {
+    if (!ps->free_slots) {
+        return -1;
     }
-    return -1;
-}
 
-static void wait_for_cmd(hba_port_t* port, int slot) {
-    while (1) {
-        if (!(port->ci & (1 << slot))) {
-            break;
-        }
-        if (port->is & (1 << 30)) {
-            print("AHCI: Command error\n");
-            break;
-        }
-    }
-    port->is = 0;
+    int slot = __builtin_ctz(ps->free_slots);
+    ps->free_slots &= ~(1u << slot);
+    return slot;
 }
 
-void test_disk_read() {
-    if (port_count == 0) {
-        print("No drives available for testing\n");
-        return;
-    }
-    
-    print("Testing disk read...\n");
-
-    uint8_t* buffer = (uint8_t*)kmalloc(512);
-    if (!buffer) {
-        print("Failed to allocate memory for test\n");
-        return;
-    }
-
-    if (ahci_read_sectors(0, 1, buffer)) {
-        print("Disk read test successful\n");
-
-        if (buffer[510] == 0x55 && buffer[511] == 0xAA) {
-            print("MBR signature found\n");
-        } else {
-            print("No MBR signature found\n");
-        }
-    } else {
-        print("Disk read test failed\n");
-    }
-    
-    kfree(buffer);
+static void slot_release(ahci_port_state_t* ps, int slot) {
+    ps->busy_slots &= ~(1u << slot);
+    ps->free_slots |= 1u << slot;
 }
 
-int ahci_read_sectors(uint64_t lba, uint32_t count, void* buffer) {
-    if (port_count == 0) {
-        print("No ports available\n");
-        return 1;
-    }
-
-    if (!is_port_ready(0)) {
-        print("Port not ready for reading\n");
-        return 1;
-    }
+static void port_recover(int port_num) {
+    hba_port_t* port = &hba->ports[port_num];
 
-    hba_port_t* port = &hba->ports[ports[0]];
+    print("AHCI: Recovering port ");
+    print_hex(port_num);
+    print("\n");
 
+    port->cmd &= ~0x01;
     int timeout = 1000000;
-    while ((port->tfd & 0x88) && timeout-- > 0) {
+    while ((port->cmd & 0x8000) && timeout-- > 0) {
         io_wait();
     }
-    
-    if (timeout <= 0) {
-        print("AHCI: Port busy timeout\n");
-        return 1;
-    }
 
-    int slot = find_cmd_slot(port);
-    if (slot == -1) {
-        print("AHCI: No free command slots\n");
-        return 1;
-    }
+    port->serr = 0xFFFFFFFF;
+    port->is = 0xFFFFFFFF;
 
-    hba_cmd_header_t* cmd_header = ((hba_cmd_header_t*)(uintptr_t)port->clb) + slot;
-    hba_cmd_table_t* cmd_table = (hba_cmd_table_t*)(uintptr_t)cmd_header->ctba;
+    if ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && (hba->cap & (1 << 24))) {
+        port->cmd |= (1 << 3);
+        timeout = 1000000;
+        while ((port->cmd & (1 << 3)) && timeout-- > 0) {
+            io_wait();
+        }
+    }
 
-    cmd_header->cfl = sizeof(fis_h2d_t) / sizeof(uint32_t);
-    cmd_header->w = 0;
-    cmd_header->prdtl = 1;
+    port->cmd |= 0x01;
+}
 
-    fis_h2d_t* fis = (fis_h2d_t*)cmd_table->cfis;
+static void build_rw_fis(fis_h2d_t* fis, uint64_t lba, uint32_t count, int write, int fua, int ncq, int lba48, int tag) {
     memset(fis, 0, sizeof(fis_h2d_t));
     fis->fis_type = FIS_TYPE_REG_H2D;
-    fis->command = 0x25;
+    fis->pmport = 0x80; // C: this FIS updates the command register
     fis->device = 0x40;
+
+    if (!lba48 && !ncq) {
+        fis->command = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+        fis->device |= (lba >> 24) & 0x0F;
+        fis->lba0 = lba & 0xFF;
+        fis->lba1 = (lba >> 8) & 0xFF;
+        fis->lba2 = (lba >> 16) & 0xFF;
+        fis->count = count & 0xFF;
+        fis->control = 0x08;
+        return;
+    }
+
+    if (ncq) {
+        fis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        fis->feature = count & 0xFF;
+        fis->feature_exp = (count >> 8) & 0xFF;
+        fis->count = tag << 3;
+        if (fua) {
+            fis->device |= 0x80;
+        }
+    } else if (fua) {
+        fis->command = ATA_CMD_WRITE_DMA_FUA_EXT;
+        fis->count = count & 0xFF;
+        fis->count_exp = (count >> 8) & 0xFF;
+    } else {
+        fis->command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        fis->count = count & 0xFF;
+        fis->count_exp = (count >> 8) & 0xFF;
+    }
+
     fis->lba0 = lba & 0xFF;
     fis->lba1 = (lba >> 8) & 0xFF;
     fis->lba2 = (lba >> 16) & 0xFF;
     fis->lba3 = (lba >> 24) & 0xFF;
     fis->lba4 = (lba >> 32) & 0xFF;
     fis->lba5 = (lba >> 40) & 0xFF;
-    fis->count = count & 0xFF;
-    fis->count_exp = (count >> 8) & 0xFF;
     fis->control = 0x08;
+}
 
-    cmd_table->prdt[0].dba = (uint32_t)(uintptr_t)buffer;
-    cmd_table->prdt[0].dbau = (uint32_t)((uint64_t)(uintptr_t)buffer >> 32);
-    cmd_table->prdt[0].dbc = (count * 512) - 1;
-    cmd_table->prdt[0].rsv = 0;
+// Describes the request's data in the command table, one PRD per
+// 4 MiB piece of each segment. Returns the entry count or -1.
+static int fill_prdt(hba_cmd_table_t* cmd_table, ahci_io_t* io) {
+    ahci_sg_t single;
+    const ahci_sg_t* sg = io->sg;
+    uint32_t nsg = io->nsg;
+    uint32_t offset = io->sg_offset;
+
+    if (!sg) {
+        single.addr = io->buffer;
+        single.len = io->count * 512;
+        sg = &single;
+        nsg = 1;
+        offset = 0;
+    }
 
-    port->ci = 1 << slot;
+    uint32_t remaining = io->count * 512;
+    int prd = 0;
 
-    wait_for_cmd(port, slot);
-    
-    return 0;
-}
+    for (uint32_t i = 0; i < nsg && remaining > 0; i++) {
+        uint64_t addr = (uint64_t)(unsigned long)sg[i].addr + offset;
+        uint32_t len = sg[i].len - offset;
+        offset = 0;
+
+        if (len > remaining) {
+            len = remaining;
+        }
+        remaining -= len;
 
-int ahci_write_sectors(uint64_t lba, uint32_t count, void* buffer) {
-    if (port_count == 0) return 1;
+        while (len > 0) {
+            if (prd == AHCI_MAX_PRDS) {
+                return -1;
+            }
 
-    hba_port_t* port = &hba->ports[ports[0]];
+            uint32_t piece = len > AHCI_MAX_PRD_BYTES ? AHCI_MAX_PRD_BYTES : len;
+            cmd_table->prdt[prd].dba = (uint32_t)addr;
+            cmd_table->prdt[prd].dbau = (uint32_t)(addr >> 32);
+            cmd_table->prdt[prd].dbc = piece - 1;
+            cmd_table->prdt[prd].rsv = 0;
+            prd++;
 
-    int slot = find_cmd_slot(port);
-    if (slot == -1) {
-        print("AHCI: No free command slots\n");
-        return 1;
+            addr += piece;
+            len -= piece;
+        }
     }
 
-    hba_cmd_header_t* cmd_header = ((hba_cmd_header_t*)(uintptr_t)port->clb) + slot;
-    hba_cmd_table_t* cmd_table = (hba_cmd_table_t*)(uintptr_t)cmd_header->ctba;
-
-    cmd_header->cfl = sizeof(fis_h2d_t) / sizeof(uint32_t);
-    cmd_header->w = 1;
-    cmd_header->prdtl = 1;
+    return remaining ? -1 : prd;
+}
 
-    fis_h2d_t* fis = (fis_h2d_t*)cmd_table->cfis;
+// TRIM and FLUSH CACHE are not queued commands, so they wait for the
+// port to drain
+static void build_trim_fis(fis_h2d_t* fis, uint32_t blocks) {
     memset(fis, 0, sizeof(fis_h2d_t));
     fis->fis_type = FIS_TYPE_REG_H2D;
-    fis->command = 0x35;
+    fis->pmport = 0x80;
     fis->device = 0x40;
-    fis->lba0 = lba & 0xFF;
-    fis->lba1 = (lba >> 8) & 0xFF;
-    fis->lba2 = (lba >> 16) & 0xFF;
-    fis->lba3 = (lba >> 24) & 0xFF;
-    fis->lba4 = (lba >> 32) & 0xFF;
-    fis->lba5 = (lba >> 40) & 0xFF;
-    fis->count = count & 0xFF;
-    fis->count_exp = (count >> 8) & 0xFF;
+    fis->command = ATA_CMD_DSM;
+    fis->feature = ATA_DSM_TRIM;
+    fis->count = blocks & 0xFF;
+    fis->count_exp = (blocks >> 8) & 0xFF;
     fis->control = 0x08;
+}
 
-    cmd_table->prdt[0].dba = (uint32_t)(uintptr_t)buffer;
-    cmd_table->prdt[0].dbau = (uint32_t)((uint64_t)(uintptr_t)buffer >> 32);
-    cmd_table->prdt[0].dbc = (count * 512) - 1;
-    cmd_table->prdt[0].rsv = 0;
+static void build_flush_fis(fis_h2d_t* fis, int lba48) {
+    memset(fis, 0, sizeof(fis_h2d_t));
+    fis->fis_type = FIS_TYPE_REG_H2D;
+    fis->pmport = 0x80;
+    fis->device = 0x40;
+    fis->command = lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE;
+    fis->control = 0x08;
+}
 
-    port->ci = 1 << slot;
+// Puts one request into a free command slot and rings the doorbell.
+// Returns the slot number or -1 if the request could not be issued.
+static int ahci_issue(int port_num, ahci_io_t* io) {
+    hba_port_t* port = &hba->ports[port_num];
+    ahci_port_state_t* ps = &port_state[port_num];
+    int queued = ps->ncq && !io->trim && !io->flush;
 
-    wait_for_cmd(port, slot);
-    
-    return 0;
-}
+    if ((io->trim || io->flush) && ps->busy_slots) {
+        return -1;
+    }
 
-void ahci_detect_drives() {
-    if (!hba) return;
-    
-    uint32_t pi = hba->pi;
-    port_count = 0;
-    
-    print("Checking implemented ports: ");
-    print_hex(pi);
-    print("\n");
+    if (!ps->busy_slots) {
+        int timeout = 1000000;
+        while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && timeout-- > 0) {
+            io_wait();
+        }
 
-    for (int i = 0; i < 32; i++) {
-        if ((pi & (1 << i)) && is_m2_port(i)) {
-            print("\nM.2 drive port found!");
-            print("\n=== Checking M.2 port ");
-            print_hex(i);
-            print(" ===\n");
-            
-            diagnose_m2_port(i);
-
-            init_m2_port(i);
-
-            uint32_t ssts = hba->ports[i].ssts;
-            uint8_t det = ssts & 0xF;
-            uint8_t ipm = (ssts >> 8) & 0xF;
-            
-            if (det == 3 && ipm == 1) {
-                ports[port_count++] = i;
-                print("M.2 drive found at port ");
-                print_hex(i);
-                print("\n");
-                port_init(i);
-            } else {
-                print("No M.2 drive found at port ");
-                print_hex(i);
-                print("\n");
-            }
+        if (timeout <= 0) {
+            print("AHCI: Port busy timeout\n");
+            return -1;
         }
     }
 
-    for (int i = 0; i < 32; i++) {
-        if ((pi & (1 << i)) && !is_m2_port(i)) {
-            print("\nM.2 drive port not found!");
-            print("\n=== Checking SATA port ");
-            print_hex(i);
-            print(" ===\n");
-            
-            hba_port_t* port = &hba->ports[i];
-            
-            port_reset(i);
-            
-            int type = check_port_type(port);
-            if (type > 0) {
-                ports[port_count++] = i;
-                print("SATA drive found at port ");
-                print_hex(i);
-                print(" type: ");
-                if (type == 1) print("SATA");
-                else if (type == 2) print("SATAPI");
-                else print("Unknown");
-                print("\n");
-
-                port_init(i);
-            } else {
-                print("No SATA drive found at port ");
-                print_hex(i);
-                print("\n");
-            }
-        }
+    int slot = slot_alloc(ps);
+    if (slot == -1) {
+        return -1;
+    }
+
+    hba_cmd_header_t* cmd_header = ((hba_cmd_header_t*)(unsigned long)port->clb) + slot;
+    hba_cmd_table_t* cmd_table = (hba_cmd_table_t*)(unsigned long)cmd_header->ctba;
+
+    cmd_header->cfl = sizeof(fis_h2d_t) / sizeof(uint32_t);
+    cmd_header->w = io->write ? 1 : 0;
+    cmd_header->prdbc = 0;
+
+    int prds = fill_prdt(cmd_table, io);
+    if (prds < 0) {
+        print("AHCI: Request does not fit the PRDT\n");
+        slot_release(ps, slot);
+        return -1;
+    }
+    cmd_header->prdtl = prds;
+
+    if (io->trim) {
+        build_trim_fis((fis_h2d_t*)cmd_table->cfis, io->count);
+    } else if (io->flush) {
+        build_flush_fis((fis_h2d_t*)cmd_table->cfis, ps->info.lba48);
+    } else {
+        build_rw_fis((fis_h2d_t*)cmd_table->cfis, io->lba / ps->spl, io->count / ps->spl,
+                     io->write, io->fua, ps->ncq, ps->info.lba48, slot);
+    }
+
+    ps->busy_slots |= 1u << slot;
+
+    if (queued) {
+        port->sact = 1u << slot;
     }
+    port->ci = 1u << slot;
+
+    return slot;
 }
 
-int try_alternative_port_init(int port_num) {
+// Collects finished slots. A task file error aborts every command still
+// outstanding on the port, so those are all reported as failed.
+static uint32_t ahci_reap(int port_num) {
     hba_port_t* port = &hba->ports[port_num];
-    
-    print("Trying alternative port initialization for port ");
-    print_hex(port_num);
-    print("\n");
-
-    port->cmd &= ~0x01;
-    port->cmd &= ~0x02;
-    while (port->cmd & 0x4000);
+    ahci_port_state_t* ps = &port_state[port_num];
 
-    port->serr = 0xFFFFFFFF;
+    // Consume the interrupt status before sampling the doorbells, so an
+    // interrupt arriving after this point wakes the next wait.
+    uint32_t is = __atomic_exchange_n(&ps->irq_status, 0, __ATOMIC_SEQ_CST);
+    is |= port->is;
 
-    msleep(5000);
+    uint32_t active = port->ci;
+    if (ps->ncq) {
+        active |= port->sact;
+    }
 
-    port->cmd |= 0x01;
+    if (is & HBA_PxIS_TFES) {
+        print("AHCI: Command error, TFD=");
+        print_hex(port->tfd);
+        print(" SERR=");
+        print_hex(port->serr);
+        print("\n");
 
-    int timeout = 1000000;
-    while (timeout-- > 0) {
-        if (port->ssts != 0) {
-            print("Port became responsive after alternative init\n");
-            return 0;
-        }
-        io_wait();
+        ps->failed_slots |= ps->busy_slots & active;
+        port_recover(port_num);
+        return ps->busy_slots;
     }
-    return 1;
-}
 
-int ahci_check_drive_ready(int port_num) {
-    if (port_count == 0 || port_num >= port_count) return 0;
-    
-    hba_port_t* port = &hba->ports[ports[port_num]];
-    uint32_t ssts = port->ssts;
-    uint8_t det = ssts & 0xF;
-    uint8_t ipm = (ssts >> 8) & 0xF;
-    
-    return (det == 3 && ipm == 1);
+    return ps->busy_slots & ~active;
 }
 
-void ahci_init() {
-    print("Initializing AHCI...\n");
+// Sleeps until one of the ports raises an interrupt or the next timer
+// tick, or spins briefly when completions are polled.
+static void ahci_sleep(uint32_t port_mask) {
+    if (ahci_irq_vector) {
+        interrupts_disable();
+        int signalled = 0;
+        for (uint32_t m = port_mask; m; m &= m - 1) {
+            if (port_state[__builtin_ctz(m)].irq_status) {
+                signalled = 1;
+                break;
+            }
+        }
 
-    if (!find_ahci_controller()) {
-        print("AHCI: Controller not found\n");
+        if (!signalled) {
+            asm volatile ("sti; hlt" ::: "memory");
+        } else {
+            interrupts_enable();
+        }
         return;
     }
-    
-    print("AHCI: Controller found at ABAR=");
-    print_hex(abar);
-    print("\n");
-    print("AHCI Controller Details:\n");
 
-    uint32_t cap = hba->cap;
+    io_wait();
+}
+
+static int ahci_timed_out(uint64_t start) {
+    return timer_ticks() - start >= AHCI_CMD_TIMEOUT_MS * TIMER_HZ / 1000;
+}
+
+// Runs one non-queued command with at most one data buffer and waits
+// for it. Meant for IDENTIFY and similar housekeeping while the port has
+// no other work.
+static int ahci_exec(int port_num, const fis_h2d_t* fis, void* buffer, uint32_t bytes, int write) {
+    hba_port_t* port = &hba->ports[port_num];
+    ahci_port_state_t* ps = &port_state[port_num];
+
+    if (ps->busy_slots || bytes > AHCI_MAX_PRD_BYTES) {
+        return 1;
+    }
+
+    int timeout = 1000000;
+    while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && timeout-- > 0) {
+        io_wait();
+    }
+    if (timeout <= 0) {
+        print("AHCI: Port busy timeout\n");
+        return 1;
+    }
+
+    int slot = slot_alloc(ps);
+    if (slot == -1) {
+        return 1;
+    }
+    uint32_t bit = 1u << slot;
+
+    hba_cmd_header_t* cmd_header = ((hba_cmd_header_t*)(unsigned long)port->clb) + slot;
+    hba_cmd_table_t* cmd_table = (hba_cmd_table_t*)(unsigned long)cmd_header->ctba;
+
+    cmd_header->cfl = sizeof(fis_h2d_t) / sizeof(uint32_t);
+    cmd_header->w = write ? 1 : 0;
+    cmd_header->prdbc = 0;
+    cmd_header->prdtl = bytes ? 1 : 0;
+    memcpy(cmd_table->cfis, fis, sizeof(fis_h2d_t));
+
+    if (bytes) {
+        uint64_t addr = (uint64_t)(unsigned long)buffer;
+        cmd_table->prdt[0].dba = (uint32_t)addr;
+        cmd_table->prdt[0].dbau = (uint32_t)(addr >> 32);
+        cmd_table->prdt[0].dbc = bytes - 1;
+        cmd_table->prdt[0].rsv = 0;
+    }
+
+    ps->busy_slots |= bit;
+    port->ci = bit;
+
+    uint64_t start = timer_ticks();
+    int failed = 0;
+    while (!(ahci_reap(port_num) & bit)) {
+        ahci_sleep(1u << port_num);
+        if (ahci_timed_out(start)) {
+            print("AHCI: Command timeout\n");
+            port_recover(port_num);
+            ps->failed_slots |= bit;
+            break;
+        }
+    }
+
+    failed = (ps->failed_slots & bit) != 0;
+    ps->failed_slots &= ~bit;
+    slot_release(ps, slot);
+    return failed;
+}
+
+// Copies an IDENTIFY string field, which stores two characters per word
+// high byte first, dropping the space padding on both ends.
+static void identify_string(char* out, const uint16_t* id, int word, int words) {
+    int n = 0;
+    for (int i = 0; i < words; i++) {
+        out[n++] = (char)(id[word + i] >> 8);
+        out[n++] = (char)(id[word + i] & 0xFF);
+    }
+    while (n > 0 && out[n - 1] == ' ') {
+        n--;
+    }
+    out[n] = '\0';
+
+    int skip = 0;
+    while (out[skip] == ' ') {
+        skip++;
+    }
+    memmove(out, out + skip, n - skip + 1);
+}
+
+// Asks the drive what it is and sizes the port's commands and queue to
+// match. Keeps the defaults from port_init if the drive does not answer.
+static void port_identify(int port_num) {
+    ahci_port_state_t* ps = &port_state[port_num];
+    ahci_device_info_t* info = &ps->info;
+
+    uint16_t* id = (uint16_t*)kmalloc_dma(512);
+    if (!id) {
+        return;
+    }
+
+    fis_h2d_t fis;
+    memset(&fis, 0, sizeof(fis));
+    fis.fis_type = FIS_TYPE_REG_H2D;
+    fis.pmport = 0x80;
+    fis.command = ATA_CMD_IDENTIFY;
+
+    if (ahci_exec(port_num, &fis, id, 512, 0)) {
+        print("AHCI: IDENTIFY failed on port ");
+        print_hex(port_num);
+        print("\n");
+        kfree_aligned(id);
+        return;
+    }
+
+    identify_string(info->serial, id, 10, 10);
+    identify_string(info->firmware, id, 23, 4);
+    identify_string(info->model, id, 27, 20);
+
+    info->lba48 = (id[83] & (1 << 10)) != 0;
+    if (info->lba48) {
+        info->sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) |
+                        ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+        info->max_transfer = AHCI_MAX_CMD_SECTORS;
+    } else {
+        info->sectors = (uint32_t)id[60] | ((uint32_t)id[61] << 16);
+        info->max_transfer = 256;
+    }
+
+    // Word 106: logical sectors longer than 256 words, several logical
+    // sectors per physical one; word 209 places LBA 0 inside the first
+    // physical sector.
+    if ((id[106] & 0xC000) == 0x4000) {
+        if (id[106] & (1 << 12)) {
+            uint32_t words = (uint32_t)id[117] | ((uint32_t)id[118] << 16);
+            if (words >= 256 && (words % 256) == 0) {
+                info->logical_sector_size = words * 2;
+            }
+        }
+        if (id[106] & (1 << 13)) {
+            info->physical_sector_size = info->logical_sector_size << (id[106] & 0x0F);
+        } else {
+            info->physical_sector_size = info->logical_sector_size;
+        }
+        if ((id[209] & 0xC000) == 0x4000) {
+            info->alignment_offset = id[209] & 0x3FFF;
+        }
+    }
+
+    if (id[76] != 0 && id[76] != 0xFFFF && (id[76] & (1 << 8))) {
+        info->ncq_depth = (id[75] & 0x1F) + 1;
+    }
+
+    info->trim = (id[169] & 1) != 0;
+    info->trim_max_blocks = id[105];
+    info->write_cache = (id[82] & (1 << 5)) != 0;
+    info->write_cache_enabled = (id[85] & (1 << 5)) != 0;
+    info->fua = (id[84] & 0xC000) == 0x4000 && (id[84] & (1 << 6));
+    info->rotational = id[217] != 1;
+
+    kfree_aligned(id);
+
+    ps->spl = info->logical_sector_size / 512;
+    ps->max_sectors = info->max_transfer * ps->spl;
+
+    int slots = ((hba->cap >> 8) & 0x1F) + 1;
+    if ((hba->cap & (1 << 30)) && info->ncq_depth) {
+        port_set_queue(ps, info->ncq_depth < slots ? info->ncq_depth : slots, 1);
+    } else {
+        port_set_queue(ps, 1, 0);
+    }
+}
+
+static void port_print_info(int port_num) {
+    ahci_port_state_t* ps = &port_state[port_num];
+    ahci_device_info_t* info = &ps->info;
+    char num_buf[12];
+
+    print("Port ");
+    print_hex(port_num);
+    print(": ");
+    print(info->model[0] ? info->model : "unidentified drive");
+    print(", ");
+    itoa((int)(info->sectors * info->logical_sector_size / (1024 * 1024)), num_buf, 10);
+    print(num_buf);
+    print(" MiB, sectors ");
+    itoa((int)info->logical_sector_size, num_buf, 10);
+    print(num_buf);
+    print("/");
+    itoa((int)info->physical_sector_size, num_buf, 10);
+    print(num_buf);
+    print(ps->ncq ? ", NCQ depth " : ", legacy DMA, depth ");
+    print_hex(ps->queue_depth);
+    if (info->trim) print(", TRIM");
+    if (info->write_cache) print(info->write_cache_enabled ? ", write cache on" : ", write cache off");
+    if (info->fua) print(", FUA");
+    print("\n");
+}
+
+static void io_finish(ahci_io_t* io, int status) {
+    io->status = status;
+    if (io->done) {
+        io->done(io);
+    }
+}
+
+// Reprograms coalescing when the port set or the count changes. Count
+// and timeout may only be written while coalescing is disabled.
+static void ccc_program(uint32_t port_mask, uint8_t count) {
+    if (port_mask == ccc_ports && (count == ccc_count || !port_mask)) {
+        return;
+    }
+
+    hba->ccc_ctl &= ~HBA_CCC_EN;
+    for (uint32_t changed = port_mask ^ ccc_ports; changed; changed &= changed - 1) {
+        int port_num = __builtin_ctz(changed);
+        hba->ports[port_num].ie = (port_mask >> port_num) & 1
+            ? HBA_PxIE_DEFAULT & ~HBA_PxIE_COMPLETION : HBA_PxIE_DEFAULT;
+    }
+    hba->ccc_pts = port_mask;
+    if (port_mask && count) {
+        hba->ccc_ctl = ((uint32_t)ccc_timeout_ms << 16) | ((uint32_t)count << 8) | HBA_CCC_EN;
+    }
+
+    ccc_ports = port_mask;
+    ccc_count = count;
+}
+
+// Coalesces a port while its queue is deep, asking for about half of
+// what is in flight so the interrupt comes while the drive still has
+// work. The shared count is the smallest any coalesced port wants.
+static void ccc_adapt(int port_num) {
+    if (ccc_mode != AHCI_CCC_ADAPTIVE) {
+        return;
+    }
+
+    ahci_port_state_t* ps = &port_state[port_num];
+    int depth = 0;
+    for (uint32_t b = ps->busy_slots; b; b &= b - 1) {
+        depth++;
+    }
+    uint32_t mask = ccc_ports & ~(1u << port_num);
+
+    ps->ccc_count = 0;
+    if (depth >= AHCI_CCC_MIN_DEPTH) {
+        uint8_t want = 1u << (31 - __builtin_clz(depth / 2));
+        ps->ccc_count = want < ccc_max_count ? want : ccc_max_count;
+        mask |= 1u << port_num;
+    }
+
+    uint8_t count = 0;
+    for (uint32_t m = mask; m; m &= m - 1) {
+        uint8_t c = port_state[__builtin_ctz(m)].ccc_count;
+        if (!count || c < count) {
+            count = c;
+        }
+    }
+    ccc_program(mask, count);
+}
+
+int ahci_set_coalescing(int mode, uint8_t count, uint16_t timeout_ms) {
+    if (!hba || !(hba->cap & HBA_CAP_CCCS) || !ahci_irq_vector) {
+        return 1;
+    }
+    if (mode != AHCI_CCC_OFF && (count == 0 || timeout_ms == 0)) {
+        return 1;
+    }
+
+    ccc_program(0, 0);
+    ccc_mode = mode;
+    if (mode == AHCI_CCC_OFF) {
+        return 0;
+    }
+
+    ccc_max_count = count;
+    ccc_timeout_ms = timeout_ms;
+    if (mode == AHCI_CCC_FIXED) {
+        uint32_t mask = 0;
+        for (int i = 0; i < port_count; i++) {
+            mask |= 1u << ports[i];
+        }
+        ccc_program(mask, count);
+    }
+    return 0;
+}
+
+void ahci_print_coalescing(void) {
+    char num_buf[12];
+
+    if (!hba) {
+        return;
+    }
+    print("AHCI coalescing: ");
+    if (!(hba->cap & HBA_CAP_CCCS)) {
+        print("not supported\n");
+        return;
+    }
+    if (!ahci_irq_vector || ccc_mode == AHCI_CCC_OFF) {
+        print(ahci_irq_vector ? "off\n" : "off, completions are polled\n");
+        return;
+    }
+
+    print(ccc_mode == AHCI_CCC_FIXED ? "fixed" : "adaptive");
+    print(", count ");
+    itoa(ccc_mode == AHCI_CCC_FIXED ? ccc_max_count : ccc_count, num_buf, 10);
+    print(num_buf);
+    if (ccc_mode == AHCI_CCC_ADAPTIVE) {
+        print(" of at most ");
+        itoa(ccc_max_count, num_buf, 10);
+        print(num_buf);
+    }
+    print(", timeout ");
+    itoa(ccc_timeout_ms, num_buf, 10);
+    print(num_buf);
+    print(" ms, ports ");
+    print_hex(ccc_ports);
+    print("\n");
+}
+
+// Moves queued commands into free slots. A command the port cannot take
+// while idle will never fit and fails straight away.
+static void port_kick(int port_num) {
+    ahci_port_state_t* ps = &port_state[port_num];
+
+    while (ps->queue_head && ps->free_slots) {
+        ahci_io_t* io = ps->queue_head;
+        int slot = ahci_issue(port_num, io);
+        if (slot == -1 && ps->busy_slots) {
+            break;
+        }
+
+        ps->queue_head = io->next;
+        if (!ps->queue_head) {
+            ps->queue_tail = NULL;
+        }
+        io->next = NULL;
+
+        if (slot == -1) {
+            io_finish(io, 1);
+            continue;
+        }
+        ps->slot_io[slot] = io;
+        ps->slot_start[slot] = timer_ticks();
+    }
+    ccc_adapt(port_num);
+}
+
+static void port_enqueue(ahci_port_state_t* ps, ahci_io_t* io, int front) {
+    if (front) {
+        io->next = ps->queue_head;
+        ps->queue_head = io;
+        if (!ps->queue_tail) ps->queue_tail = io;
+        return;
+    }
+
+    io->next = NULL;
+    if (ps->queue_tail) ps->queue_tail->next = io;
+    else ps->queue_head = io;
+    ps->queue_tail = io;
+}
+
+int ahci_queue(ahci_io_t* io) {
+    if (io->drive >= port_count || is_port_ready(io->drive)) {
+        print("Port not ready for I/O\n");
+        return 1;
+    }
+
+    int port_num = ports[io->drive];
+    io->status = -1;
+    io->retried = 0;
+    port_enqueue(&port_state[port_num], io, 0);
+    port_kick(port_num);
+    return 0;
+}
+
+// Reaps one port, fails everything outstanding once the oldest command
+// has run past the timeout, and refills the freed slots. A failed NCQ
+// command switches the port to legacy DMA and is retried once there.
+static int port_poll(int port_num) {
+    ahci_port_state_t* ps = &port_state[port_num];
+    if (!ps->busy_slots) {
+        port_kick(port_num);
+        return 0;
+    }
+
+    uint32_t done = ahci_reap(port_num);
+    if (!done) {
+        for (uint32_t b = ps->busy_slots; b; b &= b - 1) {
+            if (ahci_timed_out(ps->slot_start[__builtin_ctz(b)])) {
+                print("AHCI: Command timeout\n");
+                port_recover(port_num);
+                ps->failed_slots |= ps->busy_slots;
+                done = ps->busy_slots;
+                break;
+            }
+        }
+    }
+
+    ahci_io_t* retry = NULL;
+    int count = 0;
+    int fallback = 0;
+    for (uint32_t d = done; d; d &= d - 1) {
+        int slot = __builtin_ctz(d);
+        ahci_io_t* io = ps->slot_io[slot];
+        int failed = (ps->failed_slots >> slot) & 1;
+
+        ps->failed_slots &= ~(1u << slot);
+        ps->slot_io[slot] = NULL;
+        slot_release(ps, slot);
+        count++;
+
+        if (failed && ps->ncq && !io->retried && !io->trim && !io->flush) {
+            io->retried = 1;
+            io->next = retry;
+            retry = io;
+            fallback = 1;
+            continue;
+        }
+        io_finish(io, failed);
+    }
+
+    // Errors abort every queued command at once, so by now nothing is
+    // left in flight and the queue can be resized
+    if (fallback && !ps->busy_slots) {
+        print("AHCI: NCQ command failed, falling back to legacy DMA\n");
+        port_set_queue(ps, 1, 0);
+    }
+    while (retry) {
+        ahci_io_t* io = retry;
+        retry = io->next;
+        port_enqueue(ps, io, 1);
+    }
+
+    port_kick(port_num);
+    return count;
+}
+
+int ahci_poll(void) {
+    int count = 0;
+    for (int i = 0; i < port_count; i++) {
+        count += port_poll(ports[i]);
+    }
+    return count;
+}
+
+// Queues a set of requests, possibly spread over several drives, and
+// waits for all of them. Each port keeps its queue as full as its depth
+// allows, so drives work in parallel.
+int ahci_submit_batch(ahci_io_t* ios, int n) {
+    if (port_count == 0) {
+        print("No ports available\n");
+        return 1;
+    }
+
+    uint32_t port_mask = 0;
+    // Batches are plain reads and writes
+    for (int i = 0; i < n; i++) {
+        ios[i].done = NULL;
+        ios[i].trim = 0;
+        ios[i].flush = 0;
+        ios[i].fua = 0;
+        if (ahci_queue(&ios[i])) {
+            ios[i].status = 1;
+            continue;
+        }
+        port_mask |= 1u << ports[ios[i].drive];
+    }
+
+    int errors = 0;
+    for (int i = 0; i < n; i++) {
+        while (ios[i].status == -1) {
+            if (!ahci_poll()) {
+                ahci_sleep(port_mask);
+            }
+        }
+        errors += ios[i].status != 0;
+    }
+
+    return errors ? 1 : 0;
+}
+
+// Takes one command's worth of a scatter-gather list starting at
+// sg[*i] + *offset, bounded by the sector limit and by what fits the
+// PRDT, and moves the cursor past it. The count is cut back to whole
+// logical sectors of spl 512-byte units; 0 means not even one fits.
+// Returns the sectors taken.
+static uint32_t sg_take(const ahci_sg_t* sg, int nsg, int* i, uint32_t* offset, uint32_t max_sectors, uint32_t spl) {
+    uint32_t count = 0;
+    int prds = 0;
+
+    while (*i < nsg) {
+        uint32_t len = sg[*i].len - *offset;
+        uint32_t room = (max_sectors - count) * 512;
+        if (len > room) {
+            len = room;
+        }
+
+        uint32_t need = (len + AHCI_MAX_PRD_BYTES - 1) / AHCI_MAX_PRD_BYTES;
+        if (prds + need > AHCI_MAX_PRDS) {
+            need = AHCI_MAX_PRDS - prds;
+            len = need * AHCI_MAX_PRD_BYTES;
+        }
+
+        prds += need;
+        count += len / 512;
+        *offset += len;
+        if (*offset == sg[*i].len) {
+            (*i)++;
+            *offset = 0;
+        }
+
+        if (prds == AHCI_MAX_PRDS || count == max_sectors) {
+            break;
+        }
+    }
+
+    // Give back the tail of a logical sector the PRDT could not finish
+    uint32_t excess = (count % spl) * 512;
+    count -= count % spl;
+    while (excess) {
+        if (*offset == 0) {
+            (*i)--;
+            *offset = sg[*i].len;
+        }
+        uint32_t back = *offset < excess ? *offset : excess;
+        *offset -= back;
+        excess -= back;
+    }
+
+    return count;
+}
+
+// Splits a scatter-gather list into commands that fit both the PRDT and
+// the 16-bit sector count, and runs them in batches of up to 32.
+static int ahci_rw_sg(int drive, uint64_t lba, const ahci_sg_t* sg, int nsg, int write) {
+    ahci_port_state_t* ps = &port_state[ports[drive]];
+    ahci_io_t ios[32];
+    int n = 0;
+    int i = 0;
+    uint32_t offset = 0;
+    uint32_t total = 0;
+
+    for (int j = 0; j < nsg; j++) {
+        if (sg[j].len == 0 || (sg[j].len % 512) || ((unsigned long)sg[j].addr & 1)) {
+            print("AHCI: Bad scatter-gather segment\n");
+            return 1;
+        }
+        total += sg[j].len / 512;
+    }
+
+    // Logical sectors bigger than 512 bytes can only be moved whole
+    if ((lba % ps->spl) || (total % ps->spl)) {
+        print("AHCI: Request not aligned to the logical sector size\n");
+        return 1;
+    }
+
+    while (i < nsg) {
+        ahci_io_t* io = &ios[n];
+        io->lba = lba;
+        io->buffer = NULL;
+        io->sg = &sg[i];
+        io->nsg = nsg - i;
+        io->sg_offset = offset;
+        io->drive = drive;
+        io->write = write;
+        io->count = sg_take(sg, nsg, &i, &offset, ps->max_sectors, ps->spl);
+        if (!io->count) {
+            print("AHCI: Scatter-gather list too fragmented for the sector size\n");
+            return 1;
+        }
+
+        lba += io->count;
+        n++;
+
+        if (n == 32 || i == nsg) {
+            if (ahci_submit_batch(ios, n)) {
+                return 1;
+            }
+            n = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int ahci_rw(int drive, uint64_t lba, uint32_t count, void* buffer, int write) {
+    ahci_sg_t sg;
+    sg.addr = buffer;
+    sg.len = count * 512;
+    return ahci_rw_sg(drive, lba, &sg, 1, write);
+}
+
+void test_disk_read() {
+    if (port_count == 0) {
+        print("No drives available for testing\n");
+        return;
+    }
+    
+    print("Testing disk read...\n");
+
+    uint32_t spl = port_state[ports[0]].spl;
+    uint8_t* buffer = (uint8_t*)kmalloc(spl * 512);
+    if (!buffer) {
+        print("Failed to allocate memory for test\n");
+        return;
+    }
+
+    if (!ahci_read_sectors(0, spl, buffer)) {
+        print("Disk read test successful\n");
+
+        if (buffer[510] == 0x55 && buffer[511] == 0xAA) {
+            print("MBR signature found\n");
+        } else {
+            print("No MBR signature found\n");
+        }
+    } else {
+        print("Disk read test failed\n");
+    }
+    
+    kfree(buffer);
+}
+
+int ahci_read_sectors(uint64_t lba, uint32_t count, void* buffer) {
+    return ahci_rw(0, lba, count, buffer, 0);
+}
+
+int ahci_read_sg(uint64_t lba, const ahci_sg_t* sg, int nsg) {
+    return ahci_rw_sg(0, lba, sg, nsg, 0);
+}
+
+int ahci_write_sg(uint64_t lba, const ahci_sg_t* sg, int nsg) {
+    return ahci_rw_sg(0, lba, sg, nsg, 1);
+}
+
+int ahci_drive_count(void) {
+    return port_count;
+}
+
+int ahci_drive_port(int drive) {
+    if (drive < 0 || drive >= port_count) {
+        return -1;
+    }
+    return ports[drive];
+}
+
+int ahci_drive_queue_depth(int drive) {
+    if (drive < 0 || drive >= port_count) {
+        return 0;
+    }
+    return port_state[ports[drive]].queue_depth;
+}
+
+const ahci_device_info_t* ahci_drive_info(int drive) {
+    if (drive < 0 || drive >= port_count) {
+        return NULL;
+    }
+    return &port_state[ports[drive]].info;
+}
+
+void ahci_detect_drives() {
+    if (!hba) return;
+    
+    uint32_t pi = hba->pi;
+    port_count = 0;
+    
+    print("Checking implemented ports: ");
+    print_hex(pi);
+    print("\n");
+
+    uint64_t start = timer_us();
+    uint32_t ready = ports_bring_up(pi);
+
+    for (int i = 0; i < 32; i++) {
+        if (!(ready & (1u << i))) {
+            continue;
+        }
+
+        hba_port_t* port = &hba->ports[i];
+        int type = check_port_type(port);
+        if (type > 0) {
+            ports[port_count++] = i;
+            print("SATA drive found at port ");
+            print_hex(i);
+            print(" type: ");
+            if (type == 1) print("SATA");
+            else if (type == 2) print("SATAPI");
+            else print("Unknown");
+            print("\n");
+
+            port_init(i);
+            if (type == 1) {
+                port_identify(i);
+            }
+            port_print_info(i);
+        }
+    }
+
+    print("AHCI: Port bring-up took ");
+    print_us(timer_us() - start);
+    print("\n");
+}
+
+int try_alternative_port_init(int port_num) {
+    hba_port_t* port = &hba->ports[port_num];
+    
+    print("Trying alternative port initialization for port ");
+    print_hex(port_num);
+    print("\n");
+
+    port->cmd &= ~0x02;
+    ports_clear_cmd(1u << port_num, HBA_PxCMD_ST, HBA_PxCMD_CR);
+
+    port->serr = 0xFFFFFFFF;
+
+    // Waits for the link on the same clock and deadline as
+    // ports_bring_up rather than sleeping a fixed time
+    uint64_t start = timer_us();
+    while ((port->ssts & 0xF) != 3) {
+        if (timer_us() - start > AHCI_LINK_US) {
+            return 1;
+        }
+        asm volatile ("pause");
+    }
+
+    port->cmd |= 0x01;
+    print("Port became responsive after alternative init\n");
+    return 0;
+}
+
+int ahci_check_drive_ready(int port_num) {
+    if (port_count == 0 || port_num >= port_count) return 0;
+    
+    hba_port_t* port = &hba->ports[ports[port_num]];
+    uint32_t ssts = port->ssts;
+    uint8_t det = ssts & 0xF;
+    uint8_t ipm = (ssts >> 8) & 0xF;
+    
+    return (det == 3 && ipm == 1);
+}
+
+static void port_interrupt(int port_num) {
+    hba_port_t* port = &hba->ports[port_num];
+    uint32_t pis = port->is;
+    if (!pis) {
+        return;
+    }
+
+    port->is = pis;
+    port_state[port_num].irq_status |= pis;
+    for (int drive = 0; drive < port_count; drive++) {
+        // Drives only count once they are registered; IDENTIFY runs
+        // with interrupts already enabled
+        if (ports[drive] == port_num && ahci_drive_blkdev[drive] >= 0) {
+            iostat_interrupt(ahci_drive_blkdev[drive]);
+        }
+    }
+}
+
+static void ahci_irq(interrupt_frame_t* frame) {
+    (void)frame;
+
+    uint32_t is = hba->is;
+    for (uint32_t pending = is & ~ccc_irq_bit; pending; pending &= pending - 1) {
+        port_interrupt(__builtin_ctz(pending));
+    }
+    // The coalescing interrupt does not say which port it is for
+    if (is & ccc_irq_bit) {
+        for (uint32_t m = ccc_ports; m; m &= m - 1) {
+            port_interrupt(__builtin_ctz(m));
+        }
+    }
+    hba->is = is;
+}
+
+// Routes controller interrupts to ahci_irq, preferring MSI and falling
+// back to the legacy INTx line the firmware assigned.
+static void ahci_setup_irq(void) {
+    int vector = msi_alloc_vector(ahci_irq);
+    if (vector > 0 && !pci_enable_msi(pci_bus, pci_slot, pci_func, msi_address(), vector)) {
+        print("AHCI: Using MSI vector ");
+        print_hex(vector);
+        print("\n");
+        ahci_irq_vector = vector;
+    } else {
+        uint8_t line = pci_read_dword(pci_bus, pci_slot, pci_func, 0x3C) & 0xFF;
+        if (line >= 16) {
+            print("AHCI: No usable interrupt, polling for completion\n");
+            return;
+        }
+
+        print("AHCI: Using legacy IRQ ");
+        print_hex(line);
+        print("\n");
+        irq_install(line, ahci_irq);
+        ahci_irq_vector = IRQ_BASE_VECTOR + line;
+    }
+
+    hba->is = 0xFFFFFFFF;
+    hba->ghc |= HBA_GHC_IE;
+
+    if (hba->cap & HBA_CAP_CCCS) {
+        hba->ccc_ctl = 0;
+        ccc_irq_bit = 1u << ((hba->ccc_ctl >> 3) & 0x1F);
+        ccc_mode = AHCI_CCC_ADAPTIVE;
+    }
+}
+
+// Block layer requests are cut into commands of at most one command's
+// worth of sectors, drawn from a shared pool, and fed to ahci_queue as
+// commands complete. Each drive keeps its requests in order.
+#define AHCI_BLK_IOS 64
+#define AHCI_BLK_MAX_PIECE ((AHCI_MAX_PRDS - 1) * (AHCI_MAX_PRD_BYTES / 512))
+
+static ahci_io_t blk_ios[AHCI_BLK_IOS];
+static uint64_t blk_ios_free = ~0ULL;
+static uint64_t* blk_trim_ranges = NULL; // One 512-byte block of ranges per I/O
+static blk_request_t* blk_queue_head[32];
+static blk_request_t* blk_queue_tail[32];
+
+static void ahci_blk_finish(blk_request_t* req) {
+    if (req->inflight == 0 && req->issued == req->count) {
+        blk_complete(req);
+    }
+}
+
+static void ahci_blk_io_done(ahci_io_t* io) {
+    blk_request_t* req = io->ctx;
+    if (io->status) {
+        req->failed = 1;
+    }
+    if (io->retried) {
+        iostat_retry(req->dev);
+    }
+    req->inflight--;
+    blk_ios_free |= 1ULL << (io - blk_ios);
+    ahci_blk_finish(req);
+}
+
+static void ahci_blk_dispatch(int drive) {
+    ahci_port_state_t* ps = &port_state[ports[drive]];
+
+    while (blk_queue_head[drive]) {
+        blk_request_t* req = blk_queue_head[drive];
+
+        // Without a write cache there is nothing to flush
+        if (req->op == BLK_OP_FLUSH && !ps->info.write_cache_enabled) {
+            blk_queue_head[drive] = req->next;
+            if (!blk_queue_head[drive]) {
+                blk_queue_tail[drive] = NULL;
+            }
+            ahci_blk_finish(req);
+            continue;
+        }
+
+        if (!blk_ios_free) {
+            return;
+        }
+
+        int i = __builtin_ctzll(blk_ios_free);
+        blk_ios_free &= ~(1ULL << i);
+        ahci_io_t* io = &blk_ios[i];
+
+        uint32_t piece = req->count - req->issued;
+        uint32_t max = ps->max_sectors < AHCI_BLK_MAX_PIECE ? ps->max_sectors : AHCI_BLK_MAX_PIECE;
+        if (piece > max) {
+            piece = max;
+        }
+
+        memset(io, 0, sizeof(ahci_io_t));
+        io->lba = req->lba + req->issued;
+        if (req->op == BLK_OP_DISCARD) {
+            // A block holds 64 ranges; the piece is whatever they cover
+            uint64_t* ranges = blk_trim_ranges + (size_t)i * 64;
+            uint64_t lba = io->lba / ps->spl;
+            uint32_t left = (req->count - req->issued) / ps->spl;
+            memset(ranges, 0, 512);
+            piece = 0;
+            for (int e = 0; e < 64 && left; e++) {
+                uint32_t n = left < ATA_TRIM_RANGE_MAX ? left : ATA_TRIM_RANGE_MAX;
+                ranges[e] = lba | ((uint64_t)n << 48);
+                lba += n;
+                left -= n;
+                piece += n * ps->spl;
+            }
+            io->buffer = ranges;
+            io->trim = 1;
+        } else if (req->op == BLK_OP_FLUSH) {
+            io->flush = 1;
+            piece = 0;
+        } else if (req->sg) {
+            // Find where the previous pieces left off in the list
+            int seg = 0;
+            uint32_t offset = req->issued * 512;
+            while (offset >= req->sg[seg].len) {
+                offset -= req->sg[seg].len;
+                seg++;
+            }
+            io->sg = &req->sg[seg];
+            io->nsg = req->nsg - seg;
+            io->sg_offset = offset;
+            piece = sg_take(req->sg, req->nsg, &seg, &offset, ps->max_sectors, ps->spl);
+            if (!piece) {
+                // Not one logical sector fits the PRDT: nothing more of
+                // the request can go out
+                req->failed = 1;
+                req->issued = req->count;
+                blk_ios_free |= 1ULL << i;
+                blk_queue_head[drive] = req->next;
+                if (!blk_queue_head[drive]) {
+                    blk_queue_tail[drive] = NULL;
+                }
+                ahci_blk_finish(req);
+                continue;
+            }
+        } else {
+            io->buffer = (uint8_t*)req->buffer + (size_t)req->issued * 512;
+        }
+        io->count = io->trim ? 1 : piece;
+        io->drive = drive;
+        io->write = req->op == BLK_OP_WRITE || req->op == BLK_OP_DISCARD;
+        io->fua = req->op == BLK_OP_WRITE && (req->flags & BLK_REQ_FUA) && ps->info.fua && ps->info.lba48;
+        io->done = ahci_blk_io_done;
+        io->ctx = req;
+
+        req->issued += piece;
+        req->inflight++;
+        // Off the queue before the last piece goes out, which may finish
+        // the request straight away
+        if (req->issued == req->count) {
+            blk_queue_head[drive] = req->next;
+            if (!blk_queue_head[drive]) {
+                blk_queue_tail[drive] = NULL;
+            }
+        }
+        if (ahci_queue(io)) {
+            io->status = 1;
+            ahci_blk_io_done(io);
+        }
+    }
+}
+
+static int ahci_blk_submit(blkdev_t* dev, blk_request_t* req) {
+    int drive = dev->unit;
+    ahci_port_state_t* ps = &port_state[ports[drive]];
+
+    // Logical sectors bigger than 512 bytes can only be moved whole
+    if (req->op != BLK_OP_FLUSH &&
+        ((req->lba % ps->spl) || (req->count % ps->spl) || (!req->sg && ((unsigned long)req->buffer & 1)))) {
+        print("AHCI: Request not aligned to the logical sector size\n");
+        return 1;
+    }
+
+    if (req->sg) {
+        uint32_t total = 0;
+        for (uint32_t j = 0; j < req->nsg; j++) {
+            if (req->sg[j].len == 0 || (req->sg[j].len % 512) || ((unsigned long)req->sg[j].addr & 1)) {
+                print("AHCI: Bad scatter-gather segment\n");
+                return 1;
+            }
+            total += req->sg[j].len / 512;
+        }
+        if (total != req->count) {
+            return 1;
+        }
+    }
+
+    req->next = NULL;
+    if (blk_queue_tail[drive]) blk_queue_tail[drive]->next = req;
+    else blk_queue_head[drive] = req;
+    blk_queue_tail[drive] = req;
+
+    ahci_blk_dispatch(drive);
+    return 0;
+}
+
+static void ahci_blk_poll(blkdev_t* dev) {
+    (void)dev;
+    ahci_poll();
+    for (int i = 0; i < port_count; i++) {
+        ahci_blk_dispatch(i);
+    }
+}
+
+static int ahci_blk_ready(blkdev_t* dev) {
+    return port_state[ports[dev->unit]].irq_status != 0;
+}
+
+static const blkdev_ops_t ahci_blk_ops = {
+    .read = NULL,
+    .write = NULL,
+    .flush = NULL,
+    .discard = NULL,
+    .submit = ahci_blk_submit,
+    .poll = ahci_blk_poll,
+    .ready = ahci_blk_ready,
+};
+
+static blkdev_t ahci_blkdevs[32];
+
+static void ahci_register_blkdev(int drive) {
+    const ahci_device_info_t* info = &port_state[ports[drive]].info;
+    blkdev_t* dev = &ahci_blkdevs[drive];
+    char num_buf[12];
+
+    memset(dev, 0, sizeof(blkdev_t));
+    itoa(drive, num_buf, 10);
+    strlcpy(dev->name, "ahci", sizeof(dev->name));
+    strlcat(dev->name, num_buf, sizeof(dev->name));
+    dev->ops = &ahci_blk_ops;
+    dev->unit = drive;
+    dev->sectors = info->sectors * (info->logical_sector_size / 512);
+    dev->sector_size = info->logical_sector_size;
+    dev->physical_sector_size = info->physical_sector_size;
+    dev->alignment_offset = info->alignment_offset * (info->logical_sector_size / 512);
+    dev->queue_depth = port_state[ports[drive]].queue_depth;
+    dev->polled = ahci_irq_vector == 0;
+    dev->rotational = info->rotational;
+    dev->sg = 1;
+
+    if (info->trim && !blk_trim_ranges) {
+        blk_trim_ranges = (uint64_t*)kmalloc_aligned(AHCI_BLK_IOS * 512, 512);
+    }
+    dev->discard = info->trim && blk_trim_ranges;
+    dev->write_cache = info->write_cache_enabled;
+    dev->fua = info->fua && info->lba48;
+
+    ahci_drive_blkdev[drive] = blkdev_register(dev);
+}
+
+int ahci_drive_blkdev_id(int drive) {
+    if (drive < 0 || drive >= port_count) {
+        return -1;
+    }
+    return ahci_drive_blkdev[drive];
+}
+
+void ahci_init() {
+    print("Initializing AHCI...\n");
+
+    if (!find_ahci_controller()) {
+        print("AHCI: Controller not found\n");
+        return;
+    }
+    
+    print("AHCI: Controller found at ABAR=");
+    print_hex(abar);
+    print("\n");
+    print("AHCI Controller Details:\n");
+
+    hba = (hba_mem_t*)(unsigned long)abar;
+    uint32_t cap = hba->cap;
 
     print("Supports 64-bit addressing: "); print((cap & (1 << 31)) ? "Yes\n" : "No\n");
     print("Number of command slots: "); print_hex(((cap >> 8) & 0x1F) + 1); print("\n");
     print("Supports native command queuing: "); print((cap & (1 << 30)) ? "Yes\n" : "No\n");
     print("Supports staggered spin-up: "); print((cap & (1 << 27)) ? "Yes\n" : "No\n");
-    
-    hba = (hba_mem_t*)(uintptr_t)abar;
 
     if (hba->cap == 0 || hba->cap == 0xFFFFFFFF) {
         print("Error: Cannot read AHCI registers\n");
@@ -770,94 +1896,21 @@ void ahci_init() {
     print_hex(hba->pi);
     print("\n");
 
+    for (int i = 0; i < 32; i++) {
+        ahci_drive_blkdev[i] = -1;
+    }
+    ahci_setup_irq();
     ahci_detect_drives();
     
     if (port_count > 0) {
         print("AHCI: Initialization completed with ");
         print_hex(port_count);
         print(" drives found\n");
+        for (int i = 0; i < port_count; i++) {
+            ahci_register_blkdev(i);
+        }
         test_disk_read();
     } else {
         print("AHCI: No drives found\n");
     }
 }
-
-int is_fs_supported(uint32_t lba) {
-    uint8_t buffer[512];
-    if (!ahci_read_sectors(lba, 1, buffer)) {
-        return 0;
-    }
-
-    if (memcmp(buffer, "\x4C\x57\x53\x4F\x01\x00\x00\x00", 8) == 0) {
-        return 1;
-    }
-
-    return 0;
-}
-
-uint32_t find_fs_partition() {
-    uint8_t buffer[512];
-
-    ahci_read_sectors(0, 1, buffer);
-
-    if (buffer[510] == 0x55 && buffer[511] == 0xAA) {
-        print("Found MBR partition table\n");
-
-        for (int i = 0; i < 4; i++) {
-            uint8_t* partition_entry = buffer + 446 + i * 16;
-            uint8_t partition_type = partition_entry[4];
-
-            if (partition_type != 0) {
-                uint32_t lba = *(uint32_t*)(partition_entry + 8);
-
-                uint8_t part_buffer[512];
-                ahci_read_sectors(lba, 1, part_buffer);
-                
-                if (memcmp(part_buffer, "\x4C\x57\x53\x4F\x01\x00\x00\x00", 8) == 0) {
-                    print("Found AlwexOS filesystem at LBA: ");
-                    print_hex(lba);
-                    print("\n");
-                    return lba;
-                }
-            }
-        }
-    }
-
-    ahci_read_sectors(1, 1, buffer);
-    gpt_header_t* header = (gpt_header_t*)buffer;
-
-    if (header->signature == 0x5452415020494645ULL) {
-        print("Found GPT partition table\n");
-
-        uint32_t entry_size = header->size_of_partition_entry;
-        uint32_t num_entries = header->num_partition_entries;
-        uint32_t table_size = entry_size * num_entries;
-        uint32_t table_sectors = (table_size + 511) / 512;
-
-        uint8_t* table = kmalloc(table_sectors * 512);
-        ahci_read_sectors(header->partition_entries_lba, table_sectors, table);
-
-        for (uint32_t i = 0; i < num_entries; i++) {
-            gpt_partition_entry_t* entry = (gpt_partition_entry_t*)(table + i * entry_size);
-
-            if (entry->starting_lba == 0) continue;
-
-            uint8_t part_buffer[512];
-            ahci_read_sectors(entry->starting_lba, 1, part_buffer);
-            
-            if (memcmp(part_buffer, "\x4C\x57\x53\x4F\x01\x00\x00\x00", 8) == 0) {
-                print("Found AlwexOS filesystem at LBA: ");
-                print_hex(entry->starting_lba);
-                print("\n");
-                
-                kfree(table);
-                return entry->starting_lba;
-            }
-        }
-        
-        kfree(table);
-    }
-    
-    print("No valid partition table found\n");
-    return 0;
-}
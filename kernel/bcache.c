@@ -0,0 +1,940 @@
+#include "include/bcache.h"
+#include "include/blkdev.h"
+#include "include/lib.h"
+#include "include/mm.h"
+
+#define BCACHE_MAX_RUN 128 // sectors per backend transfer
+#define BCACHE_RA_MIN 8     // first readahead window once a stream is seen
+#define BCACHE_MAX_FETCHES 4 // asynchronous reads in flight
+#define BCACHE_SYNC_BATCH 128 // write-back requests queued before waiting
+
+typedef struct bcache_buf {
+    int dev;
+    uint64_t lba;
+    uint8_t* data;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t readahead;  // Brought in speculatively and not used yet
+    uint16_t pins;      // Mapped or being filled; off the LRU while non-zero
+    struct bcache_buf* hash_next;
+    struct bcache_buf* lru_prev;  // Towards most recently used
+    struct bcache_buf* lru_next;  // Towards least recently used
+} bcache_buf_t;
+
+typedef struct {
+    int unit;
+    bcache_io_fn read;
+    bcache_io_fn write;
+    uint64_t ra_next;    // LBA a sequential reader would ask for next
+    uint64_t ra_end;     // End of what readahead has asked for so far
+    uint32_t ra_window;  // Current readahead size in blocks, 0 = off
+    uint32_t granule;    // Blocks per physical sector, transfers cover whole ones
+    uint32_t offset;     // Blocks from a physical boundary to LBA 0
+} bcache_dev_t;
+
+// An asynchronous read, either into a private buffer or, on devices that
+// take scatter-gather lists, straight into pinned cache frames. Its
+// blocks enter the cache when the cache next looks at it after the
+// request has finished.
+typedef struct {
+    blk_request_t req;
+    uint8_t* data;
+    blk_sg_t sg[BCACHE_MAX_RUN];
+    struct bcache_buf* frames[BCACHE_MAX_RUN]; // NULL when going through data
+    uint8_t busy;
+} bcache_fetch_t;
+
+static bcache_dev_t devices[BCACHE_MAX_DEVS];
+static bcache_fetch_t fetches[BCACHE_MAX_FETCHES];
+static bcache_buf_t* bufs = NULL;
+static uint8_t* frames = NULL;     // Page aligned, one block per buffer
+static bcache_buf_t** hash_table = NULL;
+static uint32_t hash_mask = 0;
+static uint32_t buf_count = 0;
+static uint32_t dirty_count = 0;
+static bcache_buf_t* lru_head = NULL;
+static bcache_buf_t* lru_tail = NULL;
+static uint8_t* bounce = NULL;     // Readahead transfers
+static uint8_t* sync_buf = NULL;   // Write-back runs, may run during readahead
+static blk_request_t* sync_reqs = NULL;
+static bcache_buf_t** sync_owners = NULL; // Dirty block behind each write-back request
+static uint32_t sync_pending = 0;
+static uint32_t ra_max = BCACHE_RA_DEFAULT;
+
+static uint32_t stat_hits = 0;
+static uint32_t stat_misses = 0;
+static uint32_t stat_writebacks = 0;
+static uint32_t stat_evictions = 0;
+static uint32_t stat_ra_blocks = 0;
+static uint32_t stat_ra_hits = 0;
+
+static uint32_t bcache_hash(int dev, uint64_t lba) {
+    uint32_t h = (uint32_t)(lba ^ (lba >> 32)) * 2654435761u;
+    return (h ^ (uint32_t)dev * 0x9E3779B1u) & hash_mask;
+}
+
+static void lru_unlink(bcache_buf_t* b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_front(bcache_buf_t* b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (!lru_tail) lru_tail = b;
+}
+
+static void lru_push_tail(bcache_buf_t* b) {
+    b->lru_next = NULL;
+    b->lru_prev = lru_tail;
+    if (lru_tail) lru_tail->lru_next = b;
+    lru_tail = b;
+    if (!lru_head) lru_head = b;
+}
+
+static void lru_touch(bcache_buf_t* b) {
+    if (!b->pins && lru_head != b) {
+        lru_unlink(b);
+        lru_push_front(b);
+    }
+}
+
+static void hash_remove(bcache_buf_t* b) {
+    bcache_buf_t** pp = &hash_table[bcache_hash(b->dev, b->lba)];
+    while (*pp) {
+        if (*pp == b) {
+            *pp = b->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+// Pinned buffers stay out of the LRU so eviction never picks them
+static void pin(bcache_buf_t* b) {
+    if (b->pins++ == 0) {
+        lru_unlink(b);
+    }
+}
+
+static void unpin(bcache_buf_t* b) {
+    if (--b->pins == 0) {
+        if (b->valid) lru_push_front(b);
+        else lru_push_tail(b);
+    }
+}
+
+static void hash_add(bcache_buf_t* b) {
+    uint32_t h = bcache_hash(b->dev, b->lba);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+}
+
+static bcache_buf_t* lookup(int dev, uint64_t lba) {
+    bcache_buf_t* b = hash_table[bcache_hash(dev, lba)];
+    while (b) {
+        if (b->dev == dev && b->lba == lba) {
+            return b;
+        }
+        b = b->hash_next;
+    }
+    return NULL;
+}
+
+void bcache_init(size_t budget) {
+    buf_count = budget / (BCACHE_BLOCK_SIZE + sizeof(bcache_buf_t) + sizeof(bcache_buf_t*));
+    if (buf_count < 16) {
+        buf_count = 16;
+    }
+
+    uint32_t buckets = 1;
+    while (buckets < buf_count) {
+        buckets <<= 1;
+    }
+    hash_mask = buckets - 1;
+
+    bufs = (bcache_buf_t*)kcalloc(buf_count, sizeof(bcache_buf_t));
+    hash_table = (bcache_buf_t**)kcalloc(buckets, sizeof(bcache_buf_t*));
+    frames = (uint8_t*)kmalloc_aligned(buf_count * BCACHE_BLOCK_SIZE, 4096);
+    bounce = (uint8_t*)kmalloc_aligned(BCACHE_MAX_RUN * BCACHE_BLOCK_SIZE, 4096);
+    sync_buf = (uint8_t*)kmalloc_aligned(BCACHE_MAX_RUN * BCACHE_BLOCK_SIZE, 4096);
+    uint8_t* fetch_bufs = (uint8_t*)kmalloc_aligned(BCACHE_MAX_FETCHES * BCACHE_MAX_RUN * BCACHE_BLOCK_SIZE, 4096);
+    sync_reqs = (blk_request_t*)kcalloc(BCACHE_SYNC_BATCH, sizeof(blk_request_t));
+    sync_owners = (bcache_buf_t**)kcalloc(BCACHE_SYNC_BATCH, sizeof(bcache_buf_t*));
+
+    if (!bufs || !hash_table || !frames || !bounce || !sync_buf || !fetch_bufs || !sync_reqs || !sync_owners) {
+        print("Block cache: allocation failed, caching disabled\n");
+        buf_count = 0;
+        return;
+    }
+
+    for (uint32_t i = 0; i < buf_count; i++) {
+        bufs[i].data = frames + i * BCACHE_BLOCK_SIZE;
+        lru_push_front(&bufs[i]);
+    }
+    for (int i = 0; i < BCACHE_MAX_FETCHES; i++) {
+        fetches[i].data = fetch_bufs + i * BCACHE_MAX_RUN * BCACHE_BLOCK_SIZE;
+    }
+
+    print("Block cache: ");
+    print_hex(buf_count);
+    print(" blocks\n");
+}
+
+void bcache_attach(int dev, int unit, bcache_io_fn read, bcache_io_fn write) {
+    if (dev < 0 || dev >= BCACHE_MAX_DEVS) {
+        return;
+    }
+
+    devices[dev].unit = unit;
+    devices[dev].read = read;
+    devices[dev].write = write;
+    devices[dev].granule = 1;
+    devices[dev].offset = 0;
+}
+
+void bcache_set_geometry(int dev, uint32_t granule, uint32_t offset) {
+    if (dev < 0 || dev >= BCACHE_MAX_DEVS || granule == 0 || granule > BCACHE_MAX_RUN / 2) {
+        return;
+    }
+
+    devices[dev].granule = granule;
+    devices[dev].offset = offset % granule;
+}
+
+static uint64_t align_down(const bcache_dev_t* d, uint64_t lba) {
+    return lba - (lba + d->offset) % d->granule;
+}
+
+static uint64_t align_up(const bcache_dev_t* d, uint64_t lba) {
+    uint32_t rem = (lba + d->offset) % d->granule;
+    return rem ? lba + d->granule - rem : lba;
+}
+
+static int dev_io(int dev, uint64_t lba, uint32_t count, void* buffer, int write) {
+    if (dev < 0 || dev >= BCACHE_MAX_DEVS) {
+        return 1;
+    }
+
+    bcache_dev_t* d = &devices[dev];
+    bcache_io_fn fn = write ? d->write : d->read;
+    if (!fn) {
+        return 1;
+    }
+    return fn(d->unit, lba, count, buffer);
+}
+
+static void sort_by_position(bcache_buf_t** list, uint32_t n) {
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            bcache_buf_t* b = list[i];
+            uint32_t j = i;
+            while (j >= gap && (list[j - gap]->dev > b->dev ||
+                   (list[j - gap]->dev == b->dev && list[j - gap]->lba > b->lba))) {
+                list[j] = list[j - gap];
+                j -= gap;
+            }
+            list[j] = b;
+        }
+    }
+}
+
+// Waits for the queued write-back requests. Blocks whose write failed
+// are dirty again.
+static int sync_drain(void) {
+    int errors = 0;
+
+    blk_unplug();
+    for (uint32_t k = 0; k < sync_pending; k++) {
+        if (blk_wait(&sync_reqs[k]) == 0) {
+            continue;
+        }
+
+        errors++;
+        bcache_buf_t* b = sync_owners[k];
+        if (b && !b->dirty) {
+            b->dirty = 1;
+            dirty_count++;
+        }
+    }
+    sync_pending = 0;
+    return errors;
+}
+
+// Queues one block for writing straight from its cache frame; it counts
+// as clean from here on unless the write fails.
+static int sync_queue(bcache_buf_t* b) {
+    if (sync_pending == BCACHE_SYNC_BATCH) {
+        int errors = sync_drain();
+        blk_plug();
+        if (errors) {
+            return errors;
+        }
+    }
+
+    blk_request_t* req = &sync_reqs[sync_pending];
+    memset(req, 0, sizeof(blk_request_t));
+    req->dev = b->dev;
+    req->op = BLK_OP_WRITE;
+    req->lba = b->lba;
+    req->count = 1;
+    req->buffer = b->data;
+    if (blk_submit(req)) {
+        return 1;
+    }
+
+    sync_owners[sync_pending++] = b->dirty ? b : NULL;
+    if (b->dirty) {
+        b->dirty = 0;
+        dirty_count--;
+    }
+    return 0;
+}
+
+// Writes dirty blocks back, of one device or of all when dev is -1.
+// Each block goes out as its own request from its cache frame and the
+// I/O scheduler joins the ones adjacent on the device into single
+// commands.
+static int sync_blocks(int dev) {
+    if (!dirty_count) {
+        return 0;
+    }
+
+    bcache_buf_t** list = (bcache_buf_t**)kmalloc(dirty_count * sizeof(bcache_buf_t*));
+    if (!list) {
+        return 1;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < buf_count && n < dirty_count; i++) {
+        if (bufs[i].valid && bufs[i].dirty && (dev < 0 || bufs[i].dev == dev)) {
+            list[n++] = &bufs[i];
+        }
+    }
+    sort_by_position(list, n);
+
+    int errors = 0;
+    uint32_t i = 0;
+    blk_plug();
+    while (i < n) {
+        if (!list[i]->dirty) {
+            i++;
+            continue;
+        }
+
+        bcache_dev_t* d = &devices[list[i]->dev];
+        uint64_t first = list[i]->lba;
+        uint64_t start = align_down(d, first);
+        uint32_t run = 1;
+        while (i + run < n && list[i + run]->dev == list[i]->dev &&
+               list[i + run]->lba == first + run &&
+               align_up(d, first + run + 1) - start <= BCACHE_MAX_RUN) {
+            run++;
+        }
+
+        // A run that does not cover whole physical sectors is padded out
+        // with the surrounding blocks so the drive never has to
+        // read-modify-write.
+        uint64_t end = align_up(d, first + run);
+        uint32_t total = (uint32_t)(end - start);
+        int missing = 0;
+        for (uint64_t lba = start; lba < end; lba++) {
+            if ((lba < first || lba >= first + run) && !lookup(list[i]->dev, lba)) {
+                missing = 1;
+                break;
+            }
+        }
+
+        if (!missing) {
+            for (uint64_t lba = start; lba < end; lba++) {
+                bcache_buf_t* b = (lba >= first && lba < first + run) ? list[i + (lba - first)]
+                                                                    : lookup(list[i]->dev, lba);
+                errors += sync_queue(b);
+            }
+            stat_writebacks += run;
+            i += run;
+            continue;
+        }
+
+        // Blocks missing from the cache come from one read of the padded
+        // range, and the run goes out from there in one transfer
+        if (dev_io(list[i]->dev, start, total, sync_buf, 0)) {
+            errors++;
+            i += run;
+            continue;
+        }
+
+        for (uint64_t lba = start; lba < end; lba++) {
+            bcache_buf_t* b = (lba >= first && lba < first + run) ? list[i + (lba - first)]
+                                                                : lookup(list[i]->dev, lba);
+            if (b) {
+                memcpy(sync_buf + (lba - start) * BCACHE_BLOCK_SIZE, b->data, BCACHE_BLOCK_SIZE);
+            }
+        }
+
+        if (dev_io(list[i]->dev, start, total, sync_buf, 1)) {
+            errors++;
+        } else {
+            // Dirty neighbours that went out as padding are clean now too
+            for (uint64_t lba = start; lba < end; lba++) {
+                bcache_buf_t* b = lookup(list[i]->dev, lba);
+                if (b && b->dirty) {
+                    b->dirty = 0;
+                    dirty_count--;
+                }
+            }
+            stat_writebacks += run;
+        }
+        i += run;
+    }
+    errors += sync_drain();
+
+    kfree(list);
+    return errors ? 1 : 0;
+}
+
+int bcache_sync(void) {
+    return sync_blocks(-1);
+}
+
+int bcache_sync_dev(int dev) {
+    return sync_blocks(dev);
+}
+
+// Takes the least recently used block for reuse, writing its device's
+// dirty data back first.
+static bcache_buf_t* evict(void) {
+    bcache_buf_t* b = lru_tail;
+    if (!b) {
+        return NULL;
+    }
+    if (b->valid && b->dirty) {
+        bcache_sync_dev(b->dev);
+        if (b->dirty) {
+            return NULL;
+        }
+    }
+
+    if (b->valid) {
+        hash_remove(b);
+        b->valid = 0;
+        stat_evictions++;
+    }
+    return b;
+}
+
+static bcache_buf_t* insert(int dev, uint64_t lba, const void* data) {
+    bcache_buf_t* b = evict();
+    if (!b) {
+        return NULL;
+    }
+
+    b->dev = dev;
+    b->lba = lba;
+    b->valid = 1;
+    b->dirty = 0;
+    b->readahead = 0;
+    memcpy(b->data, data, BCACHE_BLOCK_SIZE);
+    hash_add(b);
+    lru_touch(b);
+    return b;
+}
+
+static int fetch_overlaps(const bcache_fetch_t* f, int dev, uint64_t lba, uint32_t count) {
+    return f->busy && f->req.dev == dev &&
+           f->req.lba < lba + count && lba < f->req.lba + f->req.count;
+}
+
+// Moves the blocks of finished fetches into the cache. Blocks that were
+// cached meanwhile are newer and stay as they are.
+static void fetch_reap(void) {
+    for (int i = 0; i < BCACHE_MAX_FETCHES; i++) {
+        bcache_fetch_t* f = &fetches[i];
+        if (!f->busy || f->req.status == BLK_PENDING) {
+            continue;
+        }
+
+        f->busy = 0;
+        if (f->req.sg) {
+            for (uint32_t j = 0; j < f->req.count; j++) {
+                bcache_buf_t* b = f->frames[j];
+                if (!f->req.status && !lookup(f->req.dev, f->req.lba + j)) {
+                    b->dev = f->req.dev;
+                    b->lba = f->req.lba + j;
+                    b->valid = 1;
+                    b->readahead = 1;
+                    hash_add(b);
+                    stat_ra_blocks++;
+                }
+                unpin(b);
+            }
+            continue;
+        }
+
+        if (f->req.status) {
+            continue;
+        }
+        for (uint32_t j = 0; j < f->req.count; j++) {
+            if (lookup(f->req.dev, f->req.lba + j)) {
+                continue;
+            }
+            bcache_buf_t* b = insert(f->req.dev, f->req.lba + j, f->data + j * BCACHE_BLOCK_SIZE);
+            if (b) {
+                b->readahead = 1;
+                stat_ra_blocks++;
+            }
+        }
+    }
+}
+
+// Waits for the fetches touching a range; count 0 means the whole device
+static void fetch_wait(int dev, uint64_t lba, uint32_t count) {
+    for (int i = 0; i < BCACHE_MAX_FETCHES; i++) {
+        bcache_fetch_t* f = &fetches[i];
+        if (f->busy && f->req.dev == dev && (count == 0 || fetch_overlaps(f, dev, lba, count))) {
+            blk_wait(&f->req);
+        }
+    }
+    fetch_reap();
+}
+
+// Gives the fetch a pinned frame for each block so the device fills the
+// cache directly. Short of frames, the fetch shrinks to whole physical
+// sectors. Returns the blocks covered.
+static uint32_t fetch_frames(bcache_fetch_t* f, const bcache_dev_t* d) {
+    uint32_t n = 0;
+    uint32_t nsg = 0;
+
+    while (n < f->req.count) {
+        bcache_buf_t* b = evict();
+        if (!b) {
+            break;
+        }
+        pin(b);
+        f->frames[n++] = b;
+
+        if (nsg && (uint8_t*)f->sg[nsg - 1].addr + f->sg[nsg - 1].len == b->data) {
+            f->sg[nsg - 1].len += BCACHE_BLOCK_SIZE;
+        } else {
+            f->sg[nsg].addr = b->data;
+            f->sg[nsg].len = BCACHE_BLOCK_SIZE;
+            nsg++;
+        }
+    }
+
+    if (n < f->req.count) {
+        // Drop the frames past the last whole physical sector
+        uint32_t keep = (uint32_t)(align_down(d, f->req.lba + n) - f->req.lba);
+        while (n > keep) {
+            bcache_buf_t* b = f->frames[--n];
+            unpin(b);
+            if (f->sg[nsg - 1].len == BCACHE_BLOCK_SIZE) nsg--;
+            else f->sg[nsg - 1].len -= BCACHE_BLOCK_SIZE;
+        }
+    }
+
+    f->req.count = n;
+    f->req.sg = n ? f->sg : NULL;
+    f->req.nsg = nsg;
+    return n;
+}
+
+static void fetch_release(bcache_fetch_t* f) {
+    for (uint32_t j = 0; j < f->req.count; j++) {
+        unpin(f->frames[j]);
+    }
+    f->req.sg = NULL;
+}
+
+static bcache_fetch_t* fetch_get(void) {
+    fetch_reap();
+    for (int i = 0; i < BCACHE_MAX_FETCHES; i++) {
+        if (!fetches[i].busy) {
+            return &fetches[i];
+        }
+    }
+
+    // All in flight: the first one is as good as any to wait for
+    blk_wait(&fetches[0].req);
+    fetch_reap();
+    return &fetches[0];
+}
+
+// Starts reading the uncached parts of a range in physical-sector
+// aligned pieces and returns without waiting. Asking for more than half
+// the cache would only evict the start of the range before it is used.
+int bcache_prefetch(int dev, uint64_t lba, uint32_t count) {
+    if (!buf_count || dev < 0 || dev >= BCACHE_MAX_DEVS) {
+        return 0;
+    }
+
+    blkdev_t* bd = blkdev_get(dev);
+    if (!bd) {
+        return 1;
+    }
+    if (count > buf_count / 2) {
+        count = buf_count / 2;
+    }
+
+    bcache_dev_t* d = &devices[dev];
+    uint64_t limit = lba + count;
+    if (bd->sectors && limit > bd->sectors) {
+        limit = bd->sectors;
+    }
+
+    fetch_reap();
+    uint64_t pos = lba;
+    while (pos < limit) {
+        int pending = 0;
+        for (int i = 0; i < BCACHE_MAX_FETCHES && !pending; i++) {
+            pending = fetch_overlaps(&fetches[i], dev, pos, 1);
+        }
+        if (pending || lookup(dev, pos)) {
+            pos++;
+            continue;
+        }
+
+        uint64_t start = align_down(d, pos);
+        uint64_t end = align_up(d, limit);
+        if (end - start > BCACHE_MAX_RUN) {
+            end = align_down(d, start + BCACHE_MAX_RUN);
+        }
+        if (bd->sectors && end > bd->sectors) {
+            end = bd->sectors;
+        }
+
+        bcache_fetch_t* f = fetch_get();
+        memset(&f->req, 0, sizeof(blk_request_t));
+        f->req.dev = dev;
+        f->req.op = BLK_OP_READ;
+        f->req.lba = start;
+        f->req.count = (uint32_t)(end - start);
+        f->req.buffer = f->data;
+        if (bd->sg) {
+            end = start + fetch_frames(f, d);
+            if (end == start) {
+                return 1;
+            }
+        }
+        if (blk_submit(&f->req)) {
+            if (f->req.sg) {
+                fetch_release(f);
+            }
+            return 1;
+        }
+        f->busy = 1;
+        pos = end;
+    }
+
+    return 0;
+}
+
+void bcache_set_readahead(uint32_t max_blocks) {
+    ra_max = max_blocks > BCACHE_MAX_RUN ? BCACHE_MAX_RUN : max_blocks;
+}
+
+// Grows the device's readahead window while reads keep starting where
+// the previous read ended, and drops it on the first random access.
+static uint32_t readahead_window(bcache_dev_t* d, uint64_t lba) {
+    if (lba != d->ra_next || ra_max == 0) {
+        d->ra_window = 0;
+    } else if (d->ra_window == 0) {
+        d->ra_window = BCACHE_RA_MIN < ra_max ? BCACHE_RA_MIN : ra_max;
+    } else {
+        d->ra_window = d->ra_window * 2 > ra_max ? ra_max : d->ra_window * 2;
+    }
+    return d->ra_window;
+}
+
+// Keeps a sequential reader ahead of itself: once the stream comes
+// within half a window of what has been asked for, the next window is
+// fetched in the background.
+static void readahead(int dev, bcache_dev_t* d, uint64_t next) {
+    if (d->ra_window == 0) {
+        d->ra_end = 0;
+        return;
+    }
+
+    if (d->ra_end < next) {
+        d->ra_end = next;
+    }
+    if (next + d->ra_window / 2 < d->ra_end) {
+        return;
+    }
+
+    uint64_t target = next + d->ra_window;
+    if (target > d->ra_end) {
+        bcache_prefetch(dev, d->ra_end, (uint32_t)(target - d->ra_end));
+        d->ra_end = target;
+    }
+}
+
+int bcache_read(int dev, uint64_t lba, uint32_t count, void* buffer) {
+    uint8_t* out = (uint8_t*)buffer;
+
+    if (!buf_count || dev < 0 || dev >= BCACHE_MAX_DEVS) {
+        return dev_io(dev, lba, count, buffer, 0);
+    }
+
+    bcache_dev_t* d = &devices[dev];
+    readahead_window(d, lba);
+    fetch_reap();
+
+    uint32_t i = 0;
+    while (i < count) {
+        bcache_buf_t* b = lookup(dev, lba + i);
+        if (b) {
+            memcpy(out + i * BCACHE_BLOCK_SIZE, b->data, BCACHE_BLOCK_SIZE);
+            lru_touch(b);
+            stat_hits++;
+            if (b->readahead) {
+                b->readahead = 0;
+                stat_ra_hits++;
+            }
+            i++;
+            continue;
+        }
+
+        // Already on its way: wait for the fetch rather than read twice
+        int pending = 0;
+        for (int k = 0; k < BCACHE_MAX_FETCHES && !pending; k++) {
+            pending = fetch_overlaps(&fetches[k], dev, lba + i, 1);
+        }
+        if (pending) {
+            fetch_wait(dev, lba + i, 1);
+            if (lookup(dev, lba + i)) {
+                continue;
+            }
+        }
+
+        uint32_t run = 1;
+        while (i + run < count && run < BCACHE_MAX_RUN && !lookup(dev, lba + i + run)) {
+            run++;
+        }
+
+        uint8_t* dst = out + i * BCACHE_BLOCK_SIZE;
+        uint64_t first = lba + i;
+
+        // Transfers start and end on physical sector boundaries
+        uint64_t start = align_down(d, first);
+        uint64_t end = align_up(d, first + run);
+        if (end - start > BCACHE_MAX_RUN) {
+            end = align_down(d, start + BCACHE_MAX_RUN);
+            run = (uint32_t)(end - first);
+        }
+
+        if (start == first && end == first + run) {
+            if (dev_io(dev, first, run, dst, 0)) {
+                return 1;
+            }
+
+            for (uint32_t j = 0; j < run; j++) {
+                insert(dev, first + j, dst + j * BCACHE_BLOCK_SIZE);
+            }
+        } else {
+            // The padding around an unaligned request comes in through
+            // the bounce buffer and is cached as well
+            if (dev_io(dev, start, (uint32_t)(end - start), bounce, 0)) {
+                return 1;
+            }
+
+            memcpy(dst, bounce + (first - start) * BCACHE_BLOCK_SIZE, run * BCACHE_BLOCK_SIZE);
+            for (uint64_t pos = start; pos < end; pos++) {
+                if (lookup(dev, pos)) {
+                    continue;
+                }
+                b = insert(dev, pos, bounce + (pos - start) * BCACHE_BLOCK_SIZE);
+                if (b && (pos < first || pos >= first + run)) {
+                    b->readahead = 1;
+                    stat_ra_blocks++;
+                }
+            }
+        }
+
+        stat_misses += run;
+        i += run;
+    }
+
+    d->ra_next = lba + count;
+    readahead(dev, d, lba + count);
+    return 0;
+}
+
+// Pins one block in the cache and returns its frame. A miss on a device
+// without padding is read by the device straight into the frame.
+const uint8_t* bcache_map(int dev, uint64_t lba) {
+    if (!buf_count || dev < 0 || dev >= BCACHE_MAX_DEVS) {
+        return NULL;
+    }
+
+    bcache_dev_t* d = &devices[dev];
+    fetch_reap();
+    bcache_buf_t* b = lookup(dev, lba);
+    if (!b) {
+        fetch_wait(dev, lba, 1);
+        b = lookup(dev, lba);
+    }
+
+    if (b) {
+        lru_touch(b);
+        stat_hits++;
+        if (b->readahead) {
+            b->readahead = 0;
+            stat_ra_hits++;
+        }
+        pin(b);
+        return b->data;
+    }
+
+    if (d->granule > 1) {
+        // Padding has to come along, the ordinary read path handles that
+        uint8_t block[BCACHE_BLOCK_SIZE];
+        if (bcache_read(dev, lba, 1, block) || !(b = lookup(dev, lba))) {
+            return NULL;
+        }
+        pin(b);
+        return b->data;
+    }
+
+    b = evict();
+    if (!b) {
+        return NULL;
+    }
+    pin(b);
+    if (dev_io(dev, lba, 1, b->data, 0)) {
+        unpin(b);
+        return NULL;
+    }
+
+    b->dev = dev;
+    b->lba = lba;
+    b->valid = 1;
+    b->dirty = 0;
+    b->readahead = 0;
+    hash_add(b);
+    stat_misses++;
+    return b->data;
+}
+
+void bcache_unmap(const void* data) {
+    if (!data || !frames) {
+        return;
+    }
+
+    uint32_t index = (uint32_t)(((const uint8_t*)data - frames) / BCACHE_BLOCK_SIZE);
+    if (index < buf_count && bufs[index].pins) {
+        unpin(&bufs[index]);
+    }
+}
+
+int bcache_write(int dev, uint64_t lba, uint32_t count, const void* buffer) {
+    const uint8_t* in = (const uint8_t*)buffer;
+
+    if (!buf_count) {
+        return dev_io(dev, lba, count, (void*)buffer, 1);
+    }
+
+    // A fetch finishing later must not bring back what this replaces
+    fetch_wait(dev, lba, count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t* b = lookup(dev, lba + i);
+        if (b) {
+            memcpy(b->data, in + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+            lru_touch(b);
+        } else {
+            b = insert(dev, lba + i, in + i * BCACHE_BLOCK_SIZE);
+            if (!b) {
+                return dev_io(dev, lba + i, count - i, (void*)(in + i * BCACHE_BLOCK_SIZE), 1);
+            }
+        }
+
+        if (!b->dirty) {
+            b->dirty = 1;
+            dirty_count++;
+        }
+    }
+
+    // Keep enough clean blocks around that reads rarely wait on write-back.
+    // Only the writer's own device is synced, so other devices never
+    // wait on it.
+    if (dirty_count > buf_count / 2) {
+        return bcache_sync_dev(dev);
+    }
+    return 0;
+}
+
+static void drop(bcache_buf_t* b) {
+    if (b->dirty) {
+        dirty_count--;
+    }
+    hash_remove(b);
+    b->valid = 0;
+    b->dirty = 0;
+    if (!b->pins) {
+        lru_unlink(b);
+        lru_push_tail(b);
+    }
+}
+
+void bcache_invalidate(int dev) {
+    fetch_wait(dev, 0, 0);
+    devices[dev].ra_end = 0;
+    for (uint32_t i = 0; i < buf_count; i++) {
+        bcache_buf_t* b = &bufs[i];
+        if (b->valid && b->dev == dev) {
+            drop(b);
+        }
+    }
+}
+
+void bcache_drop(int dev, uint64_t lba, uint32_t count) {
+    if (dev < 0 || dev >= BCACHE_MAX_DEVS || !bufs) {
+        return;
+    }
+
+    fetch_wait(dev, lba, count);
+    if (count > buf_count) {
+        for (uint32_t i = 0; i < buf_count; i++) {
+            bcache_buf_t* b = &bufs[i];
+            if (b->valid && b->dev == dev && b->lba >= lba && b->lba < lba + count) {
+                drop(b);
+            }
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        bcache_buf_t* b = lookup(dev, lba + i);
+        if (b) {
+            drop(b);
+        }
+    }
+}
+
+void bcache_print_stats(void) {
+    print("Block cache: hits ");
+    print_hex(stat_hits);
+    print(", misses ");
+    print_hex(stat_misses);
+    print(", evictions ");
+    print_hex(stat_evictions);
+    print(", written back ");
+    print_hex(stat_writebacks);
+    print(", dirty ");
+    print_hex(dirty_count);
+    print("\n");
+    print("Readahead: window max ");
+    print_hex(ra_max);
+    print(", blocks read ahead ");
+    print_hex(stat_ra_blocks);
+    print(", used ");
+    print_hex(stat_ra_hits);
+    print("\n");
+}
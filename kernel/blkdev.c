@@ -0,0 +1,592 @@
+#include "include/blkdev.h"
+#include "include/bcache.h"
+#include "include/iosched.h"
+#include "include/iostat.h"
+#include "include/timer.h"
+#include "include/lib.h"
+#include "include/idt.h"
+
+static blkdev_t* devices[BLKDEV_MAX];
+static int device_count = 0;
+
+static blk_request_t pool[BLK_POOL_SIZE];
+static uint64_t pool_free = ~0ULL;
+
+// Finished requests whose callbacks have not run yet
+static blk_request_t* done_head = NULL;
+static blk_request_t* done_tail = NULL;
+static int draining = 0;
+static int plugged = 0;
+static uint32_t next_seq = 0;
+static int outstanding = 0;
+static uint32_t completed = 0;
+static int failed_since_wait = 0;
+
+// Freed ranges waiting to be sent, per device
+typedef struct {
+    uint64_t lba;
+    uint32_t count;
+} blk_range_t;
+
+static blk_range_t discards[BLKDEV_MAX][BLK_DISCARD_BATCH];
+static int discard_count[BLKDEV_MAX];
+
+// The block cache addresses devices by number; the registry id doubles
+// as that number and as the cache's unit argument.
+static int cache_read(int unit, uint64_t lba, uint32_t count, void* buffer) {
+    return blk_read_direct(unit, lba, count, buffer);
+}
+
+static int cache_write(int unit, uint64_t lba, uint32_t count, void* buffer) {
+    return blk_write_direct(unit, lba, count, buffer);
+}
+
+int blkdev_register(blkdev_t* dev) {
+    if (device_count >= BLKDEV_MAX || device_count >= BCACHE_MAX_DEVS || !dev->ops) {
+        print("Block devices: registry full\n");
+        return -1;
+    }
+
+    if (dev->sector_size < 512) dev->sector_size = 512;
+    if (dev->physical_sector_size < dev->sector_size) dev->physical_sector_size = dev->sector_size;
+    if (dev->queue_depth == 0) dev->queue_depth = 1;
+    if (dev->ops->discard) dev->discard = 1;
+
+    dev->id = device_count;
+    dev->inflight = 0;
+    dev->dispatched = 0;
+    devices[device_count++] = dev;
+    iosched_attach(dev);
+
+    bcache_attach(dev->id, dev->id, cache_read, cache_write);
+    bcache_set_geometry(dev->id, dev->physical_sector_size / 512, dev->alignment_offset);
+    return dev->id;
+}
+
+int blkdev_count(void) {
+    return device_count;
+}
+
+blkdev_t* blkdev_get(int id) {
+    if (id < 0 || id >= device_count) {
+        return NULL;
+    }
+    return devices[id];
+}
+
+int blkdev_find(const char* name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int blkdev_read(int id, uint64_t lba, uint32_t count, void* buffer) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+    return bcache_read(id, lba, count, buffer);
+}
+
+int blkdev_write(int id, uint64_t lba, uint32_t count, const void* buffer) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+    return bcache_write(id, lba, count, buffer);
+}
+
+int blkdev_prefetch(int id, uint64_t lba, uint32_t count) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+    return bcache_prefetch(id, lba, count);
+}
+
+const void* blkdev_map(int id, uint64_t lba) {
+    if (id < 0 || id >= device_count) {
+        return NULL;
+    }
+    return bcache_map(id, lba);
+}
+
+void blkdev_unmap(const void* data) {
+    bcache_unmap(data);
+}
+
+// Completion of requests nobody waits for. A failed discard costs the
+// device some wear levelling; a failed barrier leaves the device marked
+// unflushed, so the next fsync flushes again.
+static void async_done(blk_request_t* req) {
+    (void)req;
+}
+
+// Sends the collected ranges, each shrunk to whole physical sectors.
+// Ranges the request pool cannot take are dropped for the same reason.
+static void discard_send(int id) {
+    blkdev_t* dev = devices[id];
+    uint32_t granule = dev->physical_sector_size / 512;
+    uint32_t offset = dev->alignment_offset % granule;
+
+    for (int i = 0; i < discard_count[id]; i++) {
+        uint64_t start = discards[id][i].lba;
+        uint64_t end = start + discards[id][i].count;
+        uint32_t rem = (start + offset) % granule;
+        if (rem) {
+            start += granule - rem;
+        }
+        end -= (end + offset) % granule;
+        if (end > start) {
+            blk_submit_discard(id, start, (uint32_t)(end - start), async_done, NULL);
+        }
+    }
+    discard_count[id] = 0;
+}
+
+static int flush_wait(int id) {
+    blk_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.dev = id;
+    req.op = BLK_OP_FLUSH;
+    return blk_submit(&req) || blk_wait(&req);
+}
+
+int blkdev_flush(int id) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+
+    discard_send(id);
+    int errors = bcache_sync_dev(id);
+    if (flush_wait(id)) {
+        errors++;
+    }
+    return errors ? 1 : 0;
+}
+
+int blkdev_fsync(int id) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+
+    int errors = bcache_sync_dev(id);
+    if (devices[id]->write_cache && devices[id]->unflushed && flush_wait(id)) {
+        errors++;
+    }
+    return errors ? 1 : 0;
+}
+
+int blkdev_barrier(int id) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+
+    int errors = bcache_sync_dev(id);
+    if (!blk_submit_flush(id, async_done, NULL)) {
+        // No request to spare: wait for the flush instead
+        errors += flush_wait(id);
+    }
+    return errors ? 1 : 0;
+}
+
+int blkdev_write_fua(int id, uint64_t lba, uint32_t count, const void* buffer) {
+    if (id < 0 || id >= device_count) {
+        return 1;
+    }
+
+    blkdev_t* dev = devices[id];
+    bcache_drop(id, lba, count);
+
+    blk_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.dev = id;
+    req.op = BLK_OP_WRITE;
+    req.flags = BLK_REQ_FUA;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = (void*)buffer;
+    if (blk_submit(&req) || blk_wait(&req)) {
+        return 1;
+    }
+    if (!dev->fua && dev->write_cache) {
+        return flush_wait(id);
+    }
+    return 0;
+}
+
+int blkdev_discard(int id, uint64_t lba, uint32_t count) {
+    if (id < 0 || id >= device_count || count == 0) {
+        return 1;
+    }
+
+    blkdev_t* dev = devices[id];
+    if (dev->sectors && lba + count > dev->sectors) {
+        return 1;
+    }
+
+    bcache_drop(id, lba, count);
+    if (!dev->discard) {
+        return 0;
+    }
+
+    // Ranges freed one after another usually touch
+    blk_range_t* ranges = discards[id];
+    for (int i = 0; i < discard_count[id]; i++) {
+        if (ranges[i].lba + ranges[i].count == lba && (uint64_t)ranges[i].count + count <= 0xFFFFFFFF) {
+            ranges[i].count += count;
+            return 0;
+        }
+        if (lba + count == ranges[i].lba && (uint64_t)ranges[i].count + count <= 0xFFFFFFFF) {
+            ranges[i].lba = lba;
+            ranges[i].count += count;
+            return 0;
+        }
+    }
+
+    if (discard_count[id] == BLK_DISCARD_BATCH) {
+        discard_send(id);
+    }
+    ranges[discard_count[id]].lba = lba;
+    ranges[discard_count[id]].count = count;
+    discard_count[id]++;
+    return 0;
+}
+
+void blkdev_print_list(void) {
+    char num_buf[12];
+
+    if (device_count == 0) {
+        print("No block devices\n");
+        return;
+    }
+
+    for (int i = 0; i < device_count; i++) {
+        blkdev_t* dev = devices[i];
+        itoa(i, num_buf, 10);
+        print(num_buf);
+        print(": ");
+        print(dev->name);
+        print(", ");
+        itoa((int)(dev->sectors / 2048), num_buf, 10);
+        print(num_buf);
+        print(" MiB, sectors ");
+        itoa((int)dev->sector_size, num_buf, 10);
+        print(num_buf);
+        print("/");
+        itoa((int)dev->physical_sector_size, num_buf, 10);
+        print(num_buf);
+        print(", queue depth ");
+        itoa((int)dev->queue_depth, num_buf, 10);
+        print(num_buf);
+        print(", ");
+        print(iosched_policy_name(iosched_policy(i)));
+        if (dev->ops->flush || dev->ops->submit) print(", flush");
+        if (dev->discard) print(", discard");
+        print("\n");
+    }
+}
+
+static blk_request_t* pool_get(void) {
+    if (!pool_free) {
+        return NULL;
+    }
+
+    int i = __builtin_ctzll(pool_free);
+    pool_free &= ~(1ULL << i);
+    memset(&pool[i], 0, sizeof(blk_request_t));
+    pool[i].pooled = 1;
+    return &pool[i];
+}
+
+void blk_release(blk_request_t* req) {
+    if (req && req->pooled) {
+        req->pooled = 0;
+        pool_free |= 1ULL << (req - pool);
+    }
+}
+
+// Hands a command from the scheduler to the driver. A driver that
+// refuses it completes it as failed.
+static void driver_submit(blkdev_t* dev, blk_request_t* cmd) {
+    cmd->issued = 0;
+    cmd->inflight = 0;
+    cmd->failed = 0;
+    cmd->next = NULL;
+    dev->dispatched++;
+    iostat_depth(dev);
+    if (cmd->op == BLK_OP_FLUSH) {
+        dev->unflushed = 0;
+    }
+
+    if (dev->ops->submit) {
+        if (dev->ops->submit(dev, cmd)) {
+            cmd->failed = 1;
+            blk_complete(cmd);
+        }
+        return;
+    }
+
+    // Synchronous driver: the transfer happens now, the callback still
+    // runs from blk_poll like everybody else's
+    int err = 0;
+    if (cmd->op == BLK_OP_READ) {
+        err = dev->ops->read(dev, cmd->lba, cmd->count, cmd->buffer);
+    } else if (cmd->op == BLK_OP_WRITE) {
+        err = dev->ops->write(dev, cmd->lba, cmd->count, cmd->buffer);
+    } else if (cmd->op == BLK_OP_DISCARD) {
+        err = dev->ops->discard ? dev->ops->discard(dev, cmd->lba, cmd->count) : 0;
+    } else if (dev->ops->flush) {
+        err = dev->ops->flush(dev);
+    }
+    cmd->failed = err != 0;
+    blk_complete(cmd);
+}
+
+// Feeds the driver from the scheduler while it has room
+static void dispatch(blkdev_t* dev) {
+    blk_request_t* cmd;
+    while (dev->dispatched < dev->queue_depth && (cmd = iosched_next(dev))) {
+        driver_submit(dev, cmd);
+    }
+}
+
+void blk_plug(void) {
+    plugged++;
+}
+
+void blk_unplug(void) {
+    if (plugged > 0 && --plugged == 0) {
+        for (int i = 0; i < device_count; i++) {
+            dispatch(devices[i]);
+        }
+    }
+}
+
+int blk_submit(blk_request_t* req) {
+    blkdev_t* dev = blkdev_get(req->dev);
+    if (!dev) {
+        return 1;
+    }
+
+    if (req->op != BLK_OP_FLUSH &&
+        (req->count == 0 || (dev->sectors && req->lba + req->count > dev->sectors))) {
+        return 1;
+    }
+
+    if ((req->sg && !dev->sg) || (req->op == BLK_OP_DISCARD && !dev->discard)) {
+        return 1;
+    }
+
+    // New data for a range freed earlier must land after its discard
+    if (req->op == BLK_OP_WRITE) {
+        for (int i = 0; i < discard_count[req->dev]; i++) {
+            const blk_range_t* r = &discards[req->dev][i];
+            if (r->lba < req->lba + req->count && req->lba < r->lba + r->count) {
+                discard_send(req->dev);
+                break;
+            }
+        }
+    }
+
+    req->status = BLK_PENDING;
+    req->failed = 0;
+    req->merged = 0;
+    req->next = NULL;
+    req->seq = next_seq++;
+    req->submitted_us = timer_us();
+    dev->inflight++;
+    outstanding++;
+    iostat_depth(dev);
+
+    iosched_add(dev, req);
+    if (!plugged) {
+        dispatch(dev);
+    }
+    return 0;
+}
+
+static blk_request_t* submit_pooled(int id, uint8_t op, uint64_t lba, uint32_t count, void* buffer,
+                                    blk_done_fn done, void* ctx) {
+    blk_request_t* req = pool_get();
+    if (!req) {
+        return NULL;
+    }
+
+    req->dev = id;
+    req->op = op;
+    req->lba = lba;
+    req->count = count;
+    req->buffer = buffer;
+    req->done = done;
+    req->ctx = ctx;
+    if (blk_submit(req)) {
+        blk_release(req);
+        return NULL;
+    }
+    return req;
+}
+
+blk_request_t* blk_submit_read(int id, uint64_t lba, uint32_t count, void* buffer, blk_done_fn done, void* ctx) {
+    return submit_pooled(id, BLK_OP_READ, lba, count, buffer, done, ctx);
+}
+
+blk_request_t* blk_submit_write(int id, uint64_t lba, uint32_t count, const void* buffer, blk_done_fn done, void* ctx) {
+    return submit_pooled(id, BLK_OP_WRITE, lba, count, (void*)buffer, done, ctx);
+}
+
+blk_request_t* blk_submit_flush(int id, blk_done_fn done, void* ctx) {
+    return submit_pooled(id, BLK_OP_FLUSH, 0, 0, NULL, done, ctx);
+}
+
+blk_request_t* blk_submit_discard(int id, uint64_t lba, uint32_t count, blk_done_fn done, void* ctx) {
+    return submit_pooled(id, BLK_OP_DISCARD, lba, count, NULL, done, ctx);
+}
+
+static void request_done(blkdev_t* dev, blk_request_t* req, uint64_t now) {
+    dev->inflight--;
+    outstanding--;
+    completed++;
+    if (req->failed) {
+        failed_since_wait++;
+    }
+    iostat_done(req, now - req->submitted_us);
+    req->status = req->failed ? 1 : 0;
+    if ((req->op == BLK_OP_WRITE && !req->failed && !(dev->fua && (req->flags & BLK_REQ_FUA))) ||
+        (req->op == BLK_OP_FLUSH && req->failed)) {
+        dev->unflushed = 1;
+    }
+
+    if (req->done) {
+        req->next = NULL;
+        if (done_tail) done_tail->next = req;
+        else done_head = req;
+        done_tail = req;
+    }
+}
+
+void blk_complete(blk_request_t* cmd) {
+    blkdev_t* dev = devices[cmd->dev];
+    dev->dispatched--;
+
+    blk_request_t* req = iosched_finish(cmd);
+    uint64_t now = timer_us();
+    uint32_t requests = 0;
+    while (req) {
+        blk_request_t* next = req->sched_next;
+        request_done(dev, req, now);
+        requests++;
+        req = next;
+    }
+    if (requests > 1) {
+        iostat_merged(dev->id, requests - 1);
+    }
+}
+
+int blk_poll(void) {
+    uint32_t before = completed;
+
+    for (int i = 0; i < device_count; i++) {
+        blkdev_t* dev = devices[i];
+        if (dev->dispatched && dev->ops->poll) {
+            dev->ops->poll(dev);
+        }
+        dispatch(dev);
+    }
+
+    // Callbacks may wait for I/O themselves; those nested polls only
+    // move the drivers along and leave the list to this loop
+    if (!draining) {
+        draining = 1;
+        while (done_head) {
+            blk_request_t* req = done_head;
+            done_head = req->next;
+            if (!done_head) done_tail = NULL;
+            req->done(req);
+            blk_release(req);
+        }
+        draining = 0;
+    }
+
+    return (int)(completed - before);
+}
+
+// Halts until the next interrupt unless a device can only be polled,
+// already has completions waiting or has work the scheduler still holds.
+static void blk_idle(void) {
+    interrupts_disable();
+    int spin = 0;
+    for (int i = 0; i < device_count && !spin; i++) {
+        blkdev_t* dev = devices[i];
+        if (!dev->inflight) {
+            continue;
+        }
+        if (!dev->dispatched || dev->polled || (dev->ops->ready && dev->ops->ready(dev))) {
+            spin = 1;
+        }
+    }
+
+    if (spin) {
+        interrupts_enable();
+        asm volatile ("pause");
+    } else {
+        asm volatile ("sti; hlt" ::: "memory");
+    }
+}
+
+int blk_wait(blk_request_t* req) {
+    // A pooled handle with a callback goes back to the pool once the
+    // callback has run, so it may be reused before this could look at it
+    if (req->pooled && req->done) {
+        return 1;
+    }
+
+    while (req->status == BLK_PENDING) {
+        blk_poll();
+        if (req->status == BLK_PENDING) {
+            blk_idle();
+        }
+    }
+
+    int status = req->status;
+    if (!req->done) {
+        blk_release(req);
+    }
+    return status;
+}
+
+int blk_wait_all(void) {
+    while (outstanding > 0) {
+        blk_poll();
+        if (outstanding > 0) {
+            blk_idle();
+        }
+    }
+    blk_poll();
+
+    int failed = failed_since_wait;
+    failed_since_wait = 0;
+    return failed;
+}
+
+static int blk_direct(int id, uint8_t op, uint64_t lba, uint32_t count, void* buffer) {
+    blk_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.dev = id;
+    req.op = op;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = buffer;
+    if (blk_submit(&req)) {
+        return 1;
+    }
+    return blk_wait(&req);
+}
+
+int blk_read_direct(int id, uint64_t lba, uint32_t count, void* buffer) {
+    return blk_direct(id, BLK_OP_READ, lba, count, buffer);
+}
+
+int blk_write_direct(int id, uint64_t lba, uint32_t count, const void* buffer) {
+    return blk_direct(id, BLK_OP_WRITE, lba, count, (void*)buffer);
+}
@@ -0,0 +1,275 @@
+#include "include/diskbench.h"
+#include "include/blkdev.h"
+#include "include/bcache.h"
+#include "include/part.h"
+#include "include/fs.h"
+#include "include/lib.h"
+#include "include/mm.h"
+#include "include/timer.h"
+#include "include/iostat.h"
+
+typedef struct {
+    blk_request_t req;
+    uint64_t start_us;
+    uint8_t active;
+} bench_slot_t;
+
+typedef struct {
+    lat_hist_t latency;
+    uint64_t bytes;
+    uint32_t errors;
+    uint64_t elapsed_us;
+} bench_result_t;
+
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int ranges_overlap(uint64_t a, uint64_t a_end, uint64_t b, uint64_t b_end) {
+    return a < b_end && b < a_end;
+}
+
+// Returns the reason the scratch range must not be written, or NULL
+static const char* scratch_in_use(int dev, uint64_t start, uint64_t end) {
+    // Without a scanned table nothing is known about what the device holds
+    if (!part_scanned(dev)) {
+        return "unknown data, the partition table was never scanned";
+    }
+
+    int fs_dev;
+    uint32_t fs_lba, fs_sectors;
+    if (fs_location(&fs_dev, &fs_lba, &fs_sectors) && fs_dev == dev &&
+        ranges_overlap(start, end, fs_lba, (uint64_t)fs_lba + fs_sectors)) {
+        return "the file system";
+    }
+
+    for (int i = 0; i < part_count(dev); i++) {
+        const partition_t* p = part_get(dev, i);
+        if (ranges_overlap(start, end, p->start_lba, p->end_lba + 1)) {
+            return "a partition";
+        }
+    }
+    return NULL;
+}
+
+static void slot_submit(bench_slot_t* s, int dev, uint8_t op, uint64_t lba, uint32_t block,
+                        bench_result_t* r) {
+    s->req.dev = dev;
+    s->req.op = op;
+    s->req.lba = lba;
+    s->req.count = block;
+    s->req.done = NULL;
+    s->start_us = timer_us();
+    s->active = blk_submit(&s->req) == 0;
+    if (!s->active) {
+        r->errors++;
+    }
+}
+
+// Keeps qd requests in flight until the time is up. Sequential tests
+// walk the scratch range and wrap; random ones pick block-aligned
+// offsets in it.
+static void bench_one(int dev, uint8_t op, int random, uint64_t start, uint64_t span, uint32_t block,
+                      bench_slot_t* slots, uint32_t qd, uint32_t seconds, bench_result_t* r) {
+    uint64_t blocks = span / block;
+    uint64_t next = 0;
+
+    memset(r, 0, sizeof(bench_result_t));
+    uint64_t t0 = timer_us();
+    uint64_t stop = t0 + (uint64_t)seconds * 1000000;
+
+    uint32_t active = 0;
+    for (uint32_t i = 0; i < qd; i++) {
+        uint64_t index = random ? rng_next() % blocks : next++ % blocks;
+        slot_submit(&slots[i], dev, op, start + index * block, block, r);
+        active += slots[i].active;
+    }
+
+    while (active) {
+        blk_poll();
+        uint64_t now = timer_us();
+
+        for (uint32_t i = 0; i < qd; i++) {
+            bench_slot_t* s = &slots[i];
+            if (!s->active || s->req.status == BLK_PENDING) {
+                continue;
+            }
+
+            lat_hist_add(&r->latency, now - s->start_us);
+            if (s->req.status) {
+                r->errors++;
+            } else {
+                r->bytes += (uint64_t)block * 512;
+            }
+            r->elapsed_us = now - t0;
+
+            s->active = 0;
+            active--;
+            if (now < stop) {
+                uint64_t index = random ? rng_next() % blocks : next++ % blocks;
+                slot_submit(s, dev, op, start + index * block, block, r);
+                active += s->active;
+            }
+        }
+    }
+}
+
+static void print_u64(uint64_t value) {
+    char num_buf[21];
+    u64toa(value, num_buf);
+    print(num_buf);
+}
+
+static void print_result(const char* name, const bench_result_t* r) {
+    print(name);
+    const lat_hist_t* h = &r->latency;
+    if (h->count == 0 || r->elapsed_us == 0) {
+        print(": no I/O completed\n");
+        return;
+    }
+
+    uint64_t mb10 = r->bytes * 10 / r->elapsed_us; // bytes per us is MB/s
+    print(": ");
+    print_u64(mb10 / 10);
+    print(".");
+    print_u64(mb10 % 10);
+    print(" MB/s, ");
+    print_u64(h->count * 1000000 / r->elapsed_us);
+    print(" IOPS, latency p50 ");
+    print_u64(lat_hist_percentile(h, 500));
+    print(" us, p99 ");
+    print_u64(lat_hist_percentile(h, 990));
+    print(" us, max ");
+    print_u64(h->max_us);
+    print(" us");
+    if (r->errors) {
+        print(", errors ");
+        print_u64(r->errors);
+    }
+    print("\n");
+}
+
+int diskbench_parse_tests(const char* name) {
+    if (strcmp(name, "all") == 0) return DISKBENCH_ALL;
+    if (strcmp(name, "read") == 0) return DISKBENCH_SEQ_READ;
+    if (strcmp(name, "write") == 0) return DISKBENCH_SEQ_WRITE;
+    if (strcmp(name, "randread") == 0) return DISKBENCH_RAND_READ;
+    if (strcmp(name, "randwrite") == 0) return DISKBENCH_RAND_WRITE;
+    return 0;
+}
+
+int diskbench_run(int dev, int tests, uint32_t block, uint32_t qd, uint32_t seconds) {
+    blkdev_t* bd = blkdev_get(dev);
+    if (!bd || !bd->sectors) {
+        print("diskbench: no such device\n");
+        return 1;
+    }
+
+    uint32_t spl = bd->physical_sector_size / 512;
+    if (block == 0 || block > DISKBENCH_MAX_BLOCK || (block % spl) ||
+        qd == 0 || qd > DISKBENCH_MAX_QD || seconds == 0 || seconds > DISKBENCH_MAX_SECONDS) {
+        print("diskbench: block must be a multiple of the physical sector up to 256 sectors, ");
+        print("queue depth 1-32, 1-60 seconds\n");
+        return 1;
+    }
+
+    // Scratch range: the end of the device, at most half of it, starting
+    // on a block boundary. A GPT keeps its backup header and entries in
+    // the last sectors, which stay out of it.
+    uint64_t end = bd->sectors;
+    if (part_is_gpt(dev)) {
+        uint64_t backup = (uint64_t)DISKBENCH_GPT_BACKUP * (bd->sector_size / 512);
+        end = end > backup ? end - backup : 0;
+    }
+    uint64_t span = end / 2;
+    if (span > DISKBENCH_SCRATCH_SECTORS) {
+        span = DISKBENCH_SCRATCH_SECTORS;
+    }
+    uint64_t start = (end - span + block - 1) / block * block;
+    span = end > start ? (end - start) / block * block : 0;
+    if (span < block) {
+        print("diskbench: device too small\n");
+        return 1;
+    }
+
+    const char* in_use = scratch_in_use(dev, start, start + span);
+    if (in_use && (tests & (DISKBENCH_SEQ_WRITE | DISKBENCH_RAND_WRITE))) {
+        print("diskbench: scratch range holds ");
+        print(in_use);
+        print(", skipping write tests\n");
+        tests &= ~(DISKBENCH_SEQ_WRITE | DISKBENCH_RAND_WRITE);
+    }
+    if (!tests) {
+        return 1;
+    }
+
+    bench_slot_t* slots = (bench_slot_t*)kcalloc(qd, sizeof(bench_slot_t));
+    uint8_t* data = (uint8_t*)kmalloc_aligned((size_t)qd * block * 512, 4096);
+    bench_result_t* result = (bench_result_t*)kmalloc(sizeof(bench_result_t));
+    if (!slots || !data || !result) {
+        print("diskbench: out of memory\n");
+        kfree(slots);
+        kfree_aligned(data);
+        kfree(result);
+        return 1;
+    }
+    for (uint32_t i = 0; i < qd; i++) {
+        slots[i].req.buffer = data + (size_t)i * block * 512;
+        memset(slots[i].req.buffer, (int)(0xA5 ^ i), block * 512);
+    }
+
+    print("diskbench: ");
+    print(bd->name);
+    print(", block ");
+    print_u64(block * 512);
+    print(" bytes, queue depth ");
+    print_u64(qd);
+    print(", ");
+    print_u64(seconds);
+    print(" s per test, scratch LBA ");
+    print_u64(start);
+    print("+");
+    print_u64(span);
+    print("\n");
+    if (!timer_calibrated()) {
+        print("diskbench: clock not calibrated, latencies have tick resolution\n");
+    }
+
+    // The benchmark goes around the cache, so nothing cached may be
+    // newer than the disk, and nothing cached may survive the writes
+    blkdev_flush(dev);
+
+    static const struct {
+        int bit;
+        uint8_t op;
+        int random;
+        const char* name;
+    } runs[] = {
+        { DISKBENCH_SEQ_READ,   BLK_OP_READ,  0, "seq read  " },
+        { DISKBENCH_SEQ_WRITE,  BLK_OP_WRITE, 0, "seq write " },
+        { DISKBENCH_RAND_READ,  BLK_OP_READ,  1, "rand read " },
+        { DISKBENCH_RAND_WRITE, BLK_OP_WRITE, 1, "rand write" },
+    };
+
+    for (int i = 0; i < 4; i++) {
+        if (!(tests & runs[i].bit)) {
+            continue;
+        }
+        bench_one(dev, runs[i].op, runs[i].random, start, span, block, slots, qd, seconds, result);
+        print_result(runs[i].name, result);
+    }
+
+    if (tests & (DISKBENCH_SEQ_WRITE | DISKBENCH_RAND_WRITE)) {
+        bcache_invalidate(dev);
+    }
+
+    kfree(slots);
+    kfree_aligned(data);
+    kfree(result);
+    return 0;
+}
@@ -50,7 +50,123 @@ debug_out:
     out dx, al
     ret
 
+section .text
+extern isr_dispatch
+
+; Vectors without a CPU error code push a zero so every frame looks alike
+%macro ISR_NOERR 1
+isr_stub_%+%1:
+    push 0
+    push %1
+    jmp isr_common
+%endmacro
+
+%macro ISR_ERR 1
+isr_stub_%+%1:
+    push %1
+    jmp isr_common
+%endmacro
+
+isr_common:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    ; C code may use SSE registers, keep the interrupted context's intact
+    sub rsp, 512
+    fxsave [rsp]
+
+    cld
+    lea rdi, [rsp + 512]
+    call isr_dispatch
+
+    fxrstor [rsp]
+    add rsp, 512
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+    add rsp, 16
+    iretq
+
+ISR_NOERR 0
+ISR_NOERR 1
+ISR_NOERR 2
+ISR_NOERR 3
+ISR_NOERR 4
+ISR_NOERR 5
+ISR_NOERR 6
+ISR_NOERR 7
+ISR_ERR   8
+ISR_NOERR 9
+ISR_ERR   10
+ISR_ERR   11
+ISR_ERR   12
+ISR_ERR   13
+ISR_ERR   14
+ISR_NOERR 15
+ISR_NOERR 16
+ISR_ERR   17
+ISR_NOERR 18
+ISR_NOERR 19
+ISR_NOERR 20
+ISR_ERR   21
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_ERR   29
+ISR_ERR   30
+ISR_NOERR 31
+
+; 0x20-0x2F: 8259 PIC lines, 0x30-0x3F: MSI vectors, the rest are
+; caught so stray firmware interrupts are acknowledged instead of faulting
+%assign i 32
+%rep 224
+isr_stub_%+i:
+    push 0
+    push i
+    jmp isr_common
+%assign i i+1
+%endrep
+
 section .rodata
+align 8
+global isr_stub_table
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr_stub_%+i
+%assign i i+1
+%endrep
+
 align 16
 gdt64:
     dq 0x0000000000000000
@@ -3,142 +3,1321 @@
 #include "include/ahci.h"
 #include "include/stddef.h"
 #include "include/mm.h"
-
-#define MAX_NODES 64
-static fs_node node_pool[MAX_NODES];
-static int node_count = 0;
-
-fs_node fs_root;
+#include "include/blkdev.h"
+#include "include/ramdisk.h"
+#include "include/part.h"
+#include "include/timer.h"
+
+#define FS_NODE_HASH 64
+#define FS_DENTRY_CACHE 512
+#define FS_DENTRY_HASH 256
+
+// Inode cache. Slots that are free or whose node has no references sit
+// on the LRU list, oldest first, and are reused from its head.
+static fs_node node_cache[FS_NODE_CACHE];
+static fs_node* node_hash[FS_NODE_HASH];
+static fs_node* lru_head = NULL;
+static fs_node* lru_tail = NULL;
+
+// Name cache: what a name in a directory resolved to, by inode number,
+// so that lookups need neither the directory's entries nor its index.
+// A negative entry records a name that is not there. Entries outlive
+// the nodes they name and are dropped when the name is created or
+// removed; the least recently used one is reused when all are taken.
+typedef struct dentry {
+    uint32_t parent;          // Directory inode
+    uint32_t ino;             // 0 for a negative entry; the root is nobody's child
+    uint32_t hash;            // Of the name
+    uint8_t type;
+    uint8_t used;
+    char name[MAX_NAME_LEN];
+    struct dentry* hash_next;
+    struct dentry* lru_prev;
+    struct dentry* lru_next;
+} dentry_t;
+
+static dentry_t dentry_cache[FS_DENTRY_CACHE];
+static dentry_t* dentry_hash[FS_DENTRY_HASH];
+static dentry_t* dentry_head = NULL; // Least recently used
+static dentry_t* dentry_tail = NULL;
+
+// The root directory is always inode 0 and stays cached while mounted
+static fs_node* fs_root = NULL;
 fs_node *current_dir;
 
 static char current_path[MAX_PATH_LEN] = "/";
 #define FS_SIGNATURE 0x4F53574C
-
-static uint32_t fs_start_sector = 0;
-
-static uint8_t* ramdisk = NULL;
-static size_t ramdisk_size = 2 * 1024 * 1024; // 2 МБ
-
-int use_ahci = 0;
-int use_ramdisk = 0;
-
-#ifndef SUPERBLOCK_DEFINED
-#define SUPERBLOCK_DEFINED
+#define FS_VERSION 3
+
+// First sector of the file system, followed by the block bitmap and the
+// data blocks. The inode table and the inode bitmap live in data blocks
+// and the table grows as inodes are needed. The first 8 bytes double as
+// the partition signature.
+//
+// Versions 1 and 2 had a fixed table of 64 nodes after the header,
+// each with the names of its children; version 1 also had no data
+// area. Both are converted when mounted and rewritten as version 3 by
+// the next save.
 typedef struct {
-    uint32_t magic;
-    uint32_t block_size;
-    uint32_t total_blocks;
+    uint32_t magic;       // FS_SIGNATURE
+    uint32_t version;
+    uint32_t node_count;  // Slots in the inode table
+    uint32_t bitmap_start; // Sectors from the header
+    uint32_t bitmap_sectors;
+    uint32_t data_start;   // Sector of data block 0, from the header
+    uint32_t block_count;
     uint32_t free_blocks;
-} superblock_t;
-#endif
+    // Version 3
+    uint32_t inode_map;    // First block of the inode bitmap
+    uint32_t free_inodes;
+    uint32_t table_extent_count;
+    fs_extent_t table[FS_MAX_EXTENTS]; // Blocks of the inode table
+} fs_header_t;
+
+#define FS_LEGACY_NODES 64
+#define FS_LEGACY_BITMAP_START (1 + FS_LEGACY_NODES)
+#define FS_BITMAP_START 1
+#define FS_MAX_BITMAP_SECTORS 16 // 65536 blocks, 256 MiB of file data
+#define FS_BITS_PER_SECTOR (512 * 8)
+#define FS_IMAP_BLOCKS (FS_MAX_INODES / 8 / FS_BLOCK_SIZE)
+#define FS_DIR_MIN_ENTRIES 16
+#define FS_INDEX_MIN_BUCKETS 64
+
+// Node of a version 1 or 2 table, with table indices for pointers
+#pragma pack(push, 1)
+typedef struct {
+    char name[32];
+    uint8_t type;
+    uint64_t parent;
+    uint64_t children[16];
+    uint8_t child_count;
+    uint32_t size;
+    union {
+        char content[FS_INLINE_SIZE];
+        fs_extent_t extents[FS_MAX_EXTENTS];
+    };
+    uint8_t extent_count;
+} legacy_node_t;
+#pragma pack(pop)
 
-#define FS_MAGIC 0x4C57534F  // "LWSO"
+static uint32_t fs_start_sector = 0;
 
+static int fs_dev = -1; // Block device holding the file system
+
+// Free-space bitmap, a set bit is a block in use. committed_map has the
+// blocks the metadata on disk still points at: they are neither reused
+// nor discarded until the next save has replaced that metadata.
+static uint8_t* block_map = NULL;
+static uint8_t* committed_map = NULL;
+static uint32_t bitmap_start = 0;
+static uint32_t bitmap_sectors = 0;
+static uint32_t data_start = 0;
+static uint32_t block_count = 0;
+static uint32_t free_blocks = 0;
+
+// Inode table and inode bitmap, with the same split between inodes in
+// use and inodes the disk still knows as used
+static fs_extent_t inode_table[FS_MAX_EXTENTS];
+static uint32_t inode_table_extents = 0;
+static uint32_t inode_count = 0;
+static uint32_t inode_map_block = 0;
+static uint8_t* inode_map = NULL;
+static uint8_t* committed_inodes = NULL;
+static uint32_t free_inodes = 0;
+// Sectors of a converted version 1 or 2 table, discarded once the new
+// format is on disk
+static uint32_t legacy_nodes = 0;
+
+// What changed since the last save: a bit per sector of each bitmap,
+// whether the header's table layout did, and how many inodes and bitmap
+// sectors were dirtied since when
+static uint32_t bitmap_dirty = 0;
+static uint32_t imap_dirty = 0;
+static int header_dirty = 0;
+static uint32_t dirty_count = 0;
+static uint64_t dirty_since = 0;
+// Set while the tree is one fs_init made up because nothing could be
+// loaded: writing it would overwrite whatever is on the disk, so nothing
+// reaches the device, not even file data or evicted nodes, until an
+// explicit save or a format
+static int writeback_held = 0;
+
+// Puts a freshly formatted file system on a new RAM disk, for when no
+// drive can hold one.
 void fs_init_ramdisk() {
-    use_ahci = 0;
-    use_ramdisk = 1;
-    
-    print("Initializing RAM disk...\n");
-
-    ramdisk = (uint8_t*)kmalloc(ramdisk_size);
-    if (!ramdisk) {
-        print("Error: Failed to allocate RAM disk\n");
+    int dev = ramdisk_create(RAMDISK_DEFAULT_SIZE);
+    if (dev < 0) {
         return;
     }
 
-    memset(ramdisk, 0, ramdisk_size);
+    if (!format_disk(dev, 1)) {
+        fs_init(dev, 1);
+    }
+}
+
+// Both return 1 on success. Transfers go through the block cache, call
+// fs_save() to write dirty blocks back.
+int read_sectors(uint32_t lba, uint32_t count, void* buffer) {
+    if (fs_dev < 0) {
+        return 0;
+    }
 
-    superblock_t* sb = (superblock_t*)ramdisk;
-    sb->magic = FS_MAGIC;
-    sb->block_size = 512;
-    sb->total_blocks = ramdisk_size / sb->block_size;
-    sb->free_blocks = sb->total_blocks - 1;
-    
-    print("RAM disk initialized: ");
-    print_hex(ramdisk_size);
-    print(" bytes\n");
+    return blkdev_read(fs_dev, lba, count, buffer) == 0;
 }
 
-static int ramdisk_read_sectors(uint32_t lba, uint32_t count, void* buffer) {
-    if (!ramdisk || lba * 512 + count * 512 > ramdisk_size) {
+int write_sectors(uint32_t lba, uint32_t count, void* buffer) {
+    if (fs_dev < 0) {
         return 0;
     }
-    
-    memcpy(buffer, ramdisk + lba * 512, count * 512);
-    return 1;
+    if (writeback_held) {
+        print("FS: nothing is written before sync or format\n");
+        return 0;
+    }
+
+    return blkdev_write(fs_dev, lba, count, buffer) == 0;
 }
 
-static int ramdisk_write_sectors(uint32_t lba, uint32_t count, void* buffer) {
-    if (!ramdisk || lba * 512 + count * 512 > ramdisk_size) {
+int fs_location(int* dev, uint32_t* lba, uint32_t* sectors) {
+    if (fs_dev < 0) {
         return 0;
     }
-    
-    memcpy(ramdisk + lba * 512, buffer, count * 512);
+
+    *dev = fs_dev;
+    *lba = fs_start_sector;
+    *sectors = data_start ? data_start + block_count * FS_BLOCK_SECTORS : 1;
     return 1;
 }
 
-int read_sectors(uint32_t lba, uint32_t count, void* buffer) {
-    if (use_ahci) {
-        return ahci_read_sectors(lba, count, buffer);
-    } else if (use_ramdisk) {
-        return ramdisk_read_sectors(lba, count, buffer);
+int fs_probe(const void* sector) {
+    const fs_header_t* header = (const fs_header_t*)sector;
+    return header->magic == FS_SIGNATURE && header->version >= 1 && header->version <= FS_VERSION;
+}
+
+void fs_set_start_sector(uint32_t sector) {
+    fs_start_sector = sector;
+}
+
+// Sectors from lba to the end of the partition that starts there, or to
+// the end of the device when none does
+static uint64_t region_sectors(int dev, uint32_t lba) {
+    blkdev_t* d = blkdev_get(dev);
+    if (!d || lba >= d->sectors) {
+        return 0;
+    }
+
+    uint64_t end = d->sectors;
+    for (int i = 0; i < part_count(dev); i++) {
+        const partition_t* p = part_get(dev, i);
+        if (p->start_lba == lba) {
+            end = p->end_lba + 1;
+            break;
+        }
+    }
+    return end - lba;
+}
+
+static uint32_t block_lba(uint32_t block) {
+    return fs_start_sector + data_start + block * FS_BLOCK_SECTORS;
+}
+
+static void dirty_note(void) {
+    if (dirty_count++ == 0) {
+        dirty_since = timer_ticks();
+    }
+}
+
+static void sector_dirty(uint32_t* mask, uint32_t sector) {
+    if (!(*mask & (1u << sector))) {
+        *mask |= 1u << sector;
+        dirty_note();
+    }
+}
+
+static int bit_test(const uint8_t* map, uint32_t i) {
+    return (map[i / 8] >> (i % 8)) & 1;
+}
+
+static void bit_set(uint8_t* map, uint32_t i, int set) {
+    if (set) {
+        map[i / 8] |= 1 << (i % 8);
+    } else {
+        map[i / 8] &= ~(1 << (i % 8));
+    }
+}
+
+// Sets up empty bitmaps for a data area of the given blocks. Returns 0
+// on success.
+static int maps_init(uint32_t blocks, uint32_t map_start, uint32_t start) {
+    kfree(block_map);
+    kfree(committed_map);
+    bitmap_start = map_start;
+    bitmap_sectors = blocks ? (blocks + FS_BITS_PER_SECTOR - 1) / FS_BITS_PER_SECTOR : 1;
+    block_map = (uint8_t*)kcalloc(bitmap_sectors, 512);
+    committed_map = (uint8_t*)kcalloc(bitmap_sectors, 512);
+    data_start = start;
+    block_count = blocks;
+    free_blocks = blocks;
+    bitmap_dirty = bitmap_sectors < 32 ? (1u << bitmap_sectors) - 1 : ~0u;
+    header_dirty = 1;
+
+    if (!block_map || !committed_map) {
+        print("FS: out of memory for the block bitmap\n");
+        kfree(block_map);
+        kfree(committed_map);
+        block_map = committed_map = NULL;
+        block_count = free_blocks = 0;
+        return 1;
     }
-    
     return 0;
 }
 
-int write_sectors(uint32_t lba, uint32_t count, void* buffer) {
-    if (use_ahci) {
-        return ahci_write_sectors(lba, count, buffer);
-    } else if (use_ramdisk) {
-        return ramdisk_write_sectors(lba, count, buffer);
+// Lays the data area out over whatever the region has past the bitmap.
+// Blocks start on a device LBA that is a multiple of the block size and
+// of the physical sector, so each block covers whole pages and sectors
+// and can be discarded on its own, wherever the file system starts.
+static int layout_init(uint64_t sectors, uint32_t map_start) {
+    blkdev_t* d = blkdev_get(fs_dev);
+    uint32_t granule = FS_BLOCK_SECTORS;
+    uint32_t offset = 0;
+    if (d && d->physical_sector_size / 512 > granule) {
+        granule = d->physical_sector_size / 512;
+    }
+    if (d) {
+        offset = d->alignment_offset % granule;
+    }
+
+    uint32_t start = map_start + FS_MAX_BITMAP_SECTORS;
+    uint32_t rem = (fs_start_sector + start + offset) % granule;
+    if (rem) {
+        start += granule - rem;
+    }
+
+    uint64_t blocks = sectors > start ? (sectors - start) / FS_BLOCK_SECTORS : 0;
+    if (blocks > FS_MAX_BITMAP_SECTORS * FS_BITS_PER_SECTOR) {
+        blocks = FS_MAX_BITMAP_SECTORS * FS_BITS_PER_SECTOR;
+    }
+    return maps_init((uint32_t)blocks, map_start, start);
+}
+
+static int block_taken(uint32_t b) {
+    return bit_test(block_map, b) || bit_test(committed_map, b);
+}
+
+static void blocks_mark(uint32_t start, uint32_t count, int used) {
+    for (uint32_t b = start; b < start + count; b++) {
+        bit_set(block_map, b, used);
+    }
+    for (uint32_t s = start / FS_BITS_PER_SECTOR; count && s <= (start + count - 1) / FS_BITS_PER_SECTOR; s++) {
+        sector_dirty(&bitmap_dirty, s);
+    }
+    if (used) {
+        free_blocks -= count;
+    } else {
+        free_blocks += count;
+    }
+}
+
+// Finds blocks for a file: a single run when a gap is long enough,
+// otherwise the free runs from the start of the area. Returns the
+// extent count, or -1 when blocks or extents run out.
+static int extents_alloc(fs_extent_t* extents, uint32_t blocks, uint32_t max) {
+    if (!block_map || blocks > free_blocks || !max) {
+        return -1;
+    }
+
+    uint32_t run = 0;
+    for (uint32_t b = 0; b < block_count; b++) {
+        if (block_taken(b)) {
+            run = 0;
+        } else if (++run == blocks) {
+            extents[0].start = b + 1 - blocks;
+            extents[0].count = blocks;
+            blocks_mark(extents[0].start, blocks, 1);
+            return 1;
+        }
+    }
+
+    uint32_t n = 0;
+    uint32_t left = blocks;
+    for (uint32_t b = 0; b < block_count && left; b++) {
+        if (block_taken(b)) {
+            continue;
+        }
+        if (n && extents[n - 1].start + extents[n - 1].count == b) {
+            extents[n - 1].count++;
+        } else if (n < max) {
+            extents[n].start = b;
+            extents[n].count = 1;
+            n++;
+        } else {
+            break;
+        }
+        left--;
+    }
+    if (left) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        blocks_mark(extents[i].start, extents[i].count, 1);
+    }
+    return n;
+}
+
+static uint32_t extents_blocks(const fs_extent_t* extents, uint32_t n) {
+    uint32_t blocks = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        blocks += extents[i].count;
+    }
+    return blocks;
+}
+
+// Adds blocks to the end of an extent list. The last run is extended in
+// place while the blocks after it are free. Returns 0 on success.
+static int extents_grow(fs_extent_t* extents, uint32_t* n, uint32_t blocks) {
+    if (!block_map || blocks > free_blocks) {
+        return 1;
+    }
+
+    fs_extent_t* last = *n ? &extents[*n - 1] : NULL;
+    uint32_t in_place = 0;
+    while (last && in_place < blocks && last->start + last->count + in_place < block_count &&
+           !block_taken(last->start + last->count + in_place)) {
+        in_place++;
+    }
+    if (in_place) {
+        blocks_mark(last->start + last->count, in_place, 1);
+        last->count += in_place;
+    }
+
+    if (in_place < blocks) {
+        int added = extents_alloc(extents + *n, blocks - in_place, FS_MAX_EXTENTS - *n);
+        if (added < 0) {
+            if (in_place) {
+                last->count -= in_place;
+                blocks_mark(last->start + last->count, in_place, 0);
+            }
+            return 1;
+        }
+        *n += added;
     }
-    
     return 0;
 }
 
-void fs_set_start_sector(uint32_t sector) {
-    fs_start_sector = sector;
+// Gives an inode's blocks back; it keeps its size
+static void extents_free(fs_inode_t* inode) {
+    for (int i = 0; i < inode->extent_count; i++) {
+        blocks_mark(inode->extents[i].start, inode->extents[i].count, 0);
+    }
+    inode->extent_count = 0;
+    memset(inode->extents, 0, sizeof(inode->extents));
 }
 
-fs_node *find_node(const char *path) {
-    if (strcmp(path, "/") == 0) {
-        return &fs_root;
-    }
-
-    char temp_path[MAX_PATH_LEN];
-    strlcpy(temp_path, path, sizeof(temp_path));
-
-    fs_node *current = (path[0] == '/') ? &fs_root : current_dir;
-    char *component = strtok(temp_path, "/");
-    
-    while (component != NULL) {
-        int found = 0;
-
-        for (int i = 0; i < current->child_count; i++) {
-            fs_node *child = current->children[i];
-            if (child != NULL && strcmp(child->name, component) == 0) {
-                if (child->type == FS_DIR_TYPE) {
-                    current = child;
-                    found = 1;
-                    break;
-                }
+// Makes the inode's extents cover at least the given bytes, growing by
+// as much again as it already has when it can. Returns 0 on success.
+static int extents_reserve(fs_inode_t* inode, uint32_t bytes) {
+    uint32_t need = (bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    uint32_t n = inode->extent_count;
+    uint32_t have = extents_blocks(inode->extents, n);
+    if (need <= have) {
+        return 0;
+    }
+
+    uint32_t more = need - have < have ? have : need - have;
+    if (extents_grow(inode->extents, &n, more) && extents_grow(inode->extents, &n, need - have)) {
+        return 1;
+    }
+    inode->extent_count = n;
+    return 0;
+}
+
+// Moves size bytes of an inode's data, starting at a sector aligned
+// offset, through its extents, one transfer per extent straight to or
+// from the caller's buffer. Only a partial last sector goes through a
+// bounce buffer. Returns 1 on success.
+static int extents_io(const fs_inode_t* inode, uint32_t offset, uint8_t* buf, size_t size, int write) {
+    uint8_t tail[512];
+    size_t done = 0;
+    uint32_t skip = offset / 512;
+
+    for (int i = 0; i < inode->extent_count && done < size; i++) {
+        uint32_t extent_sectors = inode->extents[i].count * FS_BLOCK_SECTORS;
+        if (skip >= extent_sectors) {
+            skip -= extent_sectors;
+            continue;
+        }
+        uint32_t lba = block_lba(inode->extents[i].start) + skip;
+        size_t len = (size_t)(extent_sectors - skip) * 512;
+        skip = 0;
+        if (len > size - done) {
+            len = size - done;
+        }
+
+        uint32_t whole = len / 512;
+        uint32_t rest = len % 512;
+        uint8_t* p = buf + done;
+        if (whole && !(write ? write_sectors(lba, whole, p) : read_sectors(lba, whole, p))) {
+            return 0;
+        }
+        if (rest && write) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p + whole * 512, rest);
+            if (!write_sectors(lba + whole, 1, tail)) {
+                return 0;
+            }
+        } else if (rest) {
+            if (!read_sectors(lba + whole, 1, tail)) {
+                return 0;
             }
+            memcpy(p + whole * 512, tail, rest);
         }
-        
-        if (!found) {
+        done += len;
+    }
+    return done == size;
+}
+
+// Sector of an inode, found through the table's extents; 0 if the table
+// is not that long
+static uint32_t inode_lba(uint32_t ino) {
+    uint32_t block = ino / FS_BLOCK_SECTORS;
+    for (uint32_t i = 0; i < inode_table_extents; i++) {
+        if (block < inode_table[i].count) {
+            return block_lba(inode_table[i].start + block) + ino % FS_BLOCK_SECTORS;
+        }
+        block -= inode_table[i].count;
+    }
+    return 0;
+}
+
+// Sets up the inode bitmap and a table of at least the given slots,
+// all free. Returns 0 on success.
+static int inodes_init(uint32_t slots) {
+    kfree(inode_map);
+    kfree(committed_inodes);
+    inode_map = (uint8_t*)kcalloc(FS_IMAP_BLOCKS, FS_BLOCK_SIZE);
+    committed_inodes = (uint8_t*)kcalloc(FS_IMAP_BLOCKS, FS_BLOCK_SIZE);
+    inode_table_extents = 0;
+    inode_count = 0;
+    free_inodes = 0;
+
+    fs_extent_t map;
+    uint32_t blocks = (slots + FS_BLOCK_SECTORS - 1) / FS_BLOCK_SECTORS;
+    if (!inode_map || !committed_inodes || extents_alloc(&map, FS_IMAP_BLOCKS, 1) < 0) {
+        print("FS: no room for the inode bitmap\n");
+        return 1;
+    }
+    inode_map_block = map.start;
+
+    if (extents_grow(inode_table, &inode_table_extents, blocks)) {
+        print("FS: no room for the inode table\n");
+        return 1;
+    }
+    inode_count = blocks * FS_BLOCK_SECTORS;
+    free_inodes = inode_count;
+    for (uint32_t s = 0; s * FS_BITS_PER_SECTOR < inode_count; s++) {
+        sector_dirty(&imap_dirty, s);
+    }
+    header_dirty = 1;
+    return 0;
+}
+
+static void inode_mark(uint32_t ino, int used) {
+    bit_set(inode_map, ino, used);
+    if (used) {
+        free_inodes--;
+    } else {
+        free_inodes++;
+    }
+    sector_dirty(&imap_dirty, ino / FS_BITS_PER_SECTOR);
+}
+
+static int inode_taken(uint32_t ino) {
+    return bit_test(inode_map, ino) || bit_test(committed_inodes, ino);
+}
+
+// Takes the lowest free inode number, doubling the table when it is
+// full. Returns 0, the root's number, when none is left.
+static uint32_t inode_alloc(void) {
+    uint32_t ino = 1;
+    while (ino < inode_count && inode_taken(ino)) {
+        ino++;
+    }
+
+    if (ino == inode_count) {
+        uint32_t blocks = inode_count / FS_BLOCK_SECTORS;
+        if (inode_count + blocks * FS_BLOCK_SECTORS > FS_MAX_INODES) {
+            blocks = (FS_MAX_INODES - inode_count) / FS_BLOCK_SECTORS;
+        }
+        if (!blocks || (extents_grow(inode_table, &inode_table_extents, blocks) &&
+                        extents_grow(inode_table, &inode_table_extents, 1))) {
+            return 0;
+        }
+        uint32_t added = extents_blocks(inode_table, inode_table_extents) * FS_BLOCK_SECTORS - inode_count;
+        // Bitmap sectors the table grew into hold nothing yet
+        for (uint32_t s = (inode_count + FS_BITS_PER_SECTOR - 1) / FS_BITS_PER_SECTOR;
+             s * FS_BITS_PER_SECTOR < inode_count + added; s++) {
+            sector_dirty(&imap_dirty, s);
+        }
+        inode_count += added;
+        free_inodes += added;
+        header_dirty = 1;
+    }
+
+    inode_mark(ino, 1);
+    return ino;
+}
+
+static void inode_release(uint32_t ino) {
+    inode_mark(ino, 0);
+}
+
+static void lru_unlink(fs_node* n) {
+    if (n->lru_prev) n->lru_prev->lru_next = n->lru_next;
+    else lru_head = n->lru_next;
+    if (n->lru_next) n->lru_next->lru_prev = n->lru_prev;
+    else lru_tail = n->lru_prev;
+    n->lru_prev = n->lru_next = NULL;
+}
+
+static void lru_push_tail(fs_node* n) {
+    n->lru_next = NULL;
+    n->lru_prev = lru_tail;
+    if (lru_tail) lru_tail->lru_next = n;
+    else lru_head = n;
+    lru_tail = n;
+}
+
+static void lru_push_head(fs_node* n) {
+    n->lru_prev = NULL;
+    n->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = n;
+    else lru_tail = n;
+    lru_head = n;
+}
+
+static void hash_insert(fs_node* n) {
+    fs_node** bucket = &node_hash[n->ino % FS_NODE_HASH];
+    n->hash_next = *bucket;
+    *bucket = n;
+}
+
+static void hash_remove(fs_node* n) {
+    fs_node** p = &node_hash[n->ino % FS_NODE_HASH];
+    while (*p && *p != n) {
+        p = &(*p)->hash_next;
+    }
+    if (*p) {
+        *p = n->hash_next;
+    }
+    n->hash_next = NULL;
+}
+
+// Notes that a node's inode has to be stored by the next save
+static void node_dirty(fs_node* n) {
+    if (!n->dirty) {
+        n->dirty = 1;
+        dirty_note();
+    }
+}
+
+static void range_add(fs_dirty_t* d, uint32_t sector) {
+    if (d->first >= d->end) {
+        d->first = sector;
+        d->end = sector + 1;
+    } else if (sector < d->first) {
+        d->first = sector;
+    } else if (sector >= d->end) {
+        d->end = sector + 1;
+    }
+}
+
+static void sectors_add(fs_dirty_t* d, uint32_t sector) {
+    if (sector >= d->first && sector < d->end) {
+        return;
+    }
+    for (uint32_t i = 0; i < d->spot_count; i++) {
+        if (d->spots[i] == sector) {
+            return;
+        }
+    }
+    if (d->first >= d->end && d->spot_count < FS_DIRTY_SPOTS) {
+        d->spots[d->spot_count++] = sector;
+        return;
+    }
+
+    // Too many to list, one range over all of them
+    range_add(d, sector);
+    for (uint32_t i = 0; i < d->spot_count; i++) {
+        range_add(d, d->spots[i]);
+    }
+    d->spot_count = 0;
+}
+
+static void sectors_all(fs_dirty_t* d, uint32_t bytes) {
+    d->spot_count = 0;
+    d->first = 0;
+    d->end = (bytes + 511) / 512;
+}
+
+// Notes a changed directory entry, which changes the inode's size too
+static void entry_dirty(fs_node* dir, uint32_t i) {
+    sectors_add(&dir->entry_sectors, i * sizeof(fs_dirent_t) / 512);
+    node_dirty(dir);
+}
+
+static void bucket_dirty(fs_node* dir, uint32_t k) {
+    sectors_add(&dir->index_sectors, k * sizeof(uint32_t) / 512);
+}
+
+// 32-bit FNV-1a, with 0 kept free to mean no hash
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// Buckets for a directory index, kept at most three quarters full
+static uint32_t index_size(uint32_t entries) {
+    uint32_t buckets = FS_INDEX_MIN_BUCKETS;
+    while (buckets / 4 * 3 < entries) {
+        buckets *= 2;
+    }
+    return buckets;
+}
+
+// Builds a directory's index over its entries with the given buckets;
+// 0 on success
+static int index_build(fs_node* dir, uint32_t buckets) {
+    uint32_t* index = (uint32_t*)kcalloc(buckets, sizeof(uint32_t));
+    if (!index) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < dir->entry_count; i++) {
+        uint32_t k = dir->entries[i].hash & (buckets - 1);
+        while (index[k]) {
+            k = (k + 1) & (buckets - 1);
+        }
+        index[k] = i + 1;
+    }
+
+    kfree(dir->index);
+    dir->index = index;
+    dir->index_buckets = buckets;
+    return 0;
+}
+
+// Takes the index a directory keeps in its data if it is sound: every
+// entry once, each reachable from its home bucket. 0 on success.
+static int index_read(fs_node* dir) {
+    const fs_inode_t* inode = &dir->inode;
+    uint32_t buckets = inode->index_buckets;
+    uint32_t mask = buckets - 1;
+    uint64_t room = (uint64_t)extents_blocks(inode->extents, inode->extent_count) * FS_BLOCK_SIZE;
+    if (buckets < FS_INDEX_MIN_BUCKETS || (buckets & mask) || buckets / 4 * 3 < dir->entry_count ||
+        inode->index_offset % 512 || inode->index_offset < inode->size ||
+        inode->index_offset + (uint64_t)buckets * sizeof(uint32_t) > room) {
+        return 1;
+    }
+
+    uint32_t* index = (uint32_t*)kmalloc(buckets * sizeof(uint32_t));
+    uint8_t* seen = (uint8_t*)kcalloc(dir->entry_count / 8 + 1, 1);
+    int bad = !index || !seen ||
+              !extents_io(inode, inode->index_offset, (uint8_t*)index, buckets * sizeof(uint32_t), 0);
+    uint32_t found = 0;
+    for (uint32_t k = 0; k < buckets && !bad; k++) {
+        uint32_t i = index[k];
+        if (!i) {
+            continue;
+        }
+        if (i > dir->entry_count || bit_test(seen, i - 1)) {
+            bad = 1;
+            break;
+        }
+        bit_set(seen, i - 1, 1);
+        found++;
+        for (uint32_t j = dir->entries[i - 1].hash & mask; j != k && !bad; j = (j + 1) & mask) {
+            bad = !index[j];
+        }
+    }
+    kfree(seen);
+    if (bad || found != dir->entry_count) {
+        kfree(index);
+        return 1;
+    }
+
+    kfree(dir->index);
+    dir->index = index;
+    dir->index_buckets = buckets;
+    return 0;
+}
+
+// Bucket of entry i
+static uint32_t index_bucket(const fs_node* dir, uint32_t i) {
+    uint32_t mask = dir->index_buckets - 1;
+    uint32_t k = dir->entries[i].hash & mask;
+    while (dir->index[k] != i + 1) {
+        k = (k + 1) & mask;
+    }
+    return k;
+}
+
+// Empties bucket k. Later members of its probe run move back into the
+// hole when their home bucket lies at or before it, so that no run is
+// cut short.
+static void index_remove(fs_node* dir, uint32_t k) {
+    uint32_t mask = dir->index_buckets - 1;
+    uint32_t hole = k;
+    for (uint32_t j = (k + 1) & mask; dir->index[j]; j = (j + 1) & mask) {
+        uint32_t home = dir->entries[dir->index[j] - 1].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            dir->index[hole] = dir->index[j];
+            bucket_dirty(dir, hole);
+            hole = j;
+        }
+    }
+    dir->index[hole] = 0;
+    bucket_dirty(dir, hole);
+}
+
+static dentry_t** dentry_bucket(uint32_t parent, uint32_t hash) {
+    return &dentry_hash[(hash ^ parent * 0x9E3779B1u) % FS_DENTRY_HASH];
+}
+
+static void dentry_unlink(dentry_t* d) {
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else dentry_head = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else dentry_tail = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void dentry_push_tail(dentry_t* d) {
+    d->lru_next = NULL;
+    d->lru_prev = dentry_tail;
+    if (dentry_tail) dentry_tail->lru_next = d;
+    else dentry_head = d;
+    dentry_tail = d;
+}
+
+static void dentry_push_head(dentry_t* d) {
+    d->lru_prev = NULL;
+    d->lru_next = dentry_head;
+    if (dentry_head) dentry_head->lru_prev = d;
+    else dentry_tail = d;
+    dentry_head = d;
+}
+
+// The cached entry for a name in a directory, made the most recently
+// used; NULL on a miss
+static dentry_t* dentry_find(uint32_t parent, const char* name, uint32_t hash) {
+    for (dentry_t* d = *dentry_bucket(parent, hash); d; d = d->hash_next) {
+        if (d->hash == hash && d->parent == parent && strcmp(d->name, name) == 0) {
+            dentry_unlink(d);
+            dentry_push_tail(d);
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static void dentry_remove(dentry_t* d) {
+    dentry_t** p = dentry_bucket(d->parent, d->hash);
+    while (*p && *p != d) {
+        p = &(*p)->hash_next;
+    }
+    if (*p) {
+        *p = d->hash_next;
+    }
+    d->hash_next = NULL;
+    d->used = 0;
+}
+
+// Records what a name resolved to, ino 0 for nothing. The name must fit
+// an entry's name unshortened.
+static dentry_t* dentry_add(uint32_t parent, const char* name, uint32_t hash, uint32_t ino, uint8_t type) {
+    dentry_t* d = dentry_head;
+    dentry_unlink(d);
+    if (d->used) {
+        dentry_remove(d);
+    }
+
+    d->parent = parent;
+    d->ino = ino;
+    d->hash = hash;
+    d->type = type;
+    d->used = 1;
+    strlcpy(d->name, name, sizeof(d->name));
+    dentry_t** bucket = dentry_bucket(parent, hash);
+    d->hash_next = *bucket;
+    *bucket = d;
+    dentry_push_tail(d);
+    return d;
+}
+
+// Forgets a name in a directory, for when it is created or removed
+static void dentry_drop(uint32_t parent, const char* name) {
+    dentry_t* d = dentry_find(parent, name, name_hash(name));
+    if (d) {
+        dentry_remove(d);
+        dentry_unlink(d);
+        dentry_push_head(d);
+    }
+}
+
+static void dentry_reset(void) {
+    dentry_head = dentry_tail = NULL;
+    memset(dentry_hash, 0, sizeof(dentry_hash));
+    memset(dentry_cache, 0, sizeof(dentry_cache));
+    for (int i = 0; i < FS_DENTRY_CACHE; i++) {
+        dentry_push_tail(&dentry_cache[i]);
+    }
+}
+
+// Forgets every cached node without writing anything back
+static void cache_reset(void) {
+    lru_head = lru_tail = NULL;
+    memset(node_hash, 0, sizeof(node_hash));
+    for (int i = 0; i < FS_NODE_CACHE; i++) {
+        kfree(node_cache[i].entries);
+        kfree(node_cache[i].index);
+        memset(&node_cache[i], 0, sizeof(fs_node));
+        lru_push_tail(&node_cache[i]);
+    }
+    dentry_reset();
+    fs_root = NULL;
+    current_dir = NULL;
+}
+
+// Writes the part of a buffer between byte offsets first and end, not
+// past size, at offset base of the inode's data. Returns 1 on success
+// and adds the sectors written.
+static int range_store(const fs_inode_t* inode, uint32_t base, const uint8_t* buf,
+                       uint32_t first, uint32_t end, uint32_t size, uint32_t* sectors) {
+    if (end > size) {
+        end = size;
+    }
+    if (first >= end) {
+        return 1;
+    }
+    *sectors += (end - first + 511) / 512;
+    return extents_io(inode, base + first, (uint8_t*)buf + first, end - first, 1);
+}
+
+// Writes the changed sectors of a buffer of size bytes to offset base of
+// the inode's data and forgets they changed. Returns 1 on success.
+static int sectors_store(const fs_inode_t* inode, uint32_t base, const uint8_t* buf,
+                         fs_dirty_t* d, uint32_t size, uint32_t* sectors) {
+    int ok = range_store(inode, base, buf, d->first * 512, d->end * 512, size, sectors);
+    for (uint32_t i = 0; i < d->spot_count; i++) {
+        ok &= range_store(inode, base, buf, d->spots[i] * 512, d->spots[i] * 512 + 512, size, sectors);
+    }
+    if (ok) {
+        memset(d, 0, sizeof(fs_dirty_t));
+    }
+    return ok;
+}
+
+// Hands what changed of a node to the block cache: its inode and, for a
+// directory, the sectors of entries and index it changed. A directory
+// of FS_INDEX_MIN entries or more keeps its hash index on disk, block
+// aligned past twice the size of the entries so that they have room to
+// grow; the index moves further out once they reach it, and is written
+// whole when it moved, grew or was not on disk. The directory gets more
+// blocks when its data outgrew them. Returns 1 on success and adds the
+// sectors written.
+static int node_store(fs_node* n, uint32_t* sectors) {
+    fs_inode_t* inode = &n->inode;
+    int ok = 1;
+    if (n->entries && n->dirty) {
+        uint32_t bytes = n->entry_count * sizeof(fs_dirent_t);
+        uint32_t offset = inode->index_offset;
+        uint32_t index_bytes = 0;
+        if (n->entry_count >= FS_INDEX_MIN) {
+            if (offset < bytes) {
+                offset = (2 * bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE * FS_BLOCK_SIZE;
+            }
+            index_bytes = n->index_buckets * sizeof(uint32_t);
+            if (offset != inode->index_offset || inode->index_buckets != n->index_buckets) {
+                sectors_all(&n->index_sectors, index_bytes);
+            }
+        }
+
+        ok = !extents_reserve(inode, index_bytes ? offset + index_bytes : bytes) &&
+             sectors_store(inode, 0, (uint8_t*)n->entries, &n->entry_sectors, bytes, sectors);
+        if (ok && index_bytes) {
+            ok = sectors_store(inode, offset, (uint8_t*)n->index, &n->index_sectors, index_bytes, sectors);
+        } else if (ok) {
+            memset(&n->index_sectors, 0, sizeof(fs_dirty_t));
+        }
+        if (ok) {
+            inode->size = bytes;
+            inode->index_offset = offset;
+            inode->index_buckets = index_bytes ? n->index_buckets : 0;
+        }
+    }
+
+    if (n->dirty) {
+        uint8_t sector[512];
+        memset(sector, 0, sizeof(sector));
+        memcpy(sector, inode, sizeof(fs_inode_t));
+        uint32_t lba = inode_lba(n->ino);
+        ok &= lba && write_sectors(lba, 1, sector);
+        (*sectors)++;
+        if (ok) {
+            n->dirty = 0;
+        }
+    }
+    return ok;
+}
+
+void fs_release(fs_node* n) {
+    if (n && --n->refs == 0) {
+        lru_push_tail(n);
+    }
+}
+
+// Takes the least recently used slot, writing its node back first.
+// While writes are held back, changed nodes cannot be written and stay.
+// NULL when every cached node is referenced or held.
+static fs_node* node_slot(void) {
+    fs_node* n = lru_head;
+    while (n && writeback_held && n->inode.used && n->dirty) {
+        n = n->lru_next;
+    }
+    if (!n) {
+        print(writeback_held ? "FS: inode cache full, sync to make room\n" : "FS: inode cache full\n");
+        return NULL;
+    }
+    lru_unlink(n);
+
+    if (n->inode.used) {
+        uint32_t sectors = 0;
+        if (!node_store(n, &sectors)) {
+            print("FS: cannot write back inode\n");
+        }
+        hash_remove(n);
+        kfree(n->entries);
+        kfree(n->index);
+        fs_node* parent = n->parent;
+        memset(n, 0, sizeof(fs_node));
+        fs_release(parent);
+    }
+    return n;
+}
+
+static int inode_valid(const fs_inode_t* inode) {
+    if (!inode->used || inode->type > FS_DIR_TYPE || inode->extent_count > FS_MAX_EXTENTS) {
+        return 0;
+    }
+    for (int e = 0; e < inode->extent_count; e++) {
+        if (inode->extents[e].start >= block_count ||
+            inode->extents[e].count > block_count - inode->extents[e].start) {
+            return 0;
+        }
+    }
+
+    uint64_t room = (uint64_t)extents_blocks(inode->extents, inode->extent_count) * FS_BLOCK_SIZE;
+    if (inode->type == FS_DIR_TYPE) {
+        return inode->size % sizeof(fs_dirent_t) == 0 && inode->size <= room;
+    }
+    return inode->extent_count ? inode->size <= room : inode->size <= FS_INLINE_SIZE;
+}
+
+// Returns the node of an inode with a reference, reading it in if it is
+// not cached. parent and name are what it was reached through.
+static fs_node* node_get(fs_node* parent, uint32_t ino, const char* name) {
+    for (fs_node* n = node_hash[ino % FS_NODE_HASH]; n; n = n->hash_next) {
+        if (n->ino == ino) {
+            if (n->refs++ == 0) {
+                lru_unlink(n);
+            }
+            return n;
+        }
+    }
+
+    uint32_t lba = ino < inode_count ? inode_lba(ino) : 0;
+    const uint8_t* stored = lba ? blkdev_map(fs_dev, lba) : NULL;
+    if (!stored) {
+        print("FS: cannot read inode\n");
+        return NULL;
+    }
+
+    fs_node* n = node_slot();
+    if (!n) {
+        blkdev_unmap(stored);
+        return NULL;
+    }
+    memcpy(&n->inode, stored, sizeof(fs_inode_t));
+    blkdev_unmap(stored);
+
+    if (!inode_valid(&n->inode)) {
+        print("FS: bad inode ");
+        print(name);
+        print("\n");
+        memset(n, 0, sizeof(fs_node));
+        lru_push_head(n);
+        return NULL;
+    }
+
+    n->ino = ino;
+    strlcpy(n->name, name, sizeof(n->name));
+    n->parent = parent;
+    if (parent) {
+        parent->refs++;
+    }
+    n->refs = 1;
+    hash_insert(n);
+    return n;
+}
+
+// Reads a directory's entries into memory on first use, with the index
+// stored after them. A directory without a usable one on disk gets its
+// names hashed and the index built afresh. 0 on success.
+static int dir_load(fs_node* dir) {
+    if (dir->entries) {
+        return 0;
+    }
+
+    uint32_t count = dir->inode.size / sizeof(fs_dirent_t);
+    uint32_t capacity = count < FS_DIR_MIN_ENTRIES ? FS_DIR_MIN_ENTRIES : count;
+    fs_dirent_t* entries = (fs_dirent_t*)kmalloc(capacity * sizeof(fs_dirent_t));
+    if (!entries) {
+        return 1;
+    }
+    if (count && !extents_io(&dir->inode, 0, (uint8_t*)entries, count * sizeof(fs_dirent_t), 0)) {
+        print("FS: cannot read directory ");
+        print(dir->name);
+        print("\n");
+        kfree(entries);
+        return 1;
+    }
+
+    dir->entries = entries;
+    dir->entry_count = count;
+    dir->entry_capacity = capacity;
+    if (index_read(dir)) {
+        for (uint32_t i = 0; i < count; i++) {
+            entries[i].name[MAX_NAME_LEN - 1] = '\0';
+            entries[i].hash = name_hash(entries[i].name);
+        }
+        if (index_build(dir, index_size(count))) {
+            kfree(entries);
+            dir->entries = NULL;
+            dir->entry_count = dir->entry_capacity = 0;
+            return 1;
+        }
+        if (count >= FS_INDEX_MIN) {
+            sectors_all(&dir->entry_sectors, count * sizeof(fs_dirent_t)); // With their hashes
+            node_dirty(dir);
+        }
+    }
+    return 0;
+}
+
+// Index of a directory's entry with the given name and type, or -1.
+// One probe of the hash index, names compared only on a full hash match.
+static int dir_find(fs_node* dir, const char* name, int type) {
+    if (dir_load(dir)) {
+        return -1;
+    }
+
+    uint32_t hash = name_hash(name);
+    uint32_t mask = dir->index_buckets - 1;
+    for (uint32_t k = hash & mask; dir->index[k]; k = (k + 1) & mask) {
+        const fs_dirent_t* entry = &dir->entries[dir->index[k] - 1];
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return type < 0 || entry->type == type ? (int)dir->index[k] - 1 : -1;
+        }
+    }
+    return -1;
+}
+
+// Looks a name up in a directory and returns its node with a
+// reference. The name cache answers first, hits and misses alike; only
+// names it has not seen go to the directory.
+static fs_node* dir_lookup(fs_node* dir, const char* name, int type) {
+    if (strlen(name) >= MAX_NAME_LEN) {
+        return NULL; // Longer than any stored name
+    }
+
+    uint32_t hash = name_hash(name);
+    dentry_t* d = dentry_find(dir->ino, name, hash);
+    if (!d) {
+        int i = dir_find(dir, name, -1);
+        if (i < 0 && !dir->entries) {
+            return NULL; // Unreadable, not known to be missing
+        }
+        d = i < 0 ? dentry_add(dir->ino, name, hash, 0, 0)
+                  : dentry_add(dir->ino, name, hash, dir->entries[i].inode, dir->entries[i].type);
+    }
+
+    if (!d->ino || (type >= 0 && d->type != type)) {
+        return NULL;
+    }
+    return node_get(dir, d->ino, d->name);
+}
+
+// Adds a new inode to a directory and returns its node with a
+// reference. -1 in *err when the directory cannot take it, -2 when no
+// inode is left, -3 when the name is taken.
+static fs_node* node_create(fs_node* dir, const char* name, uint8_t type, int* err) {
+    *err = -1;
+    if (dir_find(dir, name, -1) >= 0) {
+        *err = -3;
+        return NULL;
+    }
+    if (!dir->entries) {
+        return NULL;
+    }
+
+    if (dir->entry_count == dir->entry_capacity) {
+        fs_dirent_t* grown = (fs_dirent_t*)krealloc(dir->entries, 2 * dir->entry_capacity * sizeof(fs_dirent_t));
+        if (!grown) {
             return NULL;
         }
-        
-        component = strtok(NULL, "/");
+        dir->entries = grown;
+        dir->entry_capacity *= 2;
+    }
+    if (index_size(dir->entry_count + 1) > dir->index_buckets &&
+        index_build(dir, index_size(dir->entry_count + 1))) {
+        return NULL;
+    }
+
+    uint32_t ino = inode_alloc();
+    if (!ino) {
+        *err = -2;
+        return NULL;
+    }
+    fs_node* n = node_slot();
+    if (!n) {
+        inode_release(ino);
+        return NULL;
+    }
+
+    n->ino = ino;
+    strncpy(n->name, name, MAX_NAME_LEN - 1);
+    n->name[MAX_NAME_LEN - 1] = '\0';
+    n->inode.used = 1;
+    n->inode.type = type;
+    n->inode.parent = dir->ino;
+    n->parent = dir;
+    dir->refs++;
+    n->refs = 1;
+    hash_insert(n);
+    node_dirty(n);
+
+    fs_dirent_t* entry = &dir->entries[dir->entry_count++];
+    memset(entry, 0, sizeof(fs_dirent_t));
+    entry->inode = ino;
+    entry->type = type;
+    strlcpy(entry->name, n->name, sizeof(entry->name));
+    entry->hash = name_hash(entry->name);
+    dentry_drop(dir->ino, entry->name);
+
+    uint32_t k = entry->hash & (dir->index_buckets - 1);
+    while (dir->index[k]) {
+        k = (k + 1) & (dir->index_buckets - 1);
     }
-    
+    dir->index[k] = dir->entry_count;
+    bucket_dirty(dir, k);
+    entry_dirty(dir, dir->entry_count - 1);
+    return n;
+}
+
+// Takes entry i out of its directory and frees the node behind it,
+// which the caller holds the only reference to
+static void node_delete(fs_node* dir, int i, fs_node* n) {
+    dentry_drop(dir->ino, dir->entries[i].name);
+    uint32_t last = dir->entry_count - 1;
+    index_remove(dir, index_bucket(dir, i));
+    if ((uint32_t)i != last) {
+        uint32_t k = index_bucket(dir, last);
+        dir->index[k] = i + 1;
+        bucket_dirty(dir, k);
+        dir->entries[i] = dir->entries[last];
+    }
+    dir->entry_count--;
+    entry_dirty(dir, i);
+    entry_dirty(dir, last);
+
+    extents_free(&n->inode);
+    inode_release(n->ino);
+    hash_remove(n);
+    kfree(n->entries);
+    kfree(n->index);
+    fs_node* parent = n->parent;
+    memset(n, 0, sizeof(fs_node));
+    lru_push_head(n);
+    fs_release(parent);
+}
+
+// Starts an empty tree: inode bitmap, one block of inode table and the
+// root directory as inode 0
+static int tree_init(void) {
+    cache_reset();
+    if (inodes_init(FS_BLOCK_SECTORS)) {
+        return 1;
+    }
+
+    fs_node* root = node_slot();
+    inode_mark(0, 1);
+    strlcpy(root->name, "/", sizeof(root->name));
+    root->inode.used = 1;
+    root->inode.type = FS_DIR_TYPE;
+    root->refs = 2; // The mount and current_dir
+    hash_insert(root);
+    node_dirty(root);
+
+    fs_root = root;
+    current_dir = root;
+    strlcpy(current_path, "/", sizeof(current_path));
+    return 0;
+}
+
+fs_node *find_node(const char *path) {
+    if (!fs_root) {
+        return NULL;
+    }
+
+    fs_node *current = (path[0] == '/') ? fs_root : current_dir;
+    current->refs++;
+    char name[MAX_NAME_LEN];
+    while (*path) {
+        while (*path == '/') {
+            path++;
+        }
+        size_t len = 0;
+        while (path[len] && path[len] != '/') {
+            len++;
+        }
+        if (!len) {
+            break;
+        }
+
+        fs_node *child = NULL;
+        if (len < MAX_NAME_LEN) {
+            memcpy(name, path, len);
+            name[len] = '\0';
+            child = dir_lookup(current, name, FS_DIR_TYPE);
+        }
+        fs_release(current);
+        if (!child) {
+            return NULL;
+        }
+        current = child;
+        path += len;
+    }
+
     return current;
 }
 
 int chdir(const char *path) {
     fs_node *node = find_node(path);
-    if (node == NULL || node->type != FS_DIR_TYPE) {
+    if (node == NULL || node->inode.type != FS_DIR_TYPE) {
+        fs_release(node);
         return -1;
     }
 
@@ -155,7 +1334,7 @@ int chdir(const char *path) {
     char *dst = normalized;
     const char *src = current_path;
     char prev = '\0';
-    
+
     while (*src) {
         if (*src == '/') {
             if (prev != '/') {
@@ -172,8 +1351,9 @@ int chdir(const char *path) {
     if (normalized[0] == '\0') {
         strlcpy(normalized, "/", sizeof(normalized));
     }
-    
+
     strlcpy(current_path, normalized, sizeof(current_path));
+    fs_release(current_dir);
     current_dir = node;
     return 0;
 }
@@ -182,175 +1362,476 @@ const char *getcwd(void) {
     return current_path;
 }
 
-void fs_init(uint32_t lba) {
-    print("Initializing filesystem at LBA: ");
+void fs_init(int dev, uint32_t lba) {
+    print("Initializing filesystem on ");
+    print(blkdev_get(dev) ? blkdev_get(dev)->name : "?");
+    print(" at LBA: ");
     print_hex(lba);
     print("\n");
-    use_ahci = 1;
-    use_ramdisk = 0;
+    fs_dev = dev;
+    fs_start_sector = lba;
+    writeback_held = 0;
     fs_load();
 
-    if (node_count == 0) {
-        node_count = 0;
-        memset(node_pool, 0, sizeof(node_pool));
-
-        strlcpy(fs_root.name, "/", sizeof(fs_root.name));
-        fs_root.type = FS_DIR_TYPE;
-        fs_root.parent = NULL;
-        fs_root.child_count = 0;
-        fs_root.size = 0;
+    if (!fs_root) {
+        legacy_nodes = 0;
+        layout_init(region_sectors(dev, lba), FS_BITMAP_START);
+        tree_init();
+        // Everything is still marked for the first save; it just does
+        // not count towards starting one
+        dirty_count = 0;
+        writeback_held = 1;
+        print("FS: the new file system is only written by sync or format\n");
+    }
+}
 
-        for (int i = 0; i < MAX_CHILDREN; i++) {
-            fs_root.children[i] = NULL;
+// Writes the sectors of a bitmap whose bits are set in mask, each run
+// of them in one transfer. Returns 1 on success and adds the sectors.
+static int map_store(uint32_t lba, uint8_t* map, uint32_t mask, uint32_t* sectors) {
+    int ok = 1;
+    while (mask) {
+        uint32_t first = __builtin_ctz(mask);
+        uint32_t n = 0;
+        while (first + n < 32 && (mask & (1u << (first + n)))) {
+            mask &= ~(1u << (first + n));
+            n++;
         }
-        
-        current_dir = &fs_root;
-        node_count = 1;
-        strlcpy(current_path, "/", sizeof(current_path));
+        ok &= write_sectors(lba + first, n, map + first * 512);
+        *sectors += n;
     }
+    return ok;
 }
 
-void fs_save(void) {
-    uint8_t buffer[512];
-    memset(buffer, 0, sizeof(buffer));
-    
-    *(uint32_t*)(buffer) = FS_SIGNATURE;
-    *(uint32_t*)(buffer + 4) = node_count;
+// Hands what changed since the last save to the block layer: dirty
+// inodes, the changed sectors of directories and of both bitmaps. The
+// cache writes them back sorted, adjacent sectors in one command. When
+// the inode table moved or grew, a barrier puts everything on stable
+// media before the header, written with FUA, commits the new layout;
+// otherwise the header stays as it is, since its free counts are only
+// a hint that mounting recounts, and a flush makes the changes durable.
+// Once the metadata on disk no longer points at freed blocks they are
+// discarded. Returns 0 on success.
+static int fs_sync(int verbose) {
+    if (!fs_root) {
+        return 1;
+    }
 
-    write_sectors(0, 1, buffer);
+    uint64_t start = timer_ticks();
 
-    for (int i = 0; i < node_count; i++) {
-        memset(buffer, 0, sizeof(buffer));
+    int ok = 1;
+    uint32_t sectors = 0;
+    for (int i = 0; i < FS_NODE_CACHE; i++) {
+        if (node_cache[i].inode.used) {
+            ok &= node_store(&node_cache[i], &sectors);
+        }
+    }
 
-        fs_node node_copy = node_pool[i];
+    ok &= map_store(fs_start_sector + bitmap_start, block_map, bitmap_dirty, &sectors);
+    ok &= map_store(block_lba(inode_map_block), inode_map, imap_dirty, &sectors);
+    if (ok) {
+        bitmap_dirty = imap_dirty = 0;
+    }
 
-        if (node_copy.parent) {
-            node_copy.parent = (fs_node*)(uintptr_t)(node_copy.parent - node_pool);
+    if (header_dirty) {
+        uint8_t* image = (uint8_t*)kcalloc(1, 512);
+        if (!image) {
+            print("FS save: out of memory\n");
+            return 1;
+        }
+        ok = ok && blkdev_barrier(fs_dev) == 0;
+
+        fs_header_t* header = (fs_header_t*)image;
+        header->magic = FS_SIGNATURE;
+        header->version = FS_VERSION;
+        header->node_count = inode_count;
+        header->bitmap_start = bitmap_start;
+        header->bitmap_sectors = bitmap_sectors;
+        header->data_start = data_start;
+        header->block_count = block_count;
+        header->free_blocks = free_blocks;
+        header->inode_map = inode_map_block;
+        header->free_inodes = free_inodes;
+        header->table_extent_count = inode_table_extents;
+        memcpy(header->table, inode_table, sizeof(inode_table));
+        ok = ok && blkdev_write_fua(fs_dev, fs_start_sector, 1, image) == 0;
+        kfree(image);
+        sectors++;
+        if (ok) {
+            header_dirty = 0;
         }
+    } else {
+        ok = ok && blkdev_fsync(fs_dev) == 0;
+    }
 
-        for (int j = 0; j < node_copy.child_count; j++) {
-            if (node_copy.children[j]) {
-                node_copy.children[j] = (fs_node*)(uintptr_t)(node_copy.children[j] - node_pool);
+    if (ok) {
+        // Blocks the old metadata held and the new one does not
+        uint32_t first = 0;
+        for (uint32_t b = 0; b <= block_count; b++) {
+            if (b < block_count && bit_test(committed_map, b) && !bit_test(block_map, b)) {
+                continue;
             }
+            if (b > first) {
+                blkdev_discard(fs_dev, block_lba(first), (b - first) * FS_BLOCK_SECTORS);
+            }
+            first = b + 1;
         }
+        memcpy(committed_map, block_map, bitmap_sectors * 512);
+        memcpy(committed_inodes, inode_map, FS_IMAP_BLOCKS * FS_BLOCK_SIZE);
 
-        memcpy(buffer, &node_copy, sizeof(fs_node));
+        if (legacy_nodes) {
+            blkdev_discard(fs_dev, fs_start_sector + 1, legacy_nodes);
+            legacy_nodes = 0;
+        }
+        dirty_count = 0;
+    }
 
-        ahci_write_sectors(1 + i, 1, buffer);
+    if (!verbose && ok) {
+        return 0;
     }
+    uint32_t elapsed = (uint32_t)((timer_ticks() - start) * 1000 / TIMER_HZ);
+    char num_buf[12];
+    print(ok ? "FS saved: " : "FS save failed: ");
+    itoa(inode_count - free_inodes, num_buf, 10);
+    print(num_buf);
+    print(" nodes, ");
+    itoa(sectors, num_buf, 10);
+    print(num_buf);
+    print(" sectors in ");
+    itoa(elapsed, num_buf, 10);
+    print(num_buf);
+    print(" ms\n");
+    return ok ? 0 : 1;
 }
 
-int fs_write(const char *filename, const void *data, size_t size) {
-    fs_node *file = NULL;
-    for (int i = 0; i < current_dir->child_count; i++) {
-        fs_node *child = current_dir->children[i];
-        if (child && child->type == FS_FILE_TYPE && 
-            strcmp(child->name, filename) == 0) {
-            file = child;
-            break;
+int fs_save(void) {
+    writeback_held = 0;
+    return fs_sync(1);
+}
+
+void fs_writeback_poll(void) {
+    if (fs_root && dirty_count && !writeback_held &&
+        (dirty_count >= FS_WRITEBACK_DIRTY ||
+         timer_ticks() - dirty_since >= (uint64_t)FS_WRITEBACK_MS * TIMER_HZ / 1000)) {
+        fs_sync(0);
+    }
+}
+
+// The file at a path, with a reference; created in its directory when
+// missing if create is set
+static fs_node* file_open(const char* path, int create) {
+    const char* name = strrchr(path, '/');
+    fs_node* dir = current_dir;
+    if (name) {
+        char dir_path[MAX_PATH_LEN];
+        size_t len = name == path ? 1 : (size_t)(name - path);
+        if (len >= sizeof(dir_path)) {
+            return NULL;
         }
+        memcpy(dir_path, path, len);
+        dir_path[len] = '\0';
+        dir = find_node(dir_path);
+        if (!dir) {
+            return NULL;
+        }
+        name++;
+    } else {
+        name = path;
+        dir->refs++;
     }
 
+    fs_node* file = dir_lookup(dir, name, FS_FILE_TYPE);
+    if (!file && create && *name) {
+        int err;
+        file = node_create(dir, name, FS_FILE_TYPE, &err);
+    }
+    fs_release(dir);
+    return file;
+}
+
+int fs_write(const char *filename, const void *data, size_t size) {
+    fs_node *file = file_open(filename, 1);
     if (!file) {
-        if (create_file(filename) != 0) {
-            return -1;
-        }
+        return -1;
+    }
+    fs_inode_t* inode = &file->inode;
+
+    // The old blocks go back first so that the new data may reuse any
+    // of them the disk is not committed to. Until the new blocks are
+    // found, the old inode is kept to put back.
+    fs_inode_t old = *inode;
+    extents_free(inode);
+    memset(inode->content, 0, sizeof(inode->content));
+    inode->size = 0;
+
+    if (size <= FS_INLINE_SIZE) {
+        memcpy(inode->content, data, size);
+        inode->size = size;
+        node_dirty(file);
+        fs_release(file);
+        fs_writeback_poll();
+        return size;
+    }
 
-        for (int i = 0; i < current_dir->child_count; i++) {
-            if (strcmp(current_dir->children[i]->name, filename) == 0) {
-                file = current_dir->children[i];
-                break;
-            }
+    int n = -1;
+    if (size <= (size_t)block_count * FS_BLOCK_SIZE) {
+        n = extents_alloc(inode->extents, (uint32_t)((size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE), FS_MAX_EXTENTS);
+    }
+    if (n < 0) {
+        // Nothing was taken, so the old blocks are still free to claim
+        *inode = old;
+        for (int i = 0; i < inode->extent_count; i++) {
+            blocks_mark(inode->extents[i].start, inode->extents[i].count, 1);
         }
-        if (!file) return -1;
+        print("FS: no space left for ");
+        print(filename);
+        print("\n");
+        fs_release(file);
+        return -1;
+    }
+    inode->extent_count = n;
+    inode->size = size;
+    node_dirty(file);
+
+    int ok = extents_io(inode, 0, (uint8_t*)data, size, 1);
+    if (!ok) {
+        extents_free(inode);
+        inode->size = 0;
     }
+    fs_release(file);
+    fs_writeback_poll();
+    return ok ? (int)size : -1;
+}
 
-    size_t to_copy = size;
-    if (to_copy > MAX_FILE_SIZE) {
-        to_copy = MAX_FILE_SIZE;
+int fs_lookup(const char *name) {
+    if (!current_dir) {
+        return -1;
     }
-    
-    memcpy(file->content, data, to_copy);
-    file->size = to_copy;
-    
-    return to_copy;
+    int i = dir_find(current_dir, name, -1);
+    return i < 0 ? -1 : (int)current_dir->entries[i].inode;
 }
 
 int fs_read(const char *filename, void *buf, size_t size) {
-    fs_node *file = NULL;
-    for (int i = 0; i < current_dir->child_count; i++) {
-        fs_node *child = current_dir->children[i];
-        if (child && child->type == FS_FILE_TYPE && 
-            strcmp(child->name, filename) == 0) {
-            file = child;
+    fs_node *file = file_open(filename, 0);
+    if (!file) {
+        return -1;
+    }
+
+    size_t to_copy = (size < file->inode.size) ? size : file->inode.size;
+    int ok = 1;
+    if (!file->inode.extent_count) {
+        memcpy(buf, file->inode.content, to_copy);
+    } else {
+        ok = extents_io(&file->inode, 0, (uint8_t*)buf, to_copy, 0);
+    }
+    fs_release(file);
+    return ok ? (int)to_copy : -1;
+}
+
+// Rebuilds a version 1 or 2 node table as inodes and directory entries,
+// keeping the table index as the inode number. Nothing is written over
+// the old table, so it stays valid until the new header is committed.
+static int upgrade_legacy(uint32_t count) {
+    legacy_node_t* old = (legacy_node_t*)kcalloc(count, sizeof(legacy_node_t));
+    fs_dirent_t* entries = (fs_dirent_t*)kcalloc(16, sizeof(fs_dirent_t));
+    if (!old || !entries) {
+        kfree(old);
+        kfree(entries);
+        return 1;
+    }
+
+    blkdev_prefetch(fs_dev, fs_start_sector + 1, count);
+    blk_wait_all();
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* stored = blkdev_map(fs_dev, fs_start_sector + 1 + i);
+        if (!stored) {
+            print("FS load: cannot read node\n");
+            count = i;
             break;
         }
+        memcpy(&old[i], stored, sizeof(legacy_node_t));
+        blkdev_unmap(stored);
     }
 
-    if (!file) {
-        return -1;
+    // Whatever the tree does not reach was free. Reused slots may sit
+    // before their parent, so go over the table until nothing changes.
+    uint64_t reached = count ? 1 : 0;
+    uint64_t seen = 0;
+    while (reached != seen) {
+        seen = reached;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!((reached >> i) & 1) || old[i].type != FS_DIR_TYPE) {
+                continue;
+            }
+            for (int j = 0; j < old[i].child_count && j < 16; j++) {
+                if (old[i].children[j] && old[i].children[j] < count) {
+                    reached |= 1ULL << old[i].children[j];
+                }
+            }
+        }
     }
 
-    size_t to_copy = (size < file->size) ? size : file->size;
-    memcpy(buf, file->content, to_copy);
-    return to_copy;
+    int err = count == 0 || inodes_init(count);
+    for (uint32_t i = 0; i < count && !err; i++) {
+        if (!((reached >> i) & 1)) {
+            continue;
+        }
+
+        fs_inode_t inode;
+        memset(&inode, 0, sizeof(inode));
+        inode.used = 1;
+        inode.type = old[i].type;
+        inode.parent = i ? (uint32_t)old[i].parent : 0;
+
+        if (old[i].type == FS_DIR_TYPE) {
+            uint32_t n = 0;
+            for (int j = 0; j < old[i].child_count && j < 16; j++) {
+                uint64_t c = old[i].children[j];
+                if (c && c < count) {
+                    memset(&entries[n], 0, sizeof(fs_dirent_t));
+                    entries[n].inode = (uint32_t)c;
+                    entries[n].type = old[c].type;
+                    memcpy(entries[n].name, old[c].name, MAX_NAME_LEN - 1);
+                    n++;
+                }
+            }
+            inode.size = n * sizeof(fs_dirent_t);
+            err = n && (extents_reserve(&inode, inode.size) ||
+                        !extents_io(&inode, 0, (uint8_t*)entries, inode.size, 1));
+        } else {
+            inode.size = old[i].size;
+            inode.extent_count = old[i].extent_count;
+            memcpy(inode.content, old[i].content, sizeof(inode.content));
+            if (!inode_valid(&inode)) {
+                print("FS load: bad extents in ");
+                print(old[i].name);
+                print("\n");
+                memset(inode.extents, 0, sizeof(inode.extents));
+                inode.extent_count = 0;
+                inode.size = 0;
+            }
+        }
+
+        uint8_t sector[512];
+        memset(sector, 0, sizeof(sector));
+        memcpy(sector, &inode, sizeof(inode));
+        err = err || !write_sectors(inode_lba(i), 1, sector);
+        inode_mark(i, 1);
+    }
+
+    kfree(old);
+    kfree(entries);
+    legacy_nodes = count;
+    return err;
 }
 
 void fs_load(void) {
-    uint8_t buffer[512];
+    cache_reset();
+    legacy_nodes = 0;
 
-    uint32_t fs_start = find_fs_partition();
-    read_sectors(fs_start, 1, buffer);
+    // Metadata is read in place from the block cache's frames
+    const fs_header_t* header = fs_dev < 0 ? NULL : blkdev_map(fs_dev, fs_start_sector);
 
-    if (*(uint32_t*)buffer != FS_SIGNATURE) {
+    if (!header || !fs_probe(header)) {
+        blkdev_unmap(header);
         print("No valid FS found. Creating new.\n");
-        node_count = 0;
         return;
     }
 
-    node_count = *(uint32_t*)(buffer + 4);
-    
-    if (node_count > MAX_NODES) {
+    fs_header_t h = *header;
+    blkdev_unmap(header);
+
+    if (h.version < 3 && h.node_count > FS_LEGACY_NODES) {
         print("FS corrupted: too many nodes\n");
-        node_count = 0;
         return;
     }
 
-    for (int i = 0; i < node_count; i++) {
-        read_sectors(1 + i, 1, buffer);
-        memcpy(&node_pool[i], buffer, sizeof(fs_node));
+    if (h.version < 2) {
+        if (layout_init(region_sectors(fs_dev, fs_start_sector), FS_LEGACY_BITMAP_START)) {
+            return;
+        }
+    } else if (h.bitmap_start < 1 || h.bitmap_sectors > FS_MAX_BITMAP_SECTORS ||
+               h.block_count > h.bitmap_sectors * FS_BITS_PER_SECTOR ||
+               h.data_start < h.bitmap_start + h.bitmap_sectors) {
+        print("FS corrupted: bad data area\n");
+        return;
+    } else if (maps_init(h.block_count, h.bitmap_start, h.data_start)) {
+        return;
+    } else {
+        if (!read_sectors(fs_start_sector + bitmap_start, bitmap_sectors, block_map)) {
+            print("FS load: cannot read the block bitmap\n");
+            return;
+        }
+        memcpy(committed_map, block_map, bitmap_sectors * 512);
+        bitmap_dirty = 0;
+        free_blocks = 0;
+        for (uint32_t b = 0; b < block_count; b++) {
+            free_blocks += !bit_test(block_map, b);
+        }
     }
 
-    for (int i = 0; i < node_count; i++) {
-        fs_node *node = &node_pool[i];
-
-        if (node->parent) {
-            uintptr_t parent_index = (uintptr_t)node->parent;
-            if (parent_index < node_count) {
-                node->parent = &node_pool[parent_index];
-            } else {
-                node->parent = NULL;
-            }
+    if (h.version < 3) {
+        print("FS: converting version ");
+        print_hex(h.version);
+        print(", upgraded on the next save\n");
+        if (upgrade_legacy(h.node_count)) {
+            print("FS load: conversion failed\n");
+            return;
+        }
+    } else {
+        // extents_grow may fill every slot, so FS_MAX_EXTENTS is valid
+        int table_ok = h.table_extent_count <= FS_MAX_EXTENTS;
+        for (uint32_t i = 0; table_ok && i < h.table_extent_count; i++) {
+            table_ok = (uint64_t)h.table[i].start + h.table[i].count <= block_count;
+        }
+        uint32_t table_blocks = table_ok ? extents_blocks(h.table, h.table_extent_count) : 0;
+        if (!table_ok || h.node_count > FS_MAX_INODES ||
+            h.node_count > table_blocks * FS_BLOCK_SECTORS || h.inode_map + FS_IMAP_BLOCKS > block_count) {
+            print("FS corrupted: bad inode table\n");
+            return;
         }
 
-        for (int j = 0; j < node->child_count; j++) {
-            if (node->children[j]) {
-                uintptr_t child_index = (uintptr_t)node->children[j];
-                if (child_index < node_count) {
-                    node->children[j] = &node_pool[child_index];
-                } else {
-                    node->children[j] = NULL;
-                }
-            }
+        kfree(inode_map);
+        kfree(committed_inodes);
+        inode_map = (uint8_t*)kcalloc(FS_IMAP_BLOCKS, FS_BLOCK_SIZE);
+        committed_inodes = (uint8_t*)kcalloc(FS_IMAP_BLOCKS, FS_BLOCK_SIZE);
+        if (!inode_map || !committed_inodes) {
+            print("FS load: out of memory\n");
+            return;
         }
+        inode_map_block = h.inode_map;
+        inode_count = h.node_count;
+        inode_table_extents = h.table_extent_count;
+        memcpy(inode_table, h.table, sizeof(inode_table));
+
+        uint32_t imap_sectors = (inode_count + FS_BITS_PER_SECTOR - 1) / FS_BITS_PER_SECTOR;
+        if (!read_sectors(block_lba(inode_map_block), imap_sectors, inode_map)) {
+            print("FS load: cannot read the inode bitmap\n");
+            return;
+        }
+        memcpy(committed_inodes, inode_map, FS_IMAP_BLOCKS * FS_BLOCK_SIZE);
+        free_inodes = 0;
+        for (uint32_t i = 0; i < inode_count; i++) {
+            free_inodes += !bit_test(inode_map, i);
+        }
+        imap_dirty = 0;
+        header_dirty = 0;
+        dirty_count = 0;
     }
 
-    fs_root = node_pool[0];
-    current_dir = &fs_root;
-    
+    fs_node* root = node_get(NULL, 0, "/");
+    if (!root || root->inode.type != FS_DIR_TYPE) {
+        print("FS corrupted: no root directory\n");
+        fs_release(root);
+        return;
+    }
+    root->refs++; // current_dir's
+    fs_root = root;
+    current_dir = root;
+    strlcpy(current_path, "/", sizeof(current_path));
+
     print("FS loaded successfully. Nodes: ");
     char num_buf[12];
-    itoa(node_count, num_buf, 10);
+    itoa(inode_count - free_inodes, num_buf, 10);
     print(num_buf);
     print("\n");
 }
@@ -364,167 +1845,108 @@ void print_tree(fs_node* node, int depth) {
 
     print(node->name);
 
-    if (node->type == FS_DIR_TYPE) {
+    if (node->inode.type == FS_DIR_TYPE) {
         print("/");
     }
     print("\n");
 
-    if (node->type == FS_DIR_TYPE) {
-        for (int i = 0; i < node->child_count; i++) {
-            if (node->children[i] != NULL) {
-                print_tree(node->children[i], depth + 1);
-            }
+    if (node->inode.type == FS_DIR_TYPE && !dir_load(node)) {
+        for (uint32_t i = 0; i < node->entry_count; i++) {
+            fs_node* child = node_get(node, node->entries[i].inode, node->entries[i].name);
+            print_tree(child, depth + 1);
+            fs_release(child);
         }
     }
 }
 
 void fs_tree() {
-    print_tree(&fs_root, 0);
+    print_tree(fs_root, 0);
 }
 
 int create_file(const char* name) {
-    if (current_dir->child_count >= MAX_CHILDREN) {
-        return -1;
-    }
-
-    if (node_count >= MAX_NODES) {
-        return -2;
+    int err;
+    fs_node* node = node_create(current_dir, name, FS_FILE_TYPE, &err);
+    if (!node) {
+        return err;
     }
-
-    fs_node **new_file_ptr = &current_dir->children[current_dir->child_count];
-    *new_file_ptr = &node_pool[node_count++];
-
-    strncpy((*new_file_ptr)->name, name, MAX_NAME_LEN - 1);
-    (*new_file_ptr)->name[MAX_NAME_LEN - 1] = '\0';
-    (*new_file_ptr)->type = FS_FILE_TYPE;
-    (*new_file_ptr)->parent = current_dir;
-    (*new_file_ptr)->child_count = 0;
-    
-    current_dir->child_count++;
+    fs_release(node);
+    fs_writeback_poll();
     return 0;
 }
 
-int delete_file(const char* name) {
-    for (int i = 0; i < current_dir->child_count; i++) {
-        fs_node *child = current_dir->children[i];
-        if (child != NULL && 
-            strcmp(child->name, name) == 0 && 
-            child->type == FS_FILE_TYPE) {
-
-            for (int j = i; j < current_dir->child_count - 1; j++) {
-                current_dir->children[j] = current_dir->children[j + 1];
-            }
-            
-            current_dir->child_count--;
-            current_dir->children[current_dir->child_count] = NULL;
-            return 0;
-        }
+// Removes an entry of the current directory; -2 for a directory that
+// is not empty or a node still in use
+static int remove_entry(const char* name, int type) {
+    int i = dir_find(current_dir, name, type);
+    if (i < 0) {
+        return -1;
     }
-    return -1;
-}
 
-int create_dir(const char* name) {
-    if (current_dir->child_count >= MAX_CHILDREN) {
+    fs_node* child = node_get(current_dir, current_dir->entries[i].inode, name);
+    if (!child) {
         return -1;
     }
-
-    if (node_count >= MAX_NODES) {
+    uint32_t entries = child->entries ? child->entry_count : child->inode.size / sizeof(fs_dirent_t);
+    if (child->refs > 1 || (type == FS_DIR_TYPE && entries)) {
+        fs_release(child);
         return -2;
     }
 
-    fs_node **new_dir_ptr = &current_dir->children[current_dir->child_count];
-    *new_dir_ptr = &node_pool[node_count++];
+    node_delete(current_dir, i, child);
+    fs_writeback_poll();
+    return 0;
+}
 
-    strncpy((*new_dir_ptr)->name, name, MAX_NAME_LEN - 1);
-    (*new_dir_ptr)->name[MAX_NAME_LEN - 1] = '\0';
-    (*new_dir_ptr)->type = FS_DIR_TYPE;
-    (*new_dir_ptr)->parent = current_dir;
-    (*new_dir_ptr)->child_count = 0;
+int delete_file(const char* name) {
+    return remove_entry(name, FS_FILE_TYPE);
+}
 
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        (*new_dir_ptr)->children[i] = NULL;
+int create_dir(const char* name) {
+    int err;
+    fs_node* node = node_create(current_dir, name, FS_DIR_TYPE, &err);
+    if (!node) {
+        return err;
     }
-    
-    current_dir->child_count++;
+    fs_release(node);
+    fs_writeback_poll();
     return 0;
 }
 
 int delete_dir(const char* name) {
-    for (int i = 0; i < current_dir->child_count; i++) {
-        fs_node *child = current_dir->children[i];
-        if (child != NULL && 
-            strcmp(child->name, name) == 0 && 
-            child->type == FS_DIR_TYPE) {
-
-            if (child->child_count > 0) {
-                return -2;
-            }
-
-            for (int j = i; j < current_dir->child_count - 1; j++) {
-                current_dir->children[j] = current_dir->children[j + 1];
-            }
-            
-            current_dir->child_count--;
-            current_dir->children[current_dir->child_count] = NULL;
-            return 0;
-        }
-    }
-    return -1;
+    return remove_entry(name, FS_DIR_TYPE);
 }
 
-int format_disk(uint32_t lba) {
-    uint8_t buffer[512] = {0};
+int format_disk(int dev, uint32_t lba) {
+    fs_dev = dev;
+    fs_start_sector = lba;
 
-    superblock_t* sb = (superblock_t*)buffer;
-    sb->magic = FS_MAGIC;
-    sb->block_size = 512;
-    sb->total_blocks = 65536;
-    sb->free_blocks = sb->total_blocks - 1;
-
-    memcpy(buffer, "\x4C\x57\x53\x4F\x01\x00\x00\x00", 8);
-
-    if (!write_sectors(lba, 1, buffer)) {
-        print("Error: Failed to write superblock\n");
+    if (layout_init(region_sectors(dev, lba), FS_BITMAP_START) || !block_count || tree_init()) {
+        print("Error: Not enough room for a file system\n");
         return 1;
     }
+    legacy_nodes = 0;
 
-    node_count = 0;
-    memset(node_pool, 0, sizeof(node_pool));
-    
-    strlcpy(fs_root.name, "/", sizeof(fs_root.name));
-    fs_root.type = FS_DIR_TYPE;
-    fs_root.parent = NULL;
-    fs_root.child_count = 0;
-    fs_root.size = 0;
-    
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        fs_root.children[i] = NULL;
-    }
-    
-    current_dir = &fs_root;
-    node_count = 1;
-    strlcpy(current_path, "/", sizeof(current_path));
+    if (fs_save()) {
+        print("Error: Failed to write the file system\n");
+        return 1;
+    }
 
-    fs_save();
-    
     return 0;
 }
 
 void list_files() {
-    if (current_dir->child_count == 0) {
+    if (dir_load(current_dir) || current_dir->entry_count == 0) {
         print("The catalog is empty\n");
         return;
     }
-    
+
     print("Contents of the catalog:\n");
-    for (int i = 0; i < current_dir->child_count; i++) {
-        fs_node *child = current_dir->children[i];
-        if (child != NULL) {
-            print(child->name);
-            if (child->type == FS_DIR_TYPE) {
-                print("/");
-            }
-            print("\n");
+    for (uint32_t i = 0; i < current_dir->entry_count; i++) {
+        fs_dirent_t *entry = &current_dir->entries[i];
+        print(entry->name);
+        if (entry->type == FS_DIR_TYPE) {
+            print("/");
         }
+        print("\n");
     }
 }
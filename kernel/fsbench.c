@@ -0,0 +1,123 @@
+#include "include/fsbench.h"
+#include "include/fs.h"
+#include "include/lib.h"
+#include "include/timer.h"
+
+static uint32_t rng_state = 0x9E3779B9;
+
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void print_u64(uint64_t value) {
+    char num_buf[21];
+    u64toa(value, num_buf);
+    print(num_buf);
+}
+
+// Name of scratch file i; misses use another prefix
+static void bench_name(char* name, char prefix, uint32_t i) {
+    name[0] = prefix;
+    u64toa(i, name + 1);
+}
+
+// Looks up count random names out of the first n with the given prefix
+// and returns the time taken in microseconds. found counts the hits.
+static uint64_t time_lookups(char prefix, uint32_t n, uint32_t count, uint32_t* found) {
+    char name[MAX_NAME_LEN];
+    uint64_t start = timer_us();
+    for (uint32_t i = 0; i < count; i++) {
+        bench_name(name, prefix, rng_next() % n);
+        *found += fs_lookup(name) >= 0;
+    }
+    return timer_us() - start;
+}
+
+static void print_rate(const char* what, uint64_t us, uint32_t count) {
+    print(what);
+    print_u64(us * 1000 / count);
+    print(" ns (");
+    print_u64(us ? (uint64_t)count * 1000000 / us : 0);
+    print("/s)");
+}
+
+int fsbench_run(uint32_t max_entries, uint32_t lookups) {
+    if (max_entries < FSBENCH_FIRST_SIZE || max_entries > FSBENCH_MAX_ENTRIES || !lookups) {
+        print("fsbench: size must be 16 to 16384 entries\n");
+        return 1;
+    }
+
+    char cwd[MAX_PATH_LEN];
+    strlcpy(cwd, getcwd(), sizeof(cwd));
+    if (create_dir(FSBENCH_DIR) != 0) {
+        print("fsbench: cannot create " FSBENCH_DIR " here\n");
+        return 1;
+    }
+    if (chdir(FSBENCH_DIR) != 0) {
+        delete_dir(FSBENCH_DIR);
+        return 1;
+    }
+
+    print("fsbench: ");
+    print_u64(lookups);
+    print(" lookups of each kind per size\n");
+    if (!timer_calibrated()) {
+        print("fsbench: clock not calibrated, times have tick resolution\n");
+    }
+
+    char name[MAX_NAME_LEN];
+    uint32_t created = 0;
+    int err = 0;
+    for (uint32_t size = FSBENCH_FIRST_SIZE; size <= max_entries && !err;
+         size = size < max_entries && size * 4 > max_entries ? max_entries : size * 4) {
+        uint32_t before = created;
+        uint64_t start = timer_us();
+        while (created < size) {
+            bench_name(name, 'f', created);
+            if (create_file(name) != 0) {
+                print("fsbench: file system full at ");
+                print_u64(created);
+                print(" entries\n");
+                err = 1;
+                break;
+            }
+            created++;
+        }
+        uint64_t create_us = timer_us() - start;
+        if (err) {
+            break;
+        }
+
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+        uint64_t hit_us = time_lookups('f', created, lookups, &hits);
+        uint64_t miss_us = time_lookups('m', created, lookups, &misses);
+        if (hits != lookups || misses) {
+            print("fsbench: lookups returned wrong results\n");
+            err = 1;
+        }
+
+        print("  ");
+        print_u64(created);
+        print(" entries: create ");
+        print_u64(create_us * 1000 / (created - before));
+        print(" ns");
+        print_rate(", hit ", hit_us, lookups);
+        print_rate(", miss ", miss_us, lookups);
+        print("\n");
+    }
+
+    for (uint32_t i = 0; i < created; i++) {
+        bench_name(name, 'f', i);
+        delete_file(name);
+    }
+    chdir(cwd);
+    if (delete_dir(FSBENCH_DIR) != 0) {
+        print("fsbench: could not remove " FSBENCH_DIR "\n");
+        err = 1;
+    }
+    return err;
+}
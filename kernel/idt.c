@@ -0,0 +1,207 @@
+#include "include/idt.h"
+#include "include/lib.h"
+
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI   0x20
+
+#define LAPIC_BASE_MSR 0x1B
+#define LAPIC_ID       0x20
+#define LAPIC_EOI      0xB0
+#define LAPIC_SVR      0xF0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type_attr;
+    uint16_t offset_mid;
+    uint32_t offset_high;
+    uint32_t zero;
+} __attribute__((packed)) idt_entry_t;
+
+typedef struct {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed)) idt_ptr_t;
+
+// Stubs generated in entry.asm, one per vector
+extern uint64_t isr_stub_table[256];
+
+static idt_entry_t idt[256] __attribute__((aligned(16)));
+static irq_handler_t handlers[256];
+static irq_handler_t shared[16][IRQ_SHARE_MAX]; // PCI INTx lines are often shared
+static volatile uint32_t* lapic = NULL;
+static int next_msi_vector = MSI_BASE_VECTOR;
+static uint8_t pic1_mask = 0xFF;
+static uint8_t pic2_mask = 0xFF;
+
+static const char* exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow",
+    "Bound range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS",
+    "Segment not present", "Stack fault", "General protection fault",
+    "Page fault", "Reserved", "x87 floating point", "Alignment check",
+    "Machine check", "SIMD floating point", "Virtualization",
+    "Control protection", "Reserved", "Reserved", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Hypervisor injection", "VMM communication",
+    "Security", "Reserved"
+};
+
+static void idt_set_gate(int vector, uint64_t handler) {
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = 0x08;
+    idt[vector].ist = 0;
+    idt[vector].type_attr = 0x8E; // Present, ring 0, interrupt gate
+    idt[vector].offset_mid = (handler >> 16) & 0xFFFF;
+    idt[vector].offset_high = (handler >> 32) & 0xFFFFFFFF;
+    idt[vector].zero = 0;
+}
+
+static void pic_remap(void) {
+    outb(PIC1_CMD, 0x11);
+    io_wait();
+    outb(PIC2_CMD, 0x11);
+    io_wait();
+    outb(PIC1_DATA, IRQ_BASE_VECTOR);
+    io_wait();
+    outb(PIC2_DATA, IRQ_BASE_VECTOR + 8);
+    io_wait();
+    outb(PIC1_DATA, 0x04);
+    io_wait();
+    outb(PIC2_DATA, 0x02);
+    io_wait();
+    outb(PIC1_DATA, 0x01);
+    io_wait();
+    outb(PIC2_DATA, 0x01);
+    io_wait();
+
+    outb(PIC1_DATA, pic1_mask);
+    outb(PIC2_DATA, pic2_mask);
+}
+
+static void pic_unmask(int irq) {
+    if (irq >= 8) {
+        pic2_mask &= ~(1 << (irq - 8));
+        pic1_mask &= ~(1 << 2); // Cascade
+    } else {
+        pic1_mask &= ~(1 << irq);
+    }
+
+    outb(PIC1_DATA, pic1_mask);
+    outb(PIC2_DATA, pic2_mask);
+}
+
+static uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void lapic_init(void) {
+    uint64_t base = rdmsr(LAPIC_BASE_MSR) & 0xFFFFF000;
+    lapic = (volatile uint32_t*)(unsigned long)base;
+
+    // Software-enable the local APIC with 0xFF as the spurious vector
+    lapic[LAPIC_SVR / 4] = lapic[LAPIC_SVR / 4] | 0x100 | LAPIC_SPURIOUS_VECTOR;
+
+    // The PIT drives the tick, silence whatever timer firmware left armed
+    lapic[LAPIC_LVT_TIMER / 4] = lapic[LAPIC_LVT_TIMER / 4] | (1 << 16);
+}
+
+static void lapic_eoi(void) {
+    if (lapic) {
+        lapic[LAPIC_EOI / 4] = 0;
+    }
+}
+
+uint32_t msi_address(void) {
+    uint32_t id = lapic ? lapic[LAPIC_ID / 4] >> 24 : 0;
+    return 0xFEE00000 | (id << 12);
+}
+
+void isr_dispatch(interrupt_frame_t* frame) {
+    uint64_t vector = frame->vector;
+
+    if (vector < 32) {
+        print("\nException: ");
+        print(exception_names[vector]);
+        print(" (vector ");
+        print_hex((uint32_t)vector);
+        print(", error ");
+        print_hex((uint32_t)frame->error_code);
+        print(") at RIP=");
+        print_hex((uint32_t)(frame->rip >> 32));
+        print_hex((uint32_t)frame->rip);
+        print("\n");
+        while (1) {
+            asm volatile ("cli; hlt");
+        }
+    }
+
+    if (handlers[vector]) {
+        handlers[vector](frame);
+    }
+
+    if (vector >= IRQ_BASE_VECTOR && vector < IRQ_BASE_VECTOR + 16) {
+        for (int i = 0; i < IRQ_SHARE_MAX && shared[vector - IRQ_BASE_VECTOR][i]; i++) {
+            shared[vector - IRQ_BASE_VECTOR][i](frame);
+        }
+
+        if (vector >= IRQ_BASE_VECTOR + 8) {
+            outb(PIC2_CMD, PIC_EOI);
+        }
+        outb(PIC1_CMD, PIC_EOI);
+    } else if (vector != LAPIC_SPURIOUS_VECTOR) {
+        lapic_eoi();
+    }
+}
+
+void idt_init(void) {
+    for (int i = 0; i < 256; i++) {
+        idt_set_gate(i, isr_stub_table[i]);
+    }
+
+    pic_remap();
+    lapic_init();
+
+    idt_ptr_t idtr;
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint64_t)(unsigned long)idt;
+    asm volatile ("lidt %0" : : "m"(idtr));
+
+    print("IDT initialized\n");
+}
+
+void irq_install(int irq, irq_handler_t handler) {
+    if (irq < 0 || irq >= 16) {
+        return;
+    }
+
+    // Later handlers for the same line run after the first one
+    if (!handlers[IRQ_BASE_VECTOR + irq]) {
+        handlers[IRQ_BASE_VECTOR + irq] = handler;
+    } else {
+        for (int i = 0; i < IRQ_SHARE_MAX; i++) {
+            if (!shared[irq][i]) {
+                shared[irq][i] = handler;
+                break;
+            }
+        }
+    }
+    pic_unmask(irq);
+}
+
+int msi_alloc_vector(irq_handler_t handler) {
+    if (next_msi_vector > MSI_MAX_VECTOR) {
+        return -1;
+    }
+
+    int vector = next_msi_vector++;
+    handlers[vector] = handler;
+    return vector;
+}
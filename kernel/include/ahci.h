@@ -3,6 +3,7 @@
 
 #include "stdint.h"
 #include "stddef.h"
+#include "blkdev.h"
 
 typedef struct {
     uint32_t clb;    // Command List Base Address
@@ -43,32 +44,6 @@ typedef struct {
     hba_port_t ports[32];
 } hba_mem_t;
 
-typedef struct {
-    uint64_t signature;
-    uint32_t revision;
-    uint32_t header_size;
-    uint32_t header_crc32;
-    uint32_t reserved;
-    uint64_t my_lba;
-    uint64_t alternate_lba;
-    uint64_t first_usable_lba;
-    uint64_t last_usable_lba;
-    uint8_t disk_guid[16];
-    uint64_t partition_entries_lba;
-    uint32_t num_partition_entries;
-    uint32_t size_of_partition_entry;
-    uint32_t partition_entry_array_crc32;
-} __attribute__((packed)) gpt_header_t;
-
-typedef struct {
-    uint8_t partition_type_guid[16];
-    uint8_t unique_partition_guid[16];
-    uint64_t starting_lba;
-    uint64_t ending_lba;
-    uint64_t attributes;
-    uint16_t partition_name[36];
-} __attribute__((packed)) gpt_partition_entry_t;
-
 // FIS types
 #define FIS_TYPE_REG_H2D    0x27
 #define FIS_TYPE_REG_D2H    0x34
@@ -141,11 +116,79 @@ typedef struct {
     } prdt[];
 } hba_cmd_table_t;
 
+// PRD entries per command table; longer lists are split into several commands
+#define AHCI_MAX_PRDS 56
+
+// Same layout as the block layer's, so its lists go to the drive as is
+typedef blk_sg_t ahci_sg_t;
+
+typedef struct ahci_io {
+    uint64_t lba;
+    uint32_t count;
+    void* buffer;            // Contiguous data, used when sg is NULL
+    const ahci_sg_t* sg;     // Scatter-gather list, starting sg_offset bytes in
+    uint32_t nsg;
+    uint32_t sg_offset;
+    uint8_t drive;           // Index into the detected drives, 0 = first
+    uint8_t write;
+    uint8_t trim;            // DATA SET MANAGEMENT: buffer holds count blocks of ranges
+    uint8_t flush;           // FLUSH CACHE, no data
+    uint8_t fua;             // The write bypasses the drive's cache
+    volatile int status;     // 0 = done, 1 = failed, -1 = pending
+    void (*done)(struct ahci_io* io); // Called from ahci_poll, may be NULL
+    void* ctx;
+    uint8_t retried;         // Already resubmitted after an NCQ error
+    struct ahci_io* next;    // Port queue link
+} ahci_io_t;
+
+// What IDENTIFY DEVICE reported for a drive
+typedef struct {
+    char model[41];
+    char serial[21];
+    char firmware[9];
+    uint64_t sectors;              // Capacity in logical sectors
+    uint32_t logical_sector_size;  // Bytes
+    uint32_t physical_sector_size; // Bytes
+    uint32_t alignment_offset;     // Logical sectors before the first physical boundary
+    uint32_t max_transfer;         // Logical sectors per command
+    uint8_t lba48;
+    uint8_t ncq_depth;             // 0 = no NCQ
+    uint8_t trim;
+    uint16_t trim_max_blocks;      // 512-byte blocks of DSM ranges per command
+    uint8_t write_cache;           // Supported
+    uint8_t write_cache_enabled;
+    uint8_t fua;                   // WRITE DMA FUA EXT
+    uint8_t rotational;            // Spinning media, or rate not reported
+} ahci_device_info_t;
+
+#define AHCI_CCC_OFF      0
+#define AHCI_CCC_FIXED    1 // Every port, given count and timeout
+#define AHCI_CCC_ADAPTIVE 2 // Ports with deep queues, count up to the given one
+
 void ahci_init();
+// Command completion coalescing: one interrupt for several completions
+// or after a timeout in ms. Returns 1 if the controller cannot do it or
+// completions are polled.
+int ahci_set_coalescing(int mode, uint8_t count, uint16_t timeout_ms);
+void ahci_print_coalescing(void);
+// Queues a command and returns at once; completion is reported through
+// io->status and io->done as ahci_poll finds it. 0 = queued.
+int ahci_queue(ahci_io_t* io);
+int ahci_poll(void);
+// Queues a set of commands and waits for all of them
+int ahci_submit_batch(ahci_io_t* ios, int n);
 int ahci_read_sectors(uint64_t lba, uint32_t count, void* buffer);
-int ahci_write_sectors(uint64_t lba, uint32_t count, void* buffer);
+// Transfers to or from a segment list on the first drive, in as many
+// commands as the PRDT and sector limits need; 0 on success
+int ahci_read_sg(uint64_t lba, const ahci_sg_t* sg, int nsg);
+int ahci_write_sg(uint64_t lba, const ahci_sg_t* sg, int nsg);
+
+// Every ready port is addressable as its own drive
+int ahci_drive_count(void);
+int ahci_drive_port(int drive);
+int ahci_drive_queue_depth(int drive);
+const ahci_device_info_t* ahci_drive_info(int drive);
+int ahci_drive_blkdev_id(int drive);
 void ahci_detect_drives();
-uint32_t find_fs_partition();
-int is_fs_supported(uint32_t lba);
 
 #endif
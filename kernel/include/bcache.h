@@ -0,0 +1,37 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+#define BCACHE_BLOCK_SIZE 512
+#define BCACHE_DEFAULT_BUDGET (1024 * 1024)
+#define BCACHE_MAX_DEVS 32
+#define BCACHE_RA_DEFAULT 64 // readahead window limit in blocks
+
+// Device numbers are block device ids, see blkdev.h
+// Backend transfer, returns 0 on success
+typedef int (*bcache_io_fn)(int unit, uint64_t lba, uint32_t count, void* buffer);
+
+void bcache_init(size_t budget);
+void bcache_attach(int dev, int unit, bcache_io_fn read, bcache_io_fn write);
+// Physical sector size and alignment in blocks; transfers are widened to
+// cover whole physical sectors
+void bcache_set_geometry(int dev, uint32_t granule, uint32_t offset);
+int bcache_read(int dev, uint64_t lba, uint32_t count, void* buffer);
+int bcache_write(int dev, uint64_t lba, uint32_t count, const void* buffer);
+// Starts reading a range into the cache in the background
+int bcache_prefetch(int dev, uint64_t lba, uint32_t count);
+// In-place access to one block's cache frame, pinned until unmapped
+const uint8_t* bcache_map(int dev, uint64_t lba);
+void bcache_unmap(const void* data);
+int bcache_sync(void);
+int bcache_sync_dev(int dev);
+void bcache_invalidate(int dev);
+// Forgets a range, dirty blocks included, for when its contents no
+// longer matter or are about to be written around the cache
+void bcache_drop(int dev, uint64_t lba, uint32_t count);
+void bcache_set_readahead(uint32_t max_blocks);
+void bcache_print_stats(void);
+
+#endif
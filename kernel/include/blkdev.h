@@ -0,0 +1,177 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include "stdint.h"
+#include "stddef.h"
+
+#define BLKDEV_MAX 16
+#define BLKDEV_NAME_LEN 16
+#define BLK_POOL_SIZE 64 // Requests handed out by blk_submit_*
+#define BLK_DISCARD_BATCH 16 // Freed ranges collected per device before they go out
+
+#define BLK_OP_READ  0
+#define BLK_OP_WRITE 1
+#define BLK_OP_FLUSH 2
+#define BLK_OP_DISCARD 3 // The range's contents are no longer needed
+#define BLK_OPS 4
+
+#define BLK_REQ_FUA (1 << 0) // The write is on stable media when it completes
+
+#define BLK_PENDING (-1)
+
+typedef struct blkdev blkdev_t;
+typedef struct blk_request blk_request_t;
+
+// One physically contiguous piece of a transfer. Lengths must be a
+// multiple of 512 bytes and addresses word aligned.
+typedef struct {
+    void* addr;
+    uint32_t len;
+} blk_sg_t;
+
+// Runs from blk_poll after the request has finished, never from inside
+// a driver
+typedef void (*blk_done_fn)(blk_request_t* req);
+
+struct blk_request {
+    int dev;
+    uint8_t op;
+    uint8_t flags;            // BLK_REQ_*
+    uint64_t lba;             // 512-byte units
+    uint32_t count;
+    void* buffer;             // Contiguous data, used when sg is NULL
+    const blk_sg_t* sg;       // Only for devices that take scatter-gather
+    uint32_t nsg;
+    blk_done_fn done;         // May be NULL
+    void* ctx;
+    volatile int status;      // BLK_PENDING, then 0 = success or 1 = failed
+
+    // Owned by the block layer and the driver while pending
+    uint32_t issued;          // Sectors handed to the hardware so far
+    uint32_t inflight;        // Driver commands not finished yet
+    uint8_t failed;
+    uint8_t pooled;           // Allocated by blk_submit_*
+    uint8_t merged;           // Scheduler command standing for several requests
+    blk_request_t* next;      // Driver queue link
+    uint64_t submitted_us;    // For the latency statistics
+
+    // Owned by the I/O scheduler until dispatch
+    uint32_t seq;             // Submission order
+    uint64_t deadline;        // Tick by which it should be dispatched
+    blk_request_t* sched_next;
+};
+
+// Driver entry points. LBAs and counts are in 512-byte units whatever
+// the device sector size; all return 0 on success.
+//
+// A driver either moves data synchronously through read/write (flush
+// and discard may be NULL when there is nothing to do), or queues
+// requests through submit. Queued requests are driven by poll, which
+// reaps completions, issues waiting work and calls blk_complete; ready
+// says whether completions are waiting to be collected, so idle waits
+// know whether they may halt. Queueing drivers that can drop ranges set
+// discard and receive BLK_OP_DISCARD requests.
+typedef struct {
+    int (*read)(blkdev_t* dev, uint64_t lba, uint32_t count, void* buffer);
+    int (*write)(blkdev_t* dev, uint64_t lba, uint32_t count, const void* buffer);
+    int (*flush)(blkdev_t* dev);
+    int (*discard)(blkdev_t* dev, uint64_t lba, uint32_t count);
+    int (*submit)(blkdev_t* dev, blk_request_t* req);
+    void (*poll)(blkdev_t* dev);
+    int (*ready)(blkdev_t* dev);
+} blkdev_ops_t;
+
+struct blkdev {
+    char name[BLKDEV_NAME_LEN];
+    const blkdev_ops_t* ops;
+    void* priv;                    // Driver data
+    int unit;                      // Driver's own device number
+    uint64_t sectors;              // Capacity in 512-byte units
+    uint32_t sector_size;          // Logical sector size in bytes
+    uint32_t physical_sector_size;
+    uint32_t alignment_offset;     // 512-byte units from a physical boundary to LBA 0
+    uint32_t queue_depth;          // Requests the device can work on at once
+    uint8_t polled;                // No interrupt tells us about completions
+    uint8_t rotational;            // Seeks cost time, sorting pays off
+    uint8_t sg;                    // Driver takes scatter-gather requests
+    uint8_t discard;               // Driver takes BLK_OP_DISCARD
+    uint8_t write_cache;           // Completed writes are only durable after a flush
+    uint8_t fua;                   // Driver honours BLK_REQ_FUA
+    uint8_t unflushed;             // Writes completed since the last flush started
+    int id;                        // Set by blkdev_register
+    uint32_t inflight;             // Submitted requests not completed yet
+    uint32_t dispatched;           // Commands handed to the driver
+};
+
+// The registry keeps the pointer; the driver owns the structure.
+// Returns the device id or -1.
+int blkdev_register(blkdev_t* dev);
+int blkdev_count(void);
+blkdev_t* blkdev_get(int id);
+int blkdev_find(const char* name);
+
+// Cached transfers through the block cache, 0 on success
+int blkdev_read(int id, uint64_t lba, uint32_t count, void* buffer);
+int blkdev_write(int id, uint64_t lba, uint32_t count, const void* buffer);
+// Starts reading a range into the cache without waiting for it
+int blkdev_prefetch(int id, uint64_t lba, uint32_t count);
+// Gives read access to one cached block in place, reading it first if
+// needed; NULL on failure. The block stays put until blkdev_unmap.
+const void* blkdev_map(int id, uint64_t lba);
+void blkdev_unmap(const void* data);
+// Writes back cached data and empties the device's write cache. Pending
+// discards go out first.
+int blkdev_flush(int id);
+// Writes back the device's cached data and flushes its write cache only
+// if something was written since the last flush
+int blkdev_fsync(int id);
+// Writes back the device's cached data and queues a flush without
+// waiting for it. Nothing submitted afterwards reaches the device before
+// the flush has finished, so later writes are ordered after earlier ones
+// on stable media.
+int blkdev_barrier(int id);
+// Writes through the cache and returns once the data is durable, using
+// FUA where the driver has it and a flush where it does not
+int blkdev_write_fua(int id, uint64_t lba, uint32_t count, const void* buffer);
+// Tells the device a range is unused. Cached copies are dropped at once;
+// the ranges are collected and sent in the background, trimmed to whole
+// physical sectors. A no-op on devices without discard.
+int blkdev_discard(int id, uint64_t lba, uint32_t count);
+
+void blkdev_print_list(void);
+
+// Asynchronous requests, uncached. The blk_submit_* calls take a request
+// from a pool and return it as the handle, NULL if the pool is empty or
+// the device refuses. A handle with a callback is released after the
+// callback returns; one without stays valid until blk_wait or
+// blk_release.
+blk_request_t* blk_submit_read(int id, uint64_t lba, uint32_t count, void* buffer, blk_done_fn done, void* ctx);
+blk_request_t* blk_submit_write(int id, uint64_t lba, uint32_t count, const void* buffer, blk_done_fn done, void* ctx);
+blk_request_t* blk_submit_flush(int id, blk_done_fn done, void* ctx);
+blk_request_t* blk_submit_discard(int id, uint64_t lba, uint32_t count, blk_done_fn done, void* ctx);
+// Submits a request the caller owns and has filled in; 0 when accepted
+int blk_submit(blk_request_t* req);
+// Lets every device make progress and runs finished callbacks; returns
+// the number of requests that completed
+int blk_poll(void);
+// Waits for one request and returns its status; pooled handles are
+// released. Pooled handles with a callback cannot be waited for and
+// fail at once.
+int blk_wait(blk_request_t* req);
+void blk_release(blk_request_t* req);
+// Waits until no request is outstanding on any device. Returns the
+// number of requests that failed since the previous call.
+int blk_wait_all(void);
+// Drivers: the request has finished, failed or not
+void blk_complete(blk_request_t* req);
+// While plugged, submitted requests stay with the I/O scheduler so that
+// a burst can be merged and sorted before any of it reaches a driver.
+// Plugs nest; waiting for a request dispatches regardless.
+void blk_plug(void);
+void blk_unplug(void);
+
+// Synchronous uncached transfers, thin wrappers over submit and wait
+int blk_read_direct(int id, uint64_t lba, uint32_t count, void* buffer);
+int blk_write_direct(int id, uint64_t lba, uint32_t count, const void* buffer);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef DISKBENCH_H
+#define DISKBENCH_H
+
+#include "stdint.h"
+
+#define DISKBENCH_SEQ_READ   (1 << 0)
+#define DISKBENCH_SEQ_WRITE  (1 << 1)
+#define DISKBENCH_RAND_READ  (1 << 2)
+#define DISKBENCH_RAND_WRITE (1 << 3)
+#define DISKBENCH_ALL        0x0F
+
+#define DISKBENCH_SCRATCH_SECTORS 32768 // 16 MiB at the end of the device
+#define DISKBENCH_GPT_BACKUP  33        // Logical sectors of a backup GPT at the end
+#define DISKBENCH_MAX_BLOCK   256       // sectors
+#define DISKBENCH_MAX_QD      32
+#define DISKBENCH_MAX_SECONDS 60
+
+// Runs the selected tests against a scratch range at the end of a block
+// device, uncached, and prints throughput and latency for each. Write
+// tests are skipped when the range holds a partition or the file system,
+// or when the device's partition table was never scanned.
+int diskbench_run(int dev, int tests, uint32_t block, uint32_t qd, uint32_t seconds);
+// Returns the DISKBENCH_* bits for a test name, 0 if unknown
+int diskbench_parse_tests(const char* name);
+
+#endif
@@ -5,13 +5,17 @@
 #include "stdint.h"
 
 #define MAX_NAME_LEN 32
-#define MAX_CHILDREN 16
-#define MAX_NODES 64
-#define MAX_FILE_SIZE 256
 #define MAX_PATH_LEN 128
 
-extern int use_ahci;
-extern int use_ramdisk;
+#define FS_INLINE_SIZE 256  // Files up to this size live in their inode
+#define FS_MAX_EXTENTS 32
+#define FS_BLOCK_SIZE 4096  // Allocation unit of file data
+#define FS_BLOCK_SECTORS (FS_BLOCK_SIZE / 512)
+#define FS_MAX_INODES 65536
+#define FS_NODE_CACHE 256   // Inodes kept in memory at most
+#define FS_INDEX_MIN 16     // Directories this large keep their hash index on disk
+#define FS_WRITEBACK_DIRTY 64  // Changed inodes and bitmap sectors that start a save
+#define FS_WRITEBACK_MS 5000   // Longest a change waits to be saved
 
 typedef enum {
     FS_FILE_TYPE,
@@ -19,24 +23,94 @@ typedef enum {
 } fs_node_type;
 
 #pragma pack(push, 1)
-typedef struct fs_node {
-    char name[32];
+// A run of data blocks, numbered from the start of the data area
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} fs_extent_t;
+
+// An inode table slot, one sector each
+typedef struct {
     uint8_t type;
+    uint8_t used;
+    uint8_t extent_count;
+    uint8_t reserved;
+    uint32_t parent;          // Inode of the directory holding it
+    uint32_t size;            // Bytes; for a directory, of its entries
+    union {
+        char content[FS_INLINE_SIZE];          // Files of up to FS_INLINE_SIZE
+        fs_extent_t extents[FS_MAX_EXTENTS];   // Larger files, directories
+    };
+    // A directory's hash index: a table of index_buckets entry numbers
+    // stored index_offset bytes into its data, after the entries
+    uint32_t index_offset;
+    uint32_t index_buckets;   // 0 when there is none on disk
+} fs_inode_t;
+
+// A directory's data starts with an array of these
+typedef struct {
+    uint32_t inode;
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t hash;            // Of the name, never 0
+    uint8_t reserved2[20];
+    char name[MAX_NAME_LEN];
+} fs_dirent_t;
+#pragma pack(pop)
+
+#define FS_DIRTY_SPOTS 4
+
+// Sectors of a buffer changed since it was last stored: listed one by
+// one while they are few, after that every sector from first up to end
+typedef struct {
+    uint32_t spots[FS_DIRTY_SPOTS];
+    uint32_t spot_count;
+    uint32_t first;
+    uint32_t end;             // No range while first >= end
+} fs_dirty_t;
+
+// An inode in memory. Nodes are read in on first use and stay cached
+// while referenced; a cached node holds a reference on its parent.
+typedef struct fs_node {
+    uint32_t ino;
+    char name[MAX_NAME_LEN];
     struct fs_node *parent;
-    struct fs_node *children[16];
-    uint8_t child_count;
-    uint32_t size;
-    char content[256];
+    fs_inode_t inode;
+    fs_dirent_t *entries;     // A directory's entries, once read
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    // Open-addressed table of entry numbers plus one, 0 for an empty
+    // bucket, linearly probed from the name's hash
+    uint32_t *index;
+    uint32_t index_buckets;   // A power of two
+    // Changed since the node was last stored: the inode, and sectors of
+    // the entries and of the index
+    uint8_t dirty;
+    fs_dirty_t entry_sectors;
+    fs_dirty_t index_sectors;
+    uint32_t refs;
+    struct fs_node *hash_next;
+    struct fs_node *lru_prev; // Unreferenced nodes and free slots
+    struct fs_node *lru_next;
 } fs_node;
-#pragma pack(pop)
 
 extern fs_node *current_dir;
 
-void fs_init(uint32_t lba);
+void fs_init(int dev, uint32_t lba);
 void fs_init_ramdisk(void);
-void fs_save(void);
+// Writes what changed since the last save and commits it; 0 on success
+int fs_save(void);
+// Saves quietly once FS_WRITEBACK_DIRTY changes have piled up or the
+// oldest has waited FS_WRITEBACK_MS. Cheap, for idle loops. A tree made
+// up because the disk held no file system is never saved this way.
+void fs_writeback_poll(void);
 void fs_load(void);
-int format_disk(uint32_t lba);
+// Where the file system lives: device, first sector and sectors in use.
+// Returns 0 when no file system is mounted.
+int fs_location(int* dev, uint32_t* lba, uint32_t* sectors);
+// Whether a sector holds a file system header this code can mount
+int fs_probe(const void* sector);
+int format_disk(int dev, uint32_t lba);
 void print_tree(fs_node* node, int depth);
 void fs_tree(void);
 int create_file(const char* name);
@@ -44,10 +118,17 @@ int delete_file(const char* name);
 int create_dir(const char* name);
 int delete_dir(const char* name);
 void list_files(void);
+// Returns the directory with a reference, dropped with fs_release
 fs_node *find_node(const char *path);
+void fs_release(fs_node *node);
 int chdir(const char *path);
 const char *getcwd(void);
+// Paths are absolute or from the current directory; fs_write creates
+// the file when its directory exists
 int fs_write(const char *filename, const void *data, size_t size);
 int fs_read(const char *filename, void *buf, size_t size);
+// Looks a name up in the current directory without reading its inode.
+// Returns the inode number, or -1 if there is no such entry.
+int fs_lookup(const char *name);
 
 #endif
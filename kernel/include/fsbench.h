@@ -0,0 +1,18 @@
+#ifndef FSBENCH_H
+#define FSBENCH_H
+
+#include "stdint.h"
+
+#define FSBENCH_DIR "fsbench.tmp"     // Scratch directory, in the current one
+#define FSBENCH_FIRST_SIZE 16
+#define FSBENCH_MAX_ENTRIES 16384
+#define FSBENCH_LOOKUPS 20000         // Of each kind per directory size
+
+// Fills a scratch directory with empty files, quadrupling its size up to
+// max_entries, which is always measured last. At each size it times
+// lookups of names that exist and of names that do not, and prints the
+// cost per lookup and the rate. Everything it created is removed after.
+// Returns 0 on success.
+int fsbench_run(uint32_t max_entries, uint32_t lookups);
+
+#endif
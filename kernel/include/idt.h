@@ -0,0 +1,35 @@
+#ifndef IDT_H
+#define IDT_H
+
+#include "stdint.h"
+
+#define IRQ_BASE_VECTOR 0x20 // Remapped 8259 PIC, IRQ 0-15
+#define MSI_BASE_VECTOR 0x30 // Vectors handed out to MSI devices
+#define MSI_MAX_VECTOR  0x3F
+#define IRQ_SHARE_MAX   4    // Extra handlers on one PIC line
+
+// Register state saved by isr_common in entry.asm
+typedef struct {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t vector;
+    uint64_t error_code;
+    uint64_t rip, cs, rflags, rsp, ss;
+} interrupt_frame_t;
+
+typedef void (*irq_handler_t)(interrupt_frame_t* frame);
+
+void idt_init(void);
+void irq_install(int irq, irq_handler_t handler);
+int msi_alloc_vector(irq_handler_t handler);
+uint32_t msi_address(void);
+
+static inline void interrupts_enable(void) {
+    asm volatile ("sti");
+}
+
+static inline void interrupts_disable(void) {
+    asm volatile ("cli");
+}
+
+#endif
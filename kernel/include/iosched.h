@@ -0,0 +1,36 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include "blkdev.h"
+
+// Per-device dispatch policies. Every policy merges requests that are
+// adjacent on the device; they differ in the order requests go out.
+#define IOSCHED_NONE     0 // Arrival order
+#define IOSCHED_DEADLINE 1 // Sorted, reads preferred and expiring first
+#define IOSCHED_ELEVATOR 2 // Sorted, one-way sweep across the disk
+
+#define IOSCHED_MAX_MERGE       256  // Sectors in one merged command
+#define IOSCHED_READ_EXPIRE_MS  500
+#define IOSCHED_WRITE_EXPIRE_MS 5000
+#define IOSCHED_WRITES_STARVED  2    // Read batches before waiting writes get a turn
+
+// Picks the default policy for a newly registered device
+void iosched_attach(blkdev_t* dev);
+int iosched_set_policy(int id, int policy);
+int iosched_policy(int id);
+const char* iosched_policy_name(int policy);
+// Returns the policy named by a string or -1
+int iosched_parse_policy(const char* name);
+
+void iosched_add(blkdev_t* dev, blk_request_t* req);
+int iosched_queued(blkdev_t* dev);
+// Takes the next command to hand to the driver, possibly a merge of
+// several queued requests; NULL when nothing may go out now
+blk_request_t* iosched_next(blkdev_t* dev);
+// Resolves a finished command into the requests it carried, linked
+// through sched_next, each with its failed flag set
+blk_request_t* iosched_finish(blk_request_t* cmd);
+
+void iosched_print_stats(void);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include "stdint.h"
+#include "blkdev.h"
+
+// Latency histogram in microseconds: exact below 16, then eight buckets
+// per power of two up to about four minutes, so a percentile read from
+// it is off by at most an eighth
+#define LAT_HIST_EXACT   16
+#define LAT_HIST_SUB     8
+#define LAT_HIST_BUCKETS (LAT_HIST_EXACT + 24 * LAT_HIST_SUB)
+
+typedef struct {
+    uint32_t buckets[LAT_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+} lat_hist_t;
+
+void lat_hist_add(lat_hist_t* h, uint64_t us);
+// Upper bound of the bucket holding the given fraction of samples
+uint64_t lat_hist_percentile(const lat_hist_t* h, uint32_t per_mille);
+// Largest value that lands in a bucket
+uint64_t lat_hist_limit(int bucket);
+
+typedef struct {
+    uint64_t requests[BLK_OPS]; // Completed, per BLK_OP_*
+    uint64_t sectors[BLK_OPS];  // Moved or discarded, per BLK_OP_*
+    uint64_t merges;          // Requests that went out inside another's command
+    uint32_t errors;
+    uint32_t retries;         // Commands the driver had to issue again
+    uint32_t peak_inflight;   // Most requests submitted at once
+    uint32_t peak_dispatched; // Most commands the driver held at once
+    uint64_t interrupts;      // Raised for the device, where the driver can tell
+    lat_hist_t latency[BLK_OPS]; // Submission to completion, per BLK_OP_*
+} blk_stats_t;
+
+// Block layer and driver hooks
+void iostat_depth(const blkdev_t* dev);
+void iostat_done(const blk_request_t* req, uint64_t latency_us);
+void iostat_merged(int dev, uint32_t requests);
+void iostat_retry(int dev);
+// Safe from interrupt handlers
+void iostat_interrupt(int dev);
+
+const blk_stats_t* iostat_get(int dev);
+void iostat_reset(void);
+void iostat_print(void);
+// One line per counter and per non-empty histogram bucket, key=value
+// pairs on the serial port only
+void iostat_dump_serial(void);
+
+#endif
@@ -17,6 +17,7 @@ size_t strlcat(char *dst, const char *src, size_t size);
 char *strcat(char *dest, const char *src);
 char *strncat(char *dest, const char *src, size_t n);
 void itoa(int num, char *str, int base);
+void u64toa(uint64_t num, char* str);
 char *strstr(const char *haystack, const char *needle);
 char *strrchr(const char *s, int c);
 const unsigned short **__ctype_b_loc(void);
@@ -70,6 +71,7 @@ void set_cursor_position(uint8_t x, uint8_t y);
 void clear_line(int y);
 
 void serial_init(void);
+void serial_print(const char* str);
 void vga_init(void);
 void shell_main(void);
 
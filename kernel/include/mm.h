@@ -21,7 +21,10 @@ void* kcalloc(size_t num, size_t size);
 void* krealloc(void* ptr, size_t size);
 void kfree(void* ptr);
 
+// Blocks from kmalloc_aligned and kmalloc_dma go back through
+// kfree_aligned, never kfree
 void* kmalloc_aligned(size_t size, size_t alignment);
+void kfree_aligned(void* ptr);
 void* kmalloc_dma(size_t size);
 
 void mm_print_stats(void);
@@ -0,0 +1,53 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include "stdint.h"
+
+#define NVME_CLASS    0x01
+#define NVME_SUBCLASS 0x08
+#define NVME_PROG_IF  0x02
+
+#define NVME_MAX_CONTROLLERS 2
+#define NVME_MAX_NAMESPACES  4  // Per controller
+#define NVME_IO_QUEUES       2  // Queue pairs requested per controller
+#define NVME_QUEUE_SIZE      64 // Entries per ring
+#define NVME_QUEUE_SLOTS     16 // Commands in flight per I/O queue
+#define NVME_PAGE_SIZE       4096
+
+// Submission queue entry
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) nvme_sqe_t;
+
+// Completion queue entry
+typedef struct {
+    uint32_t result;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;   // Bit 0 is the phase tag
+} __attribute__((packed)) nvme_cqe_t;
+
+// Finds NVMe controllers and registers every active namespace as a
+// block device. Returns the number of namespaces registered.
+int nvme_init(void);
+// Completions are interrupt driven when the controller has an interrupt
+// routed; polled mode spins on the completion queues instead
+void nvme_set_polled(int polled);
+int nvme_polled(void);
+
+#endif
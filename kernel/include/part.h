@@ -0,0 +1,57 @@
+#ifndef PART_H
+#define PART_H
+
+#include "stdint.h"
+
+#define PART_MAX 16
+
+typedef struct {
+    uint64_t signature;
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t partition_entries_lba;
+    uint32_t num_partition_entries;
+    uint32_t size_of_partition_entry;
+    uint32_t partition_entry_array_crc32;
+} __attribute__((packed)) gpt_header_t;
+
+typedef struct {
+    uint8_t partition_type_guid[16];
+    uint8_t unique_partition_guid[16];
+    uint64_t starting_lba;
+    uint64_t ending_lba;
+    uint64_t attributes;
+    uint16_t partition_name[36];
+} __attribute__((packed)) gpt_partition_entry_t;
+
+typedef struct {
+    uint8_t type_guid[16];    // GPT only
+    uint8_t unique_guid[16];  // GPT only
+    uint8_t mbr_type;         // MBR only
+    uint64_t start_lba;       // 512-byte units whatever the drive sector size
+    uint64_t end_lba;         // Inclusive
+    char name[37];
+    uint8_t has_fs;           // Starts with the AlwexOS signature
+} partition_t;
+
+// Every block device has its own table, empty until part_scan has read
+// the device's MBR or GPT
+int part_scan(int dev);
+int part_scanned(int dev);
+int part_is_gpt(int dev);
+int part_count(int dev);
+const partition_t* part_get(int dev, int index);
+// Prints the tables of all scanned devices
+void part_print_table(void);
+// Start of the device's first partition holding the file system, or 0
+uint32_t find_fs_partition(int dev);
+int is_fs_supported(int dev, uint32_t lba);
+
+#endif
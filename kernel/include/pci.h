@@ -3,7 +3,12 @@
 
 #include "stdint.h"
 
+#define PCI_CAP_MSI   0x05
+#define PCI_CAP_MSIX  0x11
+
 uint32_t pci_read_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
 void pci_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+uint8_t pci_find_capability(uint8_t bus, uint8_t slot, uint8_t func, uint8_t cap_id);
+int pci_enable_msi(uint8_t bus, uint8_t slot, uint8_t func, uint32_t address, uint8_t vector);
 
 #endif
@@ -0,0 +1,16 @@
+#ifndef RAID0_H
+#define RAID0_H
+
+#include "stdint.h"
+
+#define RAID0_MAX_DRIVES 8
+#define RAID0_DEFAULT_CHUNK 128 // sectors (64 KiB)
+#define RAID0_CHILDREN 64       // Member requests in flight at once, at most 64
+
+// Stripes AHCI drives together and registers the set as the block
+// device "raid0". Configuring it again changes the layout in place.
+int raid0_init(const int* drives, int ndrives, uint32_t chunk_sectors);
+int raid0_active(void);
+void raid0_print_info(void);
+
+#endif
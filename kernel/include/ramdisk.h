@@ -0,0 +1,14 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "stddef.h"
+
+#define RAMDISK_DEFAULT_SIZE (2 * 1024 * 1024)
+#define RAMDISK_PAGE_SIZE 4096 // Unit of backing memory
+
+// Registers a zeroed RAM disk; returns the block device id or -1.
+// Backing memory is allocated as it is written and released by discard.
+int ramdisk_create(size_t size);
+void ramdisk_print_info(void);
+
+#endif
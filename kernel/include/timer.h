@@ -0,0 +1,15 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "stdint.h"
+
+#define TIMER_HZ 1000
+
+void timer_init(void);
+uint64_t timer_ticks(void);
+void timer_calibrate(void);
+int timer_calibrated(void);
+uint64_t timer_us(void);
+void udelay(uint32_t us);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "stdint.h"
+
+#define VIRTIO_PCI_VENDOR 0x1AF4
+
+// Legacy (transitional) PCI interface, registers in I/O BAR0
+#define VIRTIO_PCI_HOST_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN      0x08
+#define VIRTIO_PCI_QUEUE_SIZE     0x0C
+#define VIRTIO_PCI_QUEUE_SEL      0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10
+#define VIRTIO_PCI_STATUS         0x12
+#define VIRTIO_PCI_ISR            0x13
+#define VIRTIO_PCI_CONFIG         0x14 // Device config while MSI-X is off
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2 // Device writes into the buffer
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_ALIGN 4096
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;   // Head descriptor of the finished chain
+    uint32_t len;  // Bytes the device wrote
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];
+} __attribute__((packed)) virtq_used_t;
+
+// Split virtqueue in the legacy layout: descriptors and the available
+// ring share the first pages, the used ring starts on the next boundary
+static inline uint32_t virtq_used_offset(uint16_t size) {
+    uint32_t bytes = 16 * size + 2 * (3 + size);
+    return (bytes + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+}
+
+static inline uint32_t virtq_size_bytes(uint16_t size) {
+    uint32_t used = 2 * 3 + 8 * size;
+    return virtq_used_offset(size) + ((used + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1));
+}
+
+#endif
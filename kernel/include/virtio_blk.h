@@ -0,0 +1,10 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#define VIRTIO_BLK_MAX_DEVS 4
+
+// Finds virtio-blk PCI functions and registers each as a block device.
+// Returns the number of devices found.
+int virtio_blk_init(void);
+
+#endif
@@ -0,0 +1,431 @@
+#include "include/iosched.h"
+#include "include/lib.h"
+#include "include/mm.h"
+#include "include/timer.h"
+
+#define IOSCHED_MERGES 8 // Merged commands in flight at once
+
+typedef struct {
+    blk_request_t* head;      // Queued requests, see queue_before for the order
+    uint32_t count;
+    uint8_t policy;
+    uint8_t starved;          // Read picks made while writes were waiting
+    uint64_t pos;             // End of the last dispatched command
+    uint8_t flushing;         // A flush is with the driver, everything else waits
+    uint32_t dispatches;
+    uint32_t merged;          // Requests that rode along in another's command
+    uint32_t expired;         // Picked because their deadline had passed
+} sched_queue_t;
+
+// The command handed to the driver comes first so the completed request
+// leads back to its merge
+typedef struct {
+    blk_request_t cmd;
+    blk_request_t* members;   // In LBA order, linked through sched_next
+    blk_sg_t sg[IOSCHED_MAX_MERGE];
+    uint8_t* bounce;          // Allocated on first use
+    uint8_t bounced;          // Data goes through bounce rather than in place
+    uint8_t busy;
+} sched_merge_t;
+
+static sched_queue_t queues[BLKDEV_MAX];
+static sched_merge_t merges[IOSCHED_MERGES];
+
+static const char* policy_names[] = { "none", "deadline", "elevator" };
+
+void iosched_attach(blkdev_t* dev) {
+    sched_queue_t* q = &queues[dev->id];
+    memset(q, 0, sizeof(sched_queue_t));
+    q->policy = dev->rotational ? IOSCHED_DEADLINE : IOSCHED_NONE;
+}
+
+const char* iosched_policy_name(int policy) {
+    if (policy < 0 || policy > IOSCHED_ELEVATOR) {
+        return "?";
+    }
+    return policy_names[policy];
+}
+
+int iosched_parse_policy(const char* name) {
+    for (int i = 0; i <= IOSCHED_ELEVATOR; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int iosched_policy(int id) {
+    if (id < 0 || id >= BLKDEV_MAX) {
+        return -1;
+    }
+    return queues[id].policy;
+}
+
+// Arrival order for none, otherwise LBA order with ties in arrival order
+static int queue_before(const sched_queue_t* q, const blk_request_t* a, const blk_request_t* b) {
+    if (q->policy == IOSCHED_NONE || a->lba == b->lba) {
+        return a->seq < b->seq;
+    }
+    return a->lba < b->lba;
+}
+
+static void queue_insert(sched_queue_t* q, blk_request_t* req) {
+    blk_request_t** pp = &q->head;
+    while (*pp && !queue_before(q, req, *pp)) {
+        pp = &(*pp)->sched_next;
+    }
+    req->sched_next = *pp;
+    *pp = req;
+    q->count++;
+}
+
+static void queue_remove(sched_queue_t* q, blk_request_t* req) {
+    blk_request_t** pp = &q->head;
+    while (*pp) {
+        if (*pp == req) {
+            *pp = req->sched_next;
+            req->sched_next = NULL;
+            q->count--;
+            return;
+        }
+        pp = &(*pp)->sched_next;
+    }
+}
+
+int iosched_set_policy(int id, int policy) {
+    if (id < 0 || id >= BLKDEV_MAX || policy < 0 || policy > IOSCHED_ELEVATOR) {
+        return 1;
+    }
+
+    sched_queue_t* q = &queues[id];
+    blk_request_t* list = q->head;
+    q->head = NULL;
+    q->count = 0;
+    q->policy = policy;
+    q->starved = 0;
+
+    while (list) {
+        blk_request_t* req = list;
+        list = req->sched_next;
+        queue_insert(q, req);
+    }
+    return 0;
+}
+
+void iosched_add(blkdev_t* dev, blk_request_t* req) {
+    uint32_t expire = req->op == BLK_OP_READ ? IOSCHED_READ_EXPIRE_MS : IOSCHED_WRITE_EXPIRE_MS;
+    req->deadline = timer_ticks() + expire * TIMER_HZ / 1000;
+    queue_insert(&queues[dev->id], req);
+}
+
+int iosched_queued(blkdev_t* dev) {
+    return queues[dev->id].count;
+}
+
+// The oldest queued flush: nothing submitted after it may overtake it
+static blk_request_t* queue_barrier(const sched_queue_t* q) {
+    blk_request_t* barrier = NULL;
+    for (blk_request_t* r = q->head; r; r = r->sched_next) {
+        if (r->op == BLK_OP_FLUSH && (!barrier || r->seq < barrier->seq)) {
+            barrier = r;
+        }
+    }
+    return barrier;
+}
+
+// A request may not pass an older one it overlaps unless both only read;
+// a discard counts as a write
+static int queue_blocked(const sched_queue_t* q, const blk_request_t* req) {
+    for (blk_request_t* r = q->head; r; r = r->sched_next) {
+        if (r != req && r->op != BLK_OP_FLUSH && r->seq < req->seq &&
+            (r->op != BLK_OP_READ || req->op != BLK_OP_READ) &&
+            r->lba < req->lba + req->count && req->lba < r->lba + r->count) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int eligible(const sched_queue_t* q, const blk_request_t* req, const blk_request_t* barrier) {
+    return req->op != BLK_OP_FLUSH && (!barrier || req->seq < barrier->seq) && !queue_blocked(q, req);
+}
+
+// The first request at or past the head position, wrapping around to
+// the lowest LBA once the sweep reaches the end. reads 1 takes only
+// reads, 0 only the rest, -1 any.
+static blk_request_t* pick_sweep(sched_queue_t* q, const blk_request_t* barrier, int reads) {
+    blk_request_t* lowest = NULL;
+    for (blk_request_t* r = q->head; r; r = r->sched_next) {
+        if ((reads >= 0 && (r->op == BLK_OP_READ) != reads) || !eligible(q, r, barrier)) {
+            continue;
+        }
+        if (r->lba >= q->pos) {
+            return r;
+        }
+        if (!lowest) {
+            lowest = r;
+        }
+    }
+    return lowest;
+}
+
+static blk_request_t* pick_none(sched_queue_t* q, const blk_request_t* barrier) {
+    for (blk_request_t* r = q->head; r; r = r->sched_next) {
+        if (eligible(q, r, barrier)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Expired requests go first, oldest deadline first. Otherwise reads are
+// preferred, with waiting writes let through after a few read picks so
+// that write-back keeps moving.
+static blk_request_t* pick_deadline(sched_queue_t* q, const blk_request_t* barrier) {
+    uint64_t now = timer_ticks();
+    blk_request_t* expired = NULL;
+    int reads = 0;
+    int writes = 0;
+
+    for (blk_request_t* r = q->head; r; r = r->sched_next) {
+        if (!eligible(q, r, barrier)) {
+            continue;
+        }
+        if (r->deadline <= now && (!expired || r->deadline < expired->deadline)) {
+            expired = r;
+        }
+        if (r->op == BLK_OP_READ) reads++;
+        else writes++;
+    }
+
+    if (expired) {
+        q->expired++;
+        return expired;
+    }
+
+    if (reads && (!writes || q->starved < IOSCHED_WRITES_STARVED)) {
+        if (writes) {
+            q->starved++;
+        }
+        return pick_sweep(q, barrier, 1);
+    }
+
+    q->starved = 0;
+    return pick_sweep(q, barrier, 0);
+}
+
+static sched_merge_t* merge_get(void) {
+    for (int i = 0; i < IOSCHED_MERGES; i++) {
+        sched_merge_t* m = &merges[i];
+        if (m->busy) {
+            continue;
+        }
+        if (!m->bounce) {
+            m->bounce = (uint8_t*)kmalloc_aligned(IOSCHED_MAX_MERGE * 512, 4096);
+            if (!m->bounce) {
+                return NULL;
+            }
+        }
+        return m;
+    }
+    return NULL;
+}
+
+// Finds a queued request that extends [start, end) at either side
+static blk_request_t* find_adjacent(sched_queue_t* q, const blk_request_t* barrier, uint8_t op,
+                                    uint8_t flags, uint64_t start, uint64_t end, uint32_t room) {
+    for (blk_request_t* r = q->head; r; r = r->sched_next) {
+        if (r->op == op && r->flags == flags && r->count <= room && (r->lba == end || r->lba + r->count == start) &&
+            eligible(q, r, barrier)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Collects the requests adjacent to req into one command. The command
+// uses the callers' buffer when theirs happen to follow each other in
+// memory, a scatter-gather list over them when the driver takes one and
+// the merge's bounce buffer otherwise.
+static blk_request_t* merge_around(blkdev_t* dev, sched_queue_t* q, const blk_request_t* barrier,
+                                   blk_request_t* req) {
+    // Discards carry no data, and the block layer has joined them already
+    if (req->op == BLK_OP_DISCARD) {
+        return req;
+    }
+
+    sched_merge_t* m = merge_get();
+    if (!m) {
+        return req;
+    }
+
+    blk_request_t* first = req;
+    blk_request_t* last = req;
+    uint64_t start = req->lba;
+    uint64_t end = req->lba + req->count;
+    req->sched_next = NULL;
+
+    blk_request_t* r;
+    while (end - start < IOSCHED_MAX_MERGE &&
+           (r = find_adjacent(q, barrier, req->op, req->flags, start, end, IOSCHED_MAX_MERGE - (uint32_t)(end - start)))) {
+        queue_remove(q, r);
+        if (r->lba == end) {
+            last->sched_next = r;
+            last = r;
+            end += r->count;
+        } else {
+            r->sched_next = first;
+            first = r;
+            start = r->lba;
+        }
+        q->merged++;
+    }
+
+    if (first == last) {
+        return req;
+    }
+
+    m->busy = 1;
+    m->members = first;
+    m->bounced = 0;
+    int contiguous = 1;
+    for (r = first; r; r = r->sched_next) {
+        if (r->sg || (r->sched_next && (uint8_t*)r->buffer + (size_t)r->count * 512 != (uint8_t*)r->sched_next->buffer)) {
+            contiguous = 0;
+            break;
+        }
+    }
+
+    blk_request_t* cmd = &m->cmd;
+    memset(cmd, 0, sizeof(blk_request_t));
+    cmd->dev = req->dev;
+    cmd->op = req->op;
+    cmd->flags = req->flags;
+    cmd->lba = start;
+    cmd->count = (uint32_t)(end - start);
+    cmd->merged = 1;
+
+    if (contiguous) {
+        cmd->buffer = first->buffer;
+        return cmd;
+    }
+
+    if (dev->sg) {
+        // Pieces that touch in memory share one entry
+        uint32_t n = 0;
+        for (r = first; r; r = r->sched_next) {
+            blk_sg_t single = { r->buffer, r->count * 512 };
+            const blk_sg_t* list = r->sg ? r->sg : &single;
+            uint32_t count = r->sg ? r->nsg : 1;
+            for (uint32_t k = 0; k < count; k++) {
+                if (n && (uint8_t*)m->sg[n - 1].addr + m->sg[n - 1].len == (uint8_t*)list[k].addr) {
+                    m->sg[n - 1].len += list[k].len;
+                } else {
+                    m->sg[n++] = list[k];
+                }
+            }
+        }
+        cmd->sg = m->sg;
+        cmd->nsg = n;
+        return cmd;
+    }
+
+    m->bounced = 1;
+    cmd->buffer = m->bounce;
+
+    if (cmd->op == BLK_OP_WRITE) {
+        for (r = first; r; r = r->sched_next) {
+            memcpy(m->bounce + (r->lba - start) * 512, r->buffer, (size_t)r->count * 512);
+        }
+    }
+    return cmd;
+}
+
+blk_request_t* iosched_next(blkdev_t* dev) {
+    sched_queue_t* q = &queues[dev->id];
+    if (!q->head || q->flushing) {
+        return NULL;
+    }
+
+    // A flush goes out alone once everything before it has completed
+    blk_request_t* barrier = queue_barrier(q);
+    if (barrier) {
+        int before = 0;
+        for (blk_request_t* r = q->head; r && !before; r = r->sched_next) {
+            before = r->op != BLK_OP_FLUSH && r->seq < barrier->seq;
+        }
+        if (!before) {
+            if (dev->dispatched) {
+                return NULL;
+            }
+            queue_remove(q, barrier);
+            q->dispatches++;
+            q->flushing = 1;
+            return barrier;
+        }
+    }
+
+    blk_request_t* req;
+    if (q->policy == IOSCHED_DEADLINE) {
+        req = pick_deadline(q, barrier);
+    } else if (q->policy == IOSCHED_ELEVATOR) {
+        req = pick_sweep(q, barrier, -1);
+    } else {
+        req = pick_none(q, barrier);
+    }
+    if (!req) {
+        return NULL;
+    }
+
+    queue_remove(q, req);
+    blk_request_t* cmd = merge_around(dev, q, barrier, req);
+    q->pos = cmd->lba + cmd->count;
+    q->dispatches++;
+    return cmd;
+}
+
+blk_request_t* iosched_finish(blk_request_t* cmd) {
+    if (cmd->op == BLK_OP_FLUSH) {
+        queues[cmd->dev].flushing = 0;
+    }
+    if (!cmd->merged) {
+        cmd->sched_next = NULL;
+        return cmd;
+    }
+
+    sched_merge_t* m = (sched_merge_t*)cmd;
+    for (blk_request_t* r = m->members; r; r = r->sched_next) {
+        r->failed = cmd->failed;
+        if (m->bounced && cmd->op == BLK_OP_READ && !cmd->failed) {
+            memcpy(r->buffer, m->bounce + (r->lba - cmd->lba) * 512, (size_t)r->count * 512);
+        }
+    }
+
+    m->busy = 0;
+    return m->members;
+}
+
+void iosched_print_stats(void) {
+    char num_buf[12];
+
+    for (int i = 0; i < blkdev_count(); i++) {
+        sched_queue_t* q = &queues[i];
+        print(blkdev_get(i)->name);
+        print(": ");
+        print(iosched_policy_name(q->policy));
+        print(", commands ");
+        itoa((int)q->dispatches, num_buf, 10);
+        print(num_buf);
+        print(", merged ");
+        itoa((int)q->merged, num_buf, 10);
+        print(num_buf);
+        print(", expired ");
+        itoa((int)q->expired, num_buf, 10);
+        print(num_buf);
+        print(", queued ");
+        itoa((int)q->count, num_buf, 10);
+        print(num_buf);
+        print("\n");
+    }
+}
@@ -0,0 +1,221 @@
+#include "include/iostat.h"
+#include "include/lib.h"
+#include "include/timer.h"
+
+static blk_stats_t stats[BLKDEV_MAX];
+static uint64_t since_us = 0; // Last reset
+
+static const char* op_names[BLK_OPS] = { "read", "write", "flush", "discard" };
+
+void lat_hist_add(lat_hist_t* h, uint64_t us) {
+    int bucket;
+    if (us < LAT_HIST_EXACT) {
+        bucket = (int)us;
+    } else {
+        int e = 63 - __builtin_clzll(us);
+        int sub = (int)((us >> (e - 3)) & (LAT_HIST_SUB - 1));
+        bucket = LAT_HIST_EXACT + (e - 4) * LAT_HIST_SUB + sub;
+        if (bucket >= LAT_HIST_BUCKETS) {
+            bucket = LAT_HIST_BUCKETS - 1;
+        }
+    }
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+uint64_t lat_hist_limit(int bucket) {
+    if (bucket < LAT_HIST_EXACT) {
+        return bucket;
+    }
+
+    int e = (bucket - LAT_HIST_EXACT) / LAT_HIST_SUB + 4;
+    int sub = (bucket - LAT_HIST_EXACT) % LAT_HIST_SUB;
+    return ((uint64_t)(LAT_HIST_SUB + sub + 1) << (e - 3)) - 1;
+}
+
+uint64_t lat_hist_percentile(const lat_hist_t* h, uint32_t per_mille) {
+    if (!h->count) {
+        return 0;
+    }
+
+    uint64_t target = (h->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint64_t limit = lat_hist_limit(i);
+            return limit < h->max_us ? limit : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+void iostat_depth(const blkdev_t* dev) {
+    blk_stats_t* s = &stats[dev->id];
+    if (dev->inflight > s->peak_inflight) s->peak_inflight = dev->inflight;
+    if (dev->dispatched > s->peak_dispatched) s->peak_dispatched = dev->dispatched;
+}
+
+void iostat_done(const blk_request_t* req, uint64_t latency_us) {
+    blk_stats_t* s = &stats[req->dev];
+    s->requests[req->op]++;
+    if (req->failed) {
+        s->errors++;
+    } else if (req->op != BLK_OP_FLUSH) {
+        s->sectors[req->op] += req->count;
+    }
+    lat_hist_add(&s->latency[req->op], latency_us);
+}
+
+void iostat_merged(int dev, uint32_t requests) {
+    stats[dev].merges += requests;
+}
+
+void iostat_retry(int dev) {
+    stats[dev].retries++;
+}
+
+void iostat_interrupt(int dev) {
+    if (dev >= 0 && dev < BLKDEV_MAX) {
+        stats[dev].interrupts++;
+    }
+}
+
+const blk_stats_t* iostat_get(int dev) {
+    if (dev < 0 || dev >= blkdev_count()) {
+        return NULL;
+    }
+    return &stats[dev];
+}
+
+void iostat_reset(void) {
+    memset(stats, 0, sizeof(stats));
+    since_us = timer_us();
+}
+
+static void print_num(void (*out)(const char*), uint64_t value) {
+    char num_buf[21];
+    u64toa(value, num_buf);
+    out(num_buf);
+}
+
+void iostat_print(void) {
+    if (blkdev_count() == 0) {
+        print("No block devices\n");
+        return;
+    }
+
+    uint64_t elapsed_us = timer_us() - since_us;
+    for (int i = 0; i < blkdev_count(); i++) {
+        const blk_stats_t* s = &stats[i];
+        print(blkdev_get(i)->name);
+        print(": reads ");
+        print_num(print, s->requests[BLK_OP_READ]);
+        print(" (");
+        print_num(print, s->sectors[BLK_OP_READ] / 2);
+        print(" KiB), writes ");
+        print_num(print, s->requests[BLK_OP_WRITE]);
+        print(" (");
+        print_num(print, s->sectors[BLK_OP_WRITE] / 2);
+        print(" KiB), flushes ");
+        print_num(print, s->requests[BLK_OP_FLUSH]);
+        if (s->requests[BLK_OP_DISCARD]) {
+            print(", discards ");
+            print_num(print, s->requests[BLK_OP_DISCARD]);
+            print(" (");
+            print_num(print, s->sectors[BLK_OP_DISCARD] / 2);
+            print(" KiB)");
+        }
+        print("\n  merges ");
+        print_num(print, s->merges);
+        print(", errors ");
+        print_num(print, s->errors);
+        print(", retries ");
+        print_num(print, s->retries);
+        print(", peak depth ");
+        print_num(print, s->peak_inflight);
+        print(" queued / ");
+        print_num(print, s->peak_dispatched);
+        print(" in the driver\n");
+        if (s->interrupts) {
+            print("  interrupts ");
+            print_num(print, s->interrupts);
+            print(", ");
+            print_num(print, elapsed_us ? s->interrupts * 1000000 / elapsed_us : 0);
+            print(" per second\n");
+        }
+
+        for (int op = 0; op < BLK_OPS; op++) {
+            const lat_hist_t* h = &s->latency[op];
+            if (!h->count) {
+                continue;
+            }
+            print("  ");
+            print(op_names[op]);
+            print(" latency us: avg ");
+            print_num(print, h->total_us / h->count);
+            print(", p50 ");
+            print_num(print, lat_hist_percentile(h, 500));
+            print(", p99 ");
+            print_num(print, lat_hist_percentile(h, 990));
+            print(", max ");
+            print_num(print, h->max_us);
+            print("\n");
+        }
+    }
+}
+
+static void dump_field(const char* dev, const char* key, uint64_t value) {
+    serial_print("iostat dev=");
+    serial_print(dev);
+    serial_print(" ");
+    serial_print(key);
+    serial_print("=");
+    print_num(serial_print, value);
+    serial_print("\n");
+}
+
+void iostat_dump_serial(void) {
+    for (int i = 0; i < blkdev_count(); i++) {
+        const blk_stats_t* s = &stats[i];
+        const char* name = blkdev_get(i)->name;
+
+        dump_field(name, "reads", s->requests[BLK_OP_READ]);
+        dump_field(name, "writes", s->requests[BLK_OP_WRITE]);
+        dump_field(name, "flushes", s->requests[BLK_OP_FLUSH]);
+        dump_field(name, "read_sectors", s->sectors[BLK_OP_READ]);
+        dump_field(name, "write_sectors", s->sectors[BLK_OP_WRITE]);
+        dump_field(name, "discards", s->requests[BLK_OP_DISCARD]);
+        dump_field(name, "discard_sectors", s->sectors[BLK_OP_DISCARD]);
+        dump_field(name, "merges", s->merges);
+        dump_field(name, "errors", s->errors);
+        dump_field(name, "retries", s->retries);
+        dump_field(name, "peak_inflight", s->peak_inflight);
+        dump_field(name, "peak_dispatched", s->peak_dispatched);
+        dump_field(name, "interrupts", s->interrupts);
+
+        for (int op = 0; op < BLK_OPS; op++) {
+            const lat_hist_t* h = &s->latency[op];
+            for (int b = 0; b < LAT_HIST_BUCKETS; b++) {
+                if (!h->buckets[b]) {
+                    continue;
+                }
+                serial_print("iostat dev=");
+                serial_print(name);
+                serial_print(" op=");
+                serial_print(op_names[op]);
+                serial_print(" le_us=");
+                print_num(serial_print, lat_hist_limit(b));
+                serial_print(" count=");
+                print_num(serial_print, h->buckets[b]);
+                serial_print("\n");
+            }
+        }
+    }
+    serial_print("iostat end\n");
+}
@@ -2,6 +2,13 @@
 #include "include/ahci.h"
 #include "include/fs.h"
 #include "include/bootinfo.h"
+#include "include/idt.h"
+#include "include/timer.h"
+#include "include/bcache.h"
+#include "include/blkdev.h"
+#include "include/virtio_blk.h"
+#include "include/nvme.h"
+#include "include/part.h"
 
 extern uint32_t _end;
 
@@ -13,11 +20,31 @@ void kmain(boot_info_t* boot_info) {
     }
     serial_init();
     clear_screen();
-    uint32_t heap_start = (uint32_t)&_end;
+    uint32_t heap_start = (uint32_t)(unsigned long)&_end;
     uint32_t heap_size = 16 * 1024 * 1024;
     mm_init(heap_start, heap_size);
+    idt_init();
+    timer_init();
+    interrupts_enable();
+    timer_calibrate();
+    bcache_init(BCACHE_DEFAULT_BUDGET);
     ahci_init();
-    uint32_t fs_lba = find_fs_partition();
+    virtio_blk_init();
+    nvme_init();
+
+    // Boot from the first device that carries the file system, or format
+    // the first writable one
+    int fs_dev = -1;
+    uint32_t fs_lba = 0;
+    for (int i = 0; i < blkdev_count(); i++) {
+        part_scan(i);
+    }
+    for (int i = 0; i < blkdev_count() && fs_lba == 0; i++) {
+        fs_lba = find_fs_partition(i);
+        if (fs_lba) {
+            fs_dev = i;
+        }
+    }
     
     if (fs_lba == 0) {
         print("No filesystem partition found. Trying to use first available sector...\n");
@@ -25,11 +52,12 @@ void kmain(boot_info_t* boot_info) {
         fs_lba = 1;
 
         uint8_t test_buffer[512] = {0};
-        if (ahci_write_sectors(fs_lba, 1, test_buffer)) {
+        if (blkdev_count() > 0 && !blk_write_direct(0, fs_lba, 1, test_buffer)) {
             print("Disk is writable. Formatting...\n");
-            if (format_disk(fs_lba)) {
+            fs_dev = 0;
+            if (!format_disk(fs_dev, fs_lba)) {
                 print("Disk formatted successfully.\n");
-                fs_init(fs_lba);
+                fs_init(fs_dev, fs_lba);
             } else {
                 print("Formatting failed. Using ramdisk.\n");
                 fs_init_ramdisk();
@@ -42,7 +70,7 @@ void kmain(boot_info_t* boot_info) {
         print("Filesystem found at LBA: ");
         print_hex(fs_lba);
         print("\n");
-        fs_init(fs_lba);
+        fs_init(fs_dev, fs_lba);
     }    
     shell_main();
     while (1) {
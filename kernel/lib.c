@@ -3,6 +3,8 @@
 #include "include/lib.h"
 #include "include/keyboard.h"
 #include "include/bootinfo.h"
+#include "include/timer.h"
+#include "include/fs.h"
 
 static boot_info_t* g_boot_info = NULL;
 static uint32_t* framebuffer = NULL;
@@ -30,6 +32,11 @@ inline uint8_t inb(uint16_t port) {
 }
 
 void msleep(int milliseconds) {
+    if (timer_calibrated()) {
+        udelay(milliseconds * 1000);
+        return;
+    }
+
     for (volatile int i = 0; i < milliseconds * 1000; i++) {
         asm volatile ("nop");
     }
@@ -85,6 +92,14 @@ static void serial_putchar(char c) {
     outb(COM1, c);
 }
 
+// Writes to the serial port only, for output meant for a script on the
+// other end rather than for the screen
+void serial_print(const char* str) {
+    while (*str) {
+        serial_putchar(*str++);
+    }
+}
+
 int getchar(void) {
     int c;
     while ((c = keyboard_getkey()) == -1) {
@@ -679,6 +694,11 @@ int safe_readline(char *buf, int size) {
     
     while (i < size - 1) {
         c = getchar();
+        if (c == 0) {
+            // Nothing typed yet, a chance for delayed file system writes
+            fs_writeback_poll();
+            continue;
+        }
 
         if (c == '\r' || c == '\n') {
             buf[i] = '\0';
@@ -927,3 +947,18 @@ void itoa(int num, char *str, int base) {
         end--;
     }
 }
+
+// Decimal only; str needs room for 21 characters
+void u64toa(uint64_t num, char* str) {
+    char tmp[21];
+    int i = 0;
+    do {
+        tmp[i++] = (char)('0' + num % 10);
+        num /= 10;
+    } while (num);
+
+    while (i > 0) {
+        *str++ = tmp[--i];
+    }
+    *str = '\0';
+}
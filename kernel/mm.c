@@ -16,7 +16,7 @@ void mm_init(uint32_t start, uint32_t size) {
     heap_size = size;
     heap_end = heap_start + heap_size;
 
-    free_list = (free_block_t*)heap_start;
+    free_list = (free_block_t*)(unsigned long)heap_start;
     free_list->size = heap_size - sizeof(free_block_t);
     free_list->next = NULL;
     
@@ -182,14 +182,21 @@ void* kmalloc_aligned(size_t size, size_t alignment) {
         return NULL;
     }
 
-    uintptr_t addr = (uintptr_t)ptr;
-    uintptr_t aligned_addr = ALIGN_UP(addr + sizeof(void*) + sizeof(alloc_header_t), alignment);
+    unsigned long addr = (unsigned long)ptr;
+    unsigned long aligned_addr = ALIGN_UP(addr + sizeof(void*) + sizeof(alloc_header_t), alignment);
 
     *((void**)(aligned_addr - sizeof(void*))) = ptr;
     
     return (void*)aligned_addr;
 }
 
+void kfree_aligned(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    kfree(((void**)ptr)[-1]);
+}
+
 void* kmalloc_dma(size_t size) {
     return kmalloc_aligned(size, 256);
 }
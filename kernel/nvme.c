@@ -0,0 +1,825 @@
+#include "include/nvme.h"
+#include "include/blkdev.h"
+#include "include/lib.h"
+#include "include/mm.h"
+#include "include/pci.h"
+#include "include/idt.h"
+#include "include/timer.h"
+
+#define NVME_REG_CAP      0x00
+#define NVME_REG_VS       0x08
+#define NVME_REG_INTMS    0x0C
+#define NVME_REG_INTMC    0x10
+#define NVME_REG_CC       0x14
+#define NVME_REG_CSTS     0x1C
+#define NVME_REG_AQA      0x24
+#define NVME_REG_ASQ      0x28
+#define NVME_REG_ACQ      0x30
+#define NVME_REG_DOORBELL 0x1000
+
+#define NVME_CC_EN      (1u << 0)
+#define NVME_CC_IOSQES  (6u << 16) // 64-byte submission entries
+#define NVME_CC_IOCQES  (4u << 20) // 16-byte completion entries
+#define NVME_CSTS_RDY   (1u << 0)
+#define NVME_CSTS_CFS   (1u << 1)
+
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_DELETE_CQ    0x04
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+#define NVME_CMD_DSM   0x09
+#define NVME_DSM_AD    (1u << 2) // Deallocate
+#define NVME_RW_FUA    (1u << 30) // Force unit access, CDW12
+
+#define NVME_ADMIN_QUEUE_SIZE 16
+#define NVME_MAX_XFER_PAGES   256 // Per command, one PRP list page covers it
+#define NVME_CMD_TIMEOUT_MS   5000
+
+typedef struct {
+    nvme_sqe_t* sq;
+    volatile nvme_cqe_t* cq;
+    volatile uint32_t* sq_db;
+    volatile uint32_t* cq_db;
+    uint16_t qid;
+    uint16_t size;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint8_t phase;
+    uint32_t free_slots;                     // Command ids not in flight
+    uint64_t* prp_lists[NVME_QUEUE_SLOTS];   // One list page per command id
+    blk_request_t* owner[NVME_QUEUE_SLOTS];  // Block request each command id serves
+} nvme_queue_t;
+
+typedef struct nvme_ctrl nvme_ctrl_t;
+
+typedef struct {
+    blkdev_t dev;
+    nvme_ctrl_t* ctrl;
+    uint32_t nsid;
+    uint32_t lba_shift;  // log2 of the namespace block size
+} nvme_ns_t;
+
+struct nvme_ctrl {
+    volatile uint8_t* regs;
+    uint32_t db_stride;       // Bytes between doorbells
+    uint32_t ready_ms;        // CAP.TO
+    nvme_queue_t admin;
+    nvme_queue_t io[NVME_IO_QUEUES];
+    int io_queues;
+    int next_queue;           // Where the next batch starts handing out commands
+    blk_request_t* queue_head; // Not fully issued yet, all namespaces
+    blk_request_t* queue_tail;
+    uint32_t busy;            // I/O commands in flight
+    uint64_t progress;        // Tick of the last completion or first issue
+    uint32_t max_sectors;     // Per command, 512-byte units
+    char model[41];
+    char serial[21];
+    char firmware[9];
+    uint8_t vwc;              // Volatile write cache present
+    uint8_t dsm;              // Dataset Management, deallocation
+    int irq;                  // Vector or PIC line, -1 = none
+    int intx;                 // Level triggered, masked until completions are consumed
+    volatile uint32_t irq_pending;
+    int broken;               // A command timed out
+    nvme_ns_t ns[NVME_MAX_NAMESPACES];
+    int ns_count;
+};
+
+static nvme_ctrl_t controllers[NVME_MAX_CONTROLLERS];
+static int ctrl_count = 0;
+static int force_polled = 0;
+
+static uint32_t rd32(nvme_ctrl_t* c, uint32_t offset) {
+    return *(volatile uint32_t*)(c->regs + offset);
+}
+
+static void wr32(nvme_ctrl_t* c, uint32_t offset, uint32_t value) {
+    *(volatile uint32_t*)(c->regs + offset) = value;
+}
+
+static void wr64(nvme_ctrl_t* c, uint32_t offset, uint64_t value) {
+    wr32(c, offset, (uint32_t)value);
+    wr32(c, offset + 4, (uint32_t)(value >> 32));
+}
+
+static void nvme_irq(interrupt_frame_t* frame) {
+    (void)frame;
+    for (int i = 0; i < ctrl_count; i++) {
+        nvme_ctrl_t* c = &controllers[i];
+        if (c->irq < 0) {
+            continue;
+        }
+        if (c->intx) {
+            wr32(c, NVME_REG_INTMS, 1);
+        }
+        c->irq_pending = 1;
+    }
+}
+
+void nvme_set_polled(int polled) {
+    force_polled = polled ? 1 : 0;
+    for (int i = 0; i < ctrl_count; i++) {
+        for (int n = 0; n < controllers[i].ns_count; n++) {
+            controllers[i].ns[n].dev.polled = force_polled || controllers[i].irq < 0;
+        }
+    }
+}
+
+int nvme_polled(void) {
+    return force_polled;
+}
+
+static void queue_free(nvme_queue_t* q) {
+    kfree_aligned(q->sq);
+    kfree_aligned((void*)q->cq);
+    for (int i = 0; i < NVME_QUEUE_SLOTS; i++) {
+        kfree_aligned(q->prp_lists[i]);
+    }
+    memset(q, 0, sizeof(nvme_queue_t));
+}
+
+// Frees whatever it allocated when it fails
+static int queue_alloc(nvme_ctrl_t* c, nvme_queue_t* q, uint16_t qid, uint16_t size, int slots) {
+    memset(q, 0, sizeof(nvme_queue_t));
+    q->qid = qid;
+    q->size = size;
+    q->phase = 1;
+    q->sq = (nvme_sqe_t*)kmalloc_aligned(size * sizeof(nvme_sqe_t), NVME_PAGE_SIZE);
+    q->cq = (volatile nvme_cqe_t*)kmalloc_aligned(size * sizeof(nvme_cqe_t), NVME_PAGE_SIZE);
+    if (!q->sq || !q->cq) {
+        queue_free(q);
+        return 1;
+    }
+    memset(q->sq, 0, size * sizeof(nvme_sqe_t));
+    memset((void*)q->cq, 0, size * sizeof(nvme_cqe_t));
+
+    q->sq_db = (volatile uint32_t*)(c->regs + NVME_REG_DOORBELL + (2 * qid) * c->db_stride);
+    q->cq_db = (volatile uint32_t*)(c->regs + NVME_REG_DOORBELL + (2 * qid + 1) * c->db_stride);
+    q->free_slots = slots == 32 ? 0xFFFFFFFF : (1u << slots) - 1;
+
+    if (qid != 0) {
+        for (int i = 0; i < slots; i++) {
+            q->prp_lists[i] = (uint64_t*)kmalloc_aligned(NVME_PAGE_SIZE, NVME_PAGE_SIZE);
+            if (!q->prp_lists[i]) {
+                queue_free(q);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Copies a command into the ring; the doorbell is rung separately so a
+// batch costs one MMIO write per queue.
+static int queue_push(nvme_queue_t* q, nvme_sqe_t* cmd) {
+    if (!q->free_slots) {
+        return -1;
+    }
+
+    int slot = __builtin_ctz(q->free_slots);
+    q->free_slots &= ~(1u << slot);
+    cmd->cid = slot;
+    memcpy(&q->sq[q->sq_tail], cmd, sizeof(nvme_sqe_t));
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    return slot;
+}
+
+static void queue_ring(nvme_queue_t* q) {
+    __sync_synchronize();
+    *q->sq_db = q->sq_tail;
+}
+
+// A flush or a discard is one command, counted as a single issued unit
+static uint32_t req_units(blk_request_t* req) {
+    return req->op == BLK_OP_FLUSH || req->op == BLK_OP_DISCARD ? 1 : req->count;
+}
+
+static void nvme_finish(blk_request_t* req) {
+    if (req->inflight == 0 && req->issued == req_units(req)) {
+        blk_complete(req);
+    }
+}
+
+// Consumes completions. Returns how many finished, failed ones are added
+// to *errors and the result of the last one is left in *result. Commands
+// issued for a block request complete their share of it.
+static int queue_reap(nvme_ctrl_t* c, nvme_queue_t* q, int* errors, uint32_t* result) {
+    int done = 0;
+    while ((q->cq[q->cq_head].status & 1) == q->phase) {
+        __sync_synchronize();
+        volatile nvme_cqe_t* cqe = &q->cq[q->cq_head];
+        if (cqe->status >> 1) {
+            print("NVMe: command failed, status ");
+            print_hex(cqe->status >> 1);
+            print("\n");
+            (*errors)++;
+        }
+        if (result) {
+            *result = cqe->result;
+        }
+
+        uint16_t cid = cqe->cid;
+        if (q->qid != 0 && q->owner[cid]) {
+            blk_request_t* req = q->owner[cid];
+            q->owner[cid] = NULL;
+            if (cqe->status >> 1) {
+                req->failed = 1;
+            }
+            req->inflight--;
+            c->busy--;
+            nvme_finish(req);
+        }
+        q->free_slots |= 1u << cid;
+
+        q->cq_head++;
+        if (q->cq_head == q->size) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        done++;
+    }
+
+    if (done) {
+        *q->cq_db = q->cq_head;
+    }
+    if (c->intx) {
+        wr32(c, NVME_REG_INTMC, 1);
+    }
+    return done;
+}
+
+static int queue_has_completion(nvme_queue_t* q) {
+    return (q->cq[q->cq_head].status & 1) == q->phase;
+}
+
+// Runs one admin command to completion. Admin traffic only happens
+// during bring-up, so it is always polled.
+static int nvme_admin(nvme_ctrl_t* c, nvme_sqe_t* cmd, uint32_t* result) {
+    nvme_queue_t* q = &c->admin;
+    if (queue_push(q, cmd) < 0) {
+        return 1;
+    }
+    queue_ring(q);
+
+    int errors = 0;
+    uint64_t start = timer_ticks();
+    while (!queue_reap(c, q, &errors, result)) {
+        if (timer_ticks() - start >= NVME_CMD_TIMEOUT_MS * TIMER_HZ / 1000) {
+            print("NVMe: admin command timeout\n");
+            c->broken = 1;
+            return 1;
+        }
+        asm volatile ("pause");
+    }
+    return errors ? 1 : 0;
+}
+
+static int nvme_identify(nvme_ctrl_t* c, uint32_t cns, uint32_t nsid, void* buffer) {
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = (uint64_t)(unsigned long)buffer;
+    cmd.cdw10 = cns;
+    return nvme_admin(c, &cmd, NULL);
+}
+
+// Points PRP1 at the buffer and PRP2 at either the second page or a list
+// of every page after the first.
+static void build_prps(nvme_queue_t* q, int slot, nvme_sqe_t* cmd, uint64_t addr, uint32_t bytes) {
+    uint32_t first = NVME_PAGE_SIZE - (addr & (NVME_PAGE_SIZE - 1));
+    uint64_t next = (addr & ~(uint64_t)(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE;
+
+    cmd->prp1 = addr;
+    cmd->prp2 = 0;
+    if (bytes <= first) {
+        return;
+    }
+
+    uint32_t remaining = bytes - first;
+    if (remaining <= NVME_PAGE_SIZE) {
+        cmd->prp2 = next;
+        return;
+    }
+
+    uint64_t* list = q->prp_lists[slot];
+    int n = 0;
+    while (remaining) {
+        list[n++] = next;
+        next += NVME_PAGE_SIZE;
+        remaining -= remaining > NVME_PAGE_SIZE ? NVME_PAGE_SIZE : remaining;
+    }
+    cmd->prp2 = (uint64_t)(unsigned long)list;
+}
+
+// Cuts queued requests into commands and spreads them over the I/O
+// queues, round robin, while command ids are free. Each queue's doorbell
+// is rung once per refill.
+static void nvme_kick(nvme_ctrl_t* c) {
+    if (!c->queue_head) {
+        return;
+    }
+
+    for (int k = 0; k < c->io_queues && c->queue_head; k++) {
+        nvme_queue_t* q = &c->io[(c->next_queue + k) % c->io_queues];
+        int added = 0;
+
+        while (c->queue_head && q->free_slots) {
+            blk_request_t* req = c->queue_head;
+            nvme_ns_t* ns = (nvme_ns_t*)blkdev_get(req->dev)->priv;
+            uint32_t n = req_units(req) - req->issued;
+            if (n > c->max_sectors) {
+                n = c->max_sectors;
+            }
+
+            nvme_sqe_t cmd;
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.nsid = ns->nsid;
+            int slot = __builtin_ctz(q->free_slots);
+            if (req->op == BLK_OP_FLUSH) {
+                cmd.opcode = NVME_CMD_FLUSH;
+            } else if (req->op == BLK_OP_DISCARD) {
+                // One range, kept in the command id's PRP list page
+                uint32_t* range = (uint32_t*)q->prp_lists[slot];
+                uint64_t slba = req->lba >> (ns->lba_shift - 9);
+                range[0] = 0;
+                range[1] = req->count >> (ns->lba_shift - 9);
+                range[2] = (uint32_t)slba;
+                range[3] = (uint32_t)(slba >> 32);
+                cmd.opcode = NVME_CMD_DSM;
+                cmd.cdw10 = 0; // Ranges - 1
+                cmd.cdw11 = NVME_DSM_AD;
+                cmd.prp1 = (uint64_t)(unsigned long)range;
+            } else {
+                uint64_t lba = req->lba + req->issued;
+                uint64_t slba = lba >> (ns->lba_shift - 9);
+                cmd.opcode = req->op == BLK_OP_WRITE ? NVME_CMD_WRITE : NVME_CMD_READ;
+                cmd.cdw10 = (uint32_t)slba;
+                cmd.cdw11 = (uint32_t)(slba >> 32);
+                cmd.cdw12 = (n >> (ns->lba_shift - 9)) - 1;
+                if (req->op == BLK_OP_WRITE && (req->flags & BLK_REQ_FUA)) {
+                    cmd.cdw12 |= NVME_RW_FUA;
+                }
+                build_prps(q, slot, &cmd, (uint64_t)(unsigned long)req->buffer + (uint64_t)req->issued * 512, n * 512);
+            }
+
+            // The timeout runs from the first command of an idle controller
+            if (!c->busy) {
+                c->progress = timer_ticks();
+            }
+            queue_push(q, &cmd);
+            q->owner[slot] = req;
+            req->issued += n;
+            req->inflight++;
+            c->busy++;
+            added = 1;
+
+            if (req->issued == req_units(req)) {
+                c->queue_head = req->next;
+                if (!c->queue_head) {
+                    c->queue_tail = NULL;
+                }
+            }
+        }
+
+        if (added) {
+            queue_ring(q);
+        }
+    }
+    c->next_queue = (c->next_queue + 1) % c->io_queues;
+}
+
+// Fails everything queued or in flight. The controller state is unknown
+// after a timeout, so it takes no further requests.
+static void nvme_fail_all(nvme_ctrl_t* c) {
+    print("NVMe: I/O timeout\n");
+    c->broken = 1;
+
+    for (int k = 0; k < c->io_queues; k++) {
+        nvme_queue_t* q = &c->io[k];
+        for (int slot = 0; slot < NVME_QUEUE_SLOTS; slot++) {
+            blk_request_t* req = q->owner[slot];
+            if (req) {
+                q->owner[slot] = NULL;
+                req->failed = 1;
+                req->inflight--;
+                nvme_finish(req);
+            }
+        }
+    }
+    c->busy = 0;
+
+    while (c->queue_head) {
+        blk_request_t* req = c->queue_head;
+        c->queue_head = req->next;
+        req->failed = 1;
+        req->issued = req_units(req);
+        nvme_finish(req);
+    }
+    c->queue_tail = NULL;
+}
+
+static int nvme_blk_submit(blkdev_t* dev, blk_request_t* req) {
+    nvme_ns_t* ns = (nvme_ns_t*)dev->priv;
+    nvme_ctrl_t* c = ns->ctrl;
+    if (c->broken) {
+        return 1;
+    }
+
+    if (req->op == BLK_OP_FLUSH) {
+        if (!c->vwc) {
+            blk_complete(req);
+            return 0;
+        }
+    } else {
+        uint32_t spl = 1u << (ns->lba_shift - 9);
+        if ((req->lba % spl) || (req->count % spl)) {
+            return 1;
+        }
+        if ((unsigned long)req->buffer & 3) {
+            print("NVMe: buffer not dword aligned\n");
+            return 1;
+        }
+    }
+
+    req->next = NULL;
+    if (c->queue_tail) c->queue_tail->next = req;
+    else c->queue_head = req;
+    c->queue_tail = req;
+
+    nvme_kick(c);
+    return 0;
+}
+
+static void nvme_blk_poll(blkdev_t* dev) {
+    nvme_ctrl_t* c = ((nvme_ns_t*)dev->priv)->ctrl;
+    int errors = 0;
+    int done = 0;
+
+    c->irq_pending = 0;
+    for (int k = 0; k < c->io_queues; k++) {
+        done += queue_reap(c, &c->io[k], &errors, NULL);
+    }
+
+    if (done) {
+        c->progress = timer_ticks();
+    } else if (c->busy && timer_ticks() - c->progress >= NVME_CMD_TIMEOUT_MS * TIMER_HZ / 1000) {
+        nvme_fail_all(c);
+        return;
+    }
+
+    nvme_kick(c);
+}
+
+static int nvme_blk_ready(blkdev_t* dev) {
+    nvme_ctrl_t* c = ((nvme_ns_t*)dev->priv)->ctrl;
+    if (c->irq_pending) {
+        return 1;
+    }
+    for (int k = 0; k < c->io_queues; k++) {
+        if (queue_has_completion(&c->io[k])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const blkdev_ops_t nvme_blk_ops = {
+    .read = NULL,
+    .write = NULL,
+    .flush = NULL,
+    .discard = NULL,
+    .submit = nvme_blk_submit,
+    .poll = nvme_blk_poll,
+    .ready = nvme_blk_ready,
+};
+
+static void copy_id_string(char* out, const uint8_t* in, int len) {
+    memcpy(out, in, len);
+    out[len] = '\0';
+    while (len > 0 && out[len - 1] == ' ') {
+        out[--len] = '\0';
+    }
+}
+
+static int nvme_wait_ready(nvme_ctrl_t* c, uint32_t ready) {
+    uint64_t start = timer_ticks();
+    while ((rd32(c, NVME_REG_CSTS) & NVME_CSTS_RDY) != ready) {
+        if (rd32(c, NVME_REG_CSTS) & NVME_CSTS_CFS) {
+            print("NVMe: controller fatal status\n");
+            return 1;
+        }
+        if (timer_ticks() - start >= (uint64_t)c->ready_ms * TIMER_HZ / 1000) {
+            print("NVMe: controller ready timeout\n");
+            return 1;
+        }
+        asm volatile ("pause");
+    }
+    return 0;
+}
+
+static void nvme_setup_irq(nvme_ctrl_t* c, uint8_t bus, uint8_t slot, uint8_t func) {
+    c->irq = -1;
+    c->intx = 0;
+
+    int vector = msi_alloc_vector(nvme_irq);
+    if (vector >= 0 && !pci_enable_msi(bus, slot, func, msi_address(), vector)) {
+        c->irq = vector;
+        return;
+    }
+
+    uint8_t line = pci_read_dword(bus, slot, func, 0x3C) & 0xFF;
+    if (line < 16) {
+        c->irq = line;
+        c->intx = 1;
+        irq_install(line, nvme_irq);
+    }
+}
+
+static int nvme_create_io_queues(nvme_ctrl_t* c, uint16_t size) {
+    nvme_sqe_t cmd;
+    uint32_t result = 0;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((NVME_IO_QUEUES - 1) << 16) | (NVME_IO_QUEUES - 1);
+    if (nvme_admin(c, &cmd, &result)) {
+        return 1;
+    }
+
+    int granted = (result & 0xFFFF) + 1;
+    if ((int)(result >> 16) + 1 < granted) granted = (result >> 16) + 1;
+    if (granted > NVME_IO_QUEUES) granted = NVME_IO_QUEUES;
+
+    c->io_queues = 0;
+    for (int i = 0; i < granted; i++) {
+        nvme_queue_t* q = &c->io[i];
+        uint16_t qid = i + 1;
+        int slots = size - 1 < NVME_QUEUE_SLOTS ? size - 1 : NVME_QUEUE_SLOTS;
+        if (queue_alloc(c, q, qid, size, slots)) {
+            break;
+        }
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADMIN_CREATE_CQ;
+        cmd.prp1 = (uint64_t)(unsigned long)q->cq;
+        cmd.cdw10 = ((uint32_t)(size - 1) << 16) | qid;
+        cmd.cdw11 = c->irq >= 0 ? 0x3 : 0x1; // Physically contiguous, interrupts on vector 0
+        if (nvme_admin(c, &cmd, NULL)) {
+            queue_free(q);
+            break;
+        }
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADMIN_CREATE_SQ;
+        cmd.prp1 = (uint64_t)(unsigned long)q->sq;
+        cmd.cdw10 = ((uint32_t)(size - 1) << 16) | qid;
+        cmd.cdw11 = ((uint32_t)qid << 16) | 0x1;
+        if (nvme_admin(c, &cmd, NULL)) {
+            // Hand the completion queue back before freeing its memory.
+            // If even that fails the controller still owns it, and only
+            // nvme_teardown, which disables the controller, may free it.
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.opcode = NVME_ADMIN_DELETE_CQ;
+            cmd.cdw10 = qid;
+            if (nvme_admin(c, &cmd, NULL) == 0) {
+                queue_free(q);
+            }
+            break;
+        }
+        c->io_queues++;
+    }
+
+    return c->io_queues == 0;
+}
+
+static void nvme_add_namespace(nvme_ctrl_t* c, int index, uint32_t nsid, const uint8_t* id) {
+    uint64_t nsze = *(const uint64_t*)id;
+    uint8_t format = id[26] & 0x0F;
+    uint32_t lbaf = *(const uint32_t*)(id + 128 + 4 * format);
+    uint32_t shift = (lbaf >> 16) & 0xFF;
+
+    if (nsze == 0 || shift < 9 || shift > 16 || (lbaf & 0xFFFF)) {
+        return; // Inactive, odd block size, or interleaved metadata
+    }
+
+    nvme_ns_t* ns = &c->ns[c->ns_count];
+    blkdev_t* dev = &ns->dev;
+    char num_buf[12];
+
+    memset(ns, 0, sizeof(nvme_ns_t));
+    ns->ctrl = c;
+    ns->nsid = nsid;
+    ns->lba_shift = shift;
+
+    strlcpy(dev->name, "nvme", sizeof(dev->name));
+    itoa(index, num_buf, 10);
+    strlcat(dev->name, num_buf, sizeof(dev->name));
+    strlcat(dev->name, "n", sizeof(dev->name));
+    itoa(nsid, num_buf, 10);
+    strlcat(dev->name, num_buf, sizeof(dev->name));
+    dev->ops = &nvme_blk_ops;
+    dev->priv = ns;
+    dev->unit = index;
+    dev->sectors = nsze << (shift - 9);
+    dev->sector_size = 1u << shift;
+    dev->physical_sector_size = dev->sector_size;
+    // NPWG: preferred write granularity, the nearest thing to a physical sector
+    if (id[24] & (1 << 4)) {
+        uint32_t npwg = *(const uint16_t*)(id + 64) + 1;
+        if ((npwg & (npwg - 1)) == 0) {
+            dev->physical_sector_size = dev->sector_size * npwg;
+        }
+    }
+    dev->queue_depth = c->io_queues * (c->io[0].size - 1 < NVME_QUEUE_SLOTS ? c->io[0].size - 1 : NVME_QUEUE_SLOTS);
+    dev->polled = force_polled || c->irq < 0;
+    dev->discard = c->dsm;
+    dev->write_cache = c->vwc;
+    dev->fua = 1;
+
+    if (blkdev_register(dev) >= 0) {
+        c->ns_count++;
+        print("NVMe: ");
+        print(dev->name);
+        print(", ");
+        itoa((int)(dev->sectors / 2048), num_buf, 10);
+        print(num_buf);
+        print(" MiB, block ");
+        itoa((int)dev->sector_size, num_buf, 10);
+        print(num_buf);
+        print("\n");
+    }
+}
+
+// Undoes a setup that failed after the admin queue was allocated: the
+// controller is disabled first so nothing is written to freed queues
+static void nvme_teardown(nvme_ctrl_t* c) {
+    wr32(c, NVME_REG_INTMS, 0xFFFFFFFF);
+    wr32(c, NVME_REG_CC, rd32(c, NVME_REG_CC) & ~NVME_CC_EN);
+    nvme_wait_ready(c, 0);
+    queue_free(&c->admin);
+    for (int i = 0; i < NVME_IO_QUEUES; i++) {
+        queue_free(&c->io[i]);
+    }
+    c->io_queues = 0;
+}
+
+static int nvme_setup(nvme_ctrl_t* c, int index, uint8_t bus, uint8_t slot, uint8_t func) {
+    uint32_t bar0 = pci_read_dword(bus, slot, func, 0x10);
+    uint32_t bar1 = pci_read_dword(bus, slot, func, 0x14);
+    if (bar0 & 1) {
+        print("NVMe: BAR0 is not memory\n");
+        return 1;
+    }
+    if (((bar0 >> 1) & 3) == 2 && bar1) {
+        print("NVMe: registers above 4 GiB are not mapped\n");
+        return 1;
+    }
+
+    uint32_t command = pci_read_dword(bus, slot, func, 0x04);
+    command |= (1 << 1) | (1 << 2);
+    pci_write_dword(bus, slot, func, 0x04, command);
+
+    memset(c, 0, sizeof(nvme_ctrl_t));
+    c->regs = (volatile uint8_t*)(unsigned long)(bar0 & ~0xFu);
+
+    uint32_t cap_lo = rd32(c, NVME_REG_CAP);
+    uint32_t cap_hi = rd32(c, NVME_REG_CAP + 4);
+    uint16_t mqes = (cap_lo & 0xFFFF) + 1;
+    c->db_stride = 4u << (cap_hi & 0x0F);
+    c->ready_ms = ((cap_lo >> 24) & 0xFF) * 500;
+    if (c->ready_ms == 0) c->ready_ms = 500;
+    if ((cap_hi >> 16) & 0x0F) {
+        print("NVMe: controller does not support 4 KiB pages\n");
+        return 1;
+    }
+
+    print("NVMe: controller version ");
+    print_hex(rd32(c, NVME_REG_VS));
+    print("\n");
+
+    // Reset, then describe the admin queue and turn it back on
+    if (rd32(c, NVME_REG_CC) & NVME_CC_EN) {
+        wr32(c, NVME_REG_CC, rd32(c, NVME_REG_CC) & ~NVME_CC_EN);
+    }
+    if (nvme_wait_ready(c, 0)) {
+        return 1;
+    }
+
+    uint16_t admin_size = mqes < NVME_ADMIN_QUEUE_SIZE ? mqes : NVME_ADMIN_QUEUE_SIZE;
+    if (queue_alloc(c, &c->admin, 0, admin_size, 1)) {
+        print("NVMe: out of memory\n");
+        return 1;
+    }
+
+    wr32(c, NVME_REG_AQA, ((uint32_t)(admin_size - 1) << 16) | (admin_size - 1));
+    wr64(c, NVME_REG_ASQ, (uint64_t)(unsigned long)c->admin.sq);
+    wr64(c, NVME_REG_ACQ, (uint64_t)(unsigned long)c->admin.cq);
+    wr32(c, NVME_REG_INTMS, 0xFFFFFFFF);
+    wr32(c, NVME_REG_CC, NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_EN);
+    if (nvme_wait_ready(c, NVME_CSTS_RDY)) {
+        nvme_teardown(c);
+        return 1;
+    }
+
+    uint8_t* id = (uint8_t*)kmalloc_aligned(NVME_PAGE_SIZE, NVME_PAGE_SIZE);
+    if (!id) {
+        nvme_teardown(c);
+        return 1;
+    }
+
+    if (nvme_identify(c, 1, 0, id)) {
+        print("NVMe: IDENTIFY controller failed\n");
+        kfree_aligned(id);
+        nvme_teardown(c);
+        return 1;
+    }
+
+    copy_id_string(c->serial, id + 4, 20);
+    copy_id_string(c->model, id + 24, 40);
+    copy_id_string(c->firmware, id + 64, 8);
+    uint8_t mdts = id[77];
+    uint32_t nn = *(uint32_t*)(id + 516);
+    c->vwc = id[525] & 1;
+    c->dsm = (*(uint16_t*)(id + 520) >> 2) & 1; // ONCS
+
+    uint32_t pages = NVME_MAX_XFER_PAGES;
+    if (mdts && mdts < 16 && (1u << mdts) < pages) {
+        pages = 1u << mdts;
+    }
+    c->max_sectors = pages * (NVME_PAGE_SIZE / 512);
+
+    print("NVMe: ");
+    print(c->model);
+    print(", fw ");
+    print(c->firmware);
+    print(", namespaces ");
+    print_hex(nn);
+    print("\n");
+
+    nvme_setup_irq(c, bus, slot, func);
+    uint16_t io_size = mqes < NVME_QUEUE_SIZE ? mqes : NVME_QUEUE_SIZE;
+    if (nvme_create_io_queues(c, io_size)) {
+        print("NVMe: could not create I/O queues\n");
+        kfree_aligned(id);
+        nvme_teardown(c);
+        return 1;
+    }
+    if (c->irq >= 0) {
+        wr32(c, NVME_REG_INTMC, 1);
+    }
+
+    print("NVMe: ");
+    print_hex(c->io_queues);
+    print(" I/O queue pairs, ");
+    print(c->irq < 0 ? "polled" : (c->intx ? "INTx" : "MSI"));
+    print("\n");
+
+    // Controllers report how many namespace ids they support, not how
+    // many exist; the active ones are nearly always at the front
+    if (nn > 32) nn = 32;
+    for (uint32_t nsid = 1; nsid <= nn && c->ns_count < NVME_MAX_NAMESPACES; nsid++) {
+        if (nvme_identify(c, 0, nsid, id) == 0) {
+            nvme_add_namespace(c, index, nsid, id);
+        }
+    }
+
+    kfree_aligned(id);
+    return 0;
+}
+
+int nvme_init(void) {
+    int namespaces = 0;
+
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            for (int func = 0; func < 8; func++) {
+                uint32_t id = pci_read_dword(bus, slot, func, 0);
+                if (id == 0xFFFFFFFF) continue;
+
+                uint32_t class_code = pci_read_dword(bus, slot, func, 0x08);
+                if (((class_code >> 24) & 0xFF) != NVME_CLASS ||
+                    ((class_code >> 16) & 0xFF) != NVME_SUBCLASS ||
+                    ((class_code >> 8) & 0xFF) != NVME_PROG_IF ||
+                    ctrl_count == NVME_MAX_CONTROLLERS) {
+                    continue;
+                }
+
+                nvme_ctrl_t* c = &controllers[ctrl_count];
+                if (nvme_setup(c, ctrl_count, bus, slot, func) == 0) {
+                    namespaces += c->ns_count;
+                    ctrl_count++;
+                }
+            }
+        }
+    }
+
+    return namespaces;
+}
@@ -0,0 +1,275 @@
+#include "include/part.h"
+#include "include/blkdev.h"
+#include "include/fs.h"
+#include "include/lib.h"
+#include "include/mm.h"
+
+#define GPT_SIGNATURE 0x5452415020494645ULL // "EFI PART"
+#define MBR_TYPE_GPT_PROTECTIVE 0xEE
+
+// One table per block device, filled in by part_scan
+typedef struct {
+    partition_t entries[PART_MAX];
+    int count;
+    uint8_t scanned;
+    uint8_t is_gpt;
+    uint32_t spl;          // 512-byte blocks per logical sector of the device
+} part_table_t;
+
+static part_table_t tables[BLKDEV_MAX];
+
+static part_table_t* table_of(int dev) {
+    return dev >= 0 && dev < BLKDEV_MAX && tables[dev].scanned ? &tables[dev] : NULL;
+}
+
+static int guid_is_zero(const uint8_t* guid) {
+    for (int i = 0; i < 16; i++) {
+        if (guid[i]) return 0;
+    }
+    return 1;
+}
+
+static void print_guid(const uint8_t* g) {
+    // The first three fields are stored little endian
+    static const int order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    const char* hex = "0123456789ABCDEF";
+    char buf[37];
+    int pos = 0;
+
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            buf[pos++] = '-';
+        }
+        buf[pos++] = hex[g[order[i]] >> 4];
+        buf[pos++] = hex[g[order[i]] & 0xF];
+    }
+    buf[pos] = '\0';
+    print(buf);
+}
+
+static void parse_mbr(part_table_t* t, const uint8_t* mbr) {
+    for (int i = 0; i < 4 && t->count < PART_MAX; i++) {
+        const uint8_t* entry = mbr + 446 + i * 16;
+        uint8_t type = entry[4];
+        uint32_t start = *(const uint32_t*)(entry + 8);
+        uint32_t sectors = *(const uint32_t*)(entry + 12);
+
+        if (type == 0 || type == MBR_TYPE_GPT_PROTECTIVE || sectors == 0) {
+            continue;
+        }
+
+        partition_t* p = &t->entries[t->count++];
+        memset(p, 0, sizeof(partition_t));
+        p->mbr_type = type;
+        p->start_lba = (uint64_t)start * t->spl;
+        p->end_lba = ((uint64_t)start + sectors) * t->spl - 1;
+        strlcpy(p->name, "mbr", sizeof(p->name));
+    }
+}
+
+static int parse_gpt(int dev, part_table_t* t) {
+    const gpt_header_t* header = blkdev_map(dev, t->spl);
+    if (!header) {
+        return 0;
+    }
+
+    // The header is untrusted: entries are 128 << n bytes by the spec, so
+    // anything past a sector or not a multiple of 8 is corruption, and
+    // keeps the table size below from overflowing
+    uint32_t entry_size = header->size_of_partition_entry;
+    if (header->signature != GPT_SIGNATURE || entry_size < sizeof(gpt_partition_entry_t) ||
+        entry_size > 512 || (entry_size % 8)) {
+        blkdev_unmap(header);
+        return 0;
+    }
+
+    uint32_t num_entries = header->num_partition_entries;
+    uint64_t entries_lba = header->partition_entries_lba;
+    blkdev_unmap(header);
+    if (num_entries > 256) {
+        num_entries = 256;
+    }
+
+    uint32_t table_sectors = (entry_size * num_entries + 511) / 512;
+    table_sectors = (table_sectors + t->spl - 1) / t->spl * t->spl;
+    uint8_t* entries = (uint8_t*)kmalloc(table_sectors * 512);
+    if (!entries) {
+        return 0;
+    }
+
+    if (blkdev_read(dev, entries_lba * t->spl, table_sectors, entries)) {
+        kfree(entries);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < num_entries && t->count < PART_MAX; i++) {
+        gpt_partition_entry_t* entry = (gpt_partition_entry_t*)(entries + i * entry_size);
+        if (guid_is_zero(entry->partition_type_guid) || entry->starting_lba == 0) {
+            continue;
+        }
+
+        partition_t* p = &t->entries[t->count++];
+        memset(p, 0, sizeof(partition_t));
+        memcpy(p->type_guid, entry->partition_type_guid, 16);
+        memcpy(p->unique_guid, entry->unique_partition_guid, 16);
+        p->start_lba = entry->starting_lba * t->spl;
+        p->end_lba = (entry->ending_lba + 1) * t->spl - 1;
+
+        int n = 0;
+        for (int c = 0; c < 36 && entry->partition_name[c]; c++) {
+            uint16_t ch = entry->partition_name[c];
+            p->name[n++] = (ch < 0x80) ? (char)ch : '?';
+        }
+        p->name[n] = '\0';
+    }
+
+    kfree(entries);
+    return 1;
+}
+
+// Reads the first sector of every partition and records which ones
+// carry the AlwexOS signature.
+static void probe_partitions(int dev, part_table_t* t) {
+    for (int i = 0; i < t->count; i++) {
+        blkdev_prefetch(dev, t->entries[i].start_lba, 1);
+    }
+    blk_wait_all();
+
+    for (int i = 0; i < t->count; i++) {
+        const uint8_t* sector = blkdev_map(dev, t->entries[i].start_lba);
+        t->entries[i].has_fs = sector && fs_probe(sector);
+        blkdev_unmap(sector);
+    }
+}
+
+// Parses the MBR or GPT of a block device once; later lookups use the
+// device's table.
+int part_scan(int dev) {
+    if (dev < 0 || dev >= BLKDEV_MAX) {
+        return 0;
+    }
+    part_table_t* t = &tables[dev];
+    memset(t, 0, sizeof(part_table_t));
+
+    const uint8_t* mbr = blkdev_get(dev) ? blkdev_map(dev, 0) : NULL;
+    if (!mbr) {
+        print("Partitions: device not readable\n");
+        return 0;
+    }
+
+    // Table LBAs count logical sectors; the partition table keeps 512-byte units
+    t->spl = blkdev_get(dev)->sector_size / 512;
+    t->scanned = 1;
+
+    if (mbr[510] == 0x55 && mbr[511] == 0xAA) {
+        parse_mbr(t, mbr);
+    }
+    blkdev_unmap(mbr);
+
+    if (t->count == 0 && parse_gpt(dev, t)) {
+        t->is_gpt = 1;
+    }
+
+    probe_partitions(dev, t);
+
+    print("Partitions on ");
+    print(blkdev_get(dev)->name);
+    print(": ");
+    print(t->is_gpt ? "GPT, " : (t->count ? "MBR, " : "none found"));
+    if (t->count) {
+        print_hex(t->count);
+        print(" entries");
+    }
+    print("\n");
+
+    return t->count;
+}
+
+int part_scanned(int dev) {
+    return table_of(dev) != NULL;
+}
+
+int part_is_gpt(int dev) {
+    part_table_t* t = table_of(dev);
+    return t && t->is_gpt;
+}
+
+int part_count(int dev) {
+    part_table_t* t = table_of(dev);
+    return t ? t->count : 0;
+}
+
+const partition_t* part_get(int dev, int index) {
+    part_table_t* t = table_of(dev);
+    if (!t || index < 0 || index >= t->count) {
+        return NULL;
+    }
+    return &t->entries[index];
+}
+
+static void print_table(int dev, const part_table_t* t) {
+    char num_buf[12];
+
+    print(t->is_gpt ? "GPT on " : "MBR on ");
+    print(blkdev_get(dev)->name);
+    print("\n");
+
+    for (int i = 0; i < t->count; i++) {
+        const partition_t* p = &t->entries[i];
+        itoa(i, num_buf, 10);
+        print(num_buf);
+        print(": LBA ");
+        print_hex((uint32_t)p->start_lba);
+        print("-");
+        print_hex((uint32_t)p->end_lba);
+        print(" ");
+        if (t->is_gpt) {
+            print_guid(p->type_guid);
+        } else {
+            print("type ");
+            print_hex(p->mbr_type);
+        }
+        print(" ");
+        print(p->name);
+        if (p->has_fs) {
+            print(" [AlwexOS]");
+        }
+        print("\n");
+    }
+}
+
+void part_print_table(void) {
+    int shown = 0;
+    for (int dev = 0; dev < BLKDEV_MAX; dev++) {
+        part_table_t* t = table_of(dev);
+        if (t && t->count) {
+            print_table(dev, t);
+            shown++;
+        }
+    }
+
+    if (!shown) {
+        print("No partitions\n");
+    }
+}
+
+uint32_t find_fs_partition(int dev) {
+    part_table_t* t = table_of(dev);
+    for (int i = 0; t && i < t->count; i++) {
+        if (t->entries[i].has_fs) {
+            print("Found AlwexOS filesystem at LBA: ");
+            print_hex((uint32_t)t->entries[i].start_lba);
+            print("\n");
+            return (uint32_t)t->entries[i].start_lba;
+        }
+    }
+
+    return 0;
+}
+
+int is_fs_supported(int dev, uint32_t lba) {
+    const uint8_t* sector = blkdev_get(dev) ? blkdev_map(dev, lba) : NULL;
+    int found = sector && fs_probe(sector);
+    blkdev_unmap(sector);
+    return found;
+}
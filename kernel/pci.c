@@ -18,3 +18,53 @@ void pci_write_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, ui
     outl(0xCF8, address);
     outl(0xCFC, value);
 }
+
+// Walks the capability list and returns the config offset of the
+// capability with the given ID, or 0 if the function does not have it.
+uint8_t pci_find_capability(uint8_t bus, uint8_t slot, uint8_t func, uint8_t cap_id) {
+    uint32_t status = pci_read_dword(bus, slot, func, 0x04) >> 16;
+    if (!(status & (1 << 4))) {
+        return 0;
+    }
+
+    uint8_t offset = pci_read_dword(bus, slot, func, 0x34) & 0xFC;
+    for (int guard = 0; offset && guard < 48; guard++) {
+        uint32_t header = pci_read_dword(bus, slot, func, offset);
+        if ((header & 0xFF) == cap_id) {
+            return offset;
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+
+    return 0;
+}
+
+// Points the function's MSI capability at the local APIC so it raises
+// the given vector. Returns 0 on success, 1 if MSI is not available.
+int pci_enable_msi(uint8_t bus, uint8_t slot, uint8_t func, uint32_t address, uint8_t vector) {
+    uint8_t cap = pci_find_capability(bus, slot, func, PCI_CAP_MSI);
+    if (!cap) {
+        return 1;
+    }
+
+    uint32_t header = pci_read_dword(bus, slot, func, cap);
+    uint16_t control = header >> 16;
+    int is_64bit = control & (1 << 7);
+
+    pci_write_dword(bus, slot, func, cap + 4, address);
+    if (is_64bit) {
+        pci_write_dword(bus, slot, func, cap + 8, 0);
+        pci_write_dword(bus, slot, func, cap + 12, vector);
+    } else {
+        pci_write_dword(bus, slot, func, cap + 8, vector);
+    }
+
+    control &= ~(0x7 << 4); // One message
+    control |= 1;           // MSI enable
+    pci_write_dword(bus, slot, func, cap, (header & 0xFFFF) | ((uint32_t)control << 16));
+
+    uint32_t command = pci_read_dword(bus, slot, func, 0x04);
+    pci_write_dword(bus, slot, func, 0x04, command | (1 << 10)); // INTx disable
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include "include/raid0.h"
+#include "include/ahci.h"
+#include "include/blkdev.h"
+#include "include/bcache.h"
+#include "include/lib.h"
+
+static int stripe_drives[RAID0_MAX_DRIVES];
+static int stripe_devs[RAID0_MAX_DRIVES];   // Block device ids of the members
+static int stripe_count = 0;
+static uint32_t chunk_size = RAID0_DEFAULT_CHUNK;
+
+// The stripe set is a block device of its own. Each request is cut at
+// chunk boundaries into child requests on the members, which all run at
+// once; the request completes when the last child has.
+static blkdev_t raid_dev;
+static int raid_id = -1;
+static blk_request_t children[RAID0_CHILDREN];
+static uint64_t children_free = ~0ULL;
+static blk_request_t* active_head = NULL; // Requests being split, oldest first
+static blk_request_t* active_tail = NULL;
+
+static void raid_issue(void);
+
+static void child_done(blk_request_t* child) {
+    blk_request_t* cmd = (blk_request_t*)child->ctx;
+    if (child->status) {
+        cmd->failed = 1;
+    }
+    cmd->inflight--;
+    children_free |= 1ULL << (child - children);
+    raid_issue();
+}
+
+// Sectors of a request to hand out, or for a flush, members to flush
+static uint32_t request_pieces(const blk_request_t* cmd) {
+    return cmd->op == BLK_OP_FLUSH ? (uint32_t)stripe_count : cmd->count;
+}
+
+// Hands out pieces of the active requests while child requests are
+// free. A piece a member refuses fails its request.
+static void raid_issue(void) {
+    for (blk_request_t* cmd = active_head; cmd && children_free; cmd = cmd->next) {
+        while (cmd->issued < request_pieces(cmd) && children_free) {
+            int slot = __builtin_ctzll(children_free);
+            blk_request_t* child = &children[slot];
+            memset(child, 0, sizeof(blk_request_t));
+            child->op = cmd->op;
+            child->flags = cmd->flags;
+            child->done = child_done;
+            child->ctx = cmd;
+
+            uint32_t len = 1;
+            if (cmd->op == BLK_OP_FLUSH) {
+                child->dev = stripe_devs[cmd->issued];
+            } else {
+                uint64_t lba = cmd->lba + cmd->issued;
+                uint64_t chunk = lba / chunk_size;
+                uint32_t offset = lba % chunk_size;
+                len = chunk_size - offset;
+                if (len > cmd->count - cmd->issued) {
+                    len = cmd->count - cmd->issued;
+                }
+                child->dev = stripe_devs[chunk % stripe_count];
+                child->lba = (chunk / stripe_count) * chunk_size + offset;
+                child->count = len;
+                // LBAs are 512-byte units whatever the members' sector size
+                child->buffer = cmd->buffer ? (uint8_t*)cmd->buffer + (size_t)cmd->issued * 512 : NULL;
+            }
+
+            cmd->issued += len;
+            children_free &= ~(1ULL << slot);
+            if (blk_submit(child)) {
+                cmd->failed = 1;
+                children_free |= 1ULL << slot;
+            } else {
+                cmd->inflight++;
+            }
+        }
+    }
+}
+
+static int raid_submit(blkdev_t* dev, blk_request_t* req) {
+    (void)dev;
+    req->next = NULL;
+    if (active_tail) active_tail->next = req;
+    else active_head = req;
+    active_tail = req;
+    raid_issue();
+    return 0;
+}
+
+// Completes the requests whose pieces have all finished
+static void raid_poll(blkdev_t* dev) {
+    (void)dev;
+    blk_request_t* prev = NULL;
+    blk_request_t* cmd = active_head;
+    while (cmd) {
+        blk_request_t* next = cmd->next;
+        if (cmd->issued >= request_pieces(cmd) && !cmd->inflight) {
+            if (prev) prev->next = next;
+            else active_head = next;
+            if (active_tail == cmd) active_tail = prev;
+            blk_complete(cmd);
+        } else {
+            prev = cmd;
+        }
+        cmd = next;
+    }
+    raid_issue();
+}
+
+static int raid_ready(blkdev_t* dev) {
+    (void)dev;
+    for (blk_request_t* cmd = active_head; cmd; cmd = cmd->next) {
+        if (cmd->issued >= request_pieces(cmd) ? !cmd->inflight : children_free != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const blkdev_ops_t raid_ops = {
+    .submit = raid_submit,
+    .poll = raid_poll,
+    .ready = raid_ready,
+};
+
+int raid0_init(const int* drives, int ndrives, uint32_t chunk_sectors) {
+    if (ndrives < 2 || ndrives > RAID0_MAX_DRIVES) {
+        print("RAID-0: Need between 2 and 8 drives\n");
+        return 1;
+    }
+
+    if (chunk_sectors == 0 || (chunk_sectors & (chunk_sectors - 1))) {
+        print("RAID-0: Chunk size must be a power of two\n");
+        return 1;
+    }
+
+    if (raid_id >= 0 && raid_dev.inflight) {
+        print("RAID-0: Busy\n");
+        return 1;
+    }
+
+    int devs[RAID0_MAX_DRIVES];
+    uint64_t member_sectors = ~0ULL;
+    uint32_t sector_size = 512;
+    uint32_t physical = 512;
+    uint32_t depth = 0;
+    int discard = 1;
+    int write_cache = 0;
+    int fua = 1;
+    for (int i = 0; i < ndrives; i++) {
+        devs[i] = drives[i] >= 0 && drives[i] < ahci_drive_count() ? ahci_drive_blkdev_id(drives[i]) : -1;
+        blkdev_t* m = blkdev_get(devs[i]);
+        if (!m) {
+            print("RAID-0: No such drive\n");
+            return 1;
+        }
+        for (int j = 0; j < i; j++) {
+            if (drives[j] == drives[i]) {
+                print("RAID-0: Drive listed twice\n");
+                return 1;
+            }
+        }
+
+        // Pieces are cut at chunk boundaries, which must fall on whole
+        // sectors of every member
+        if (chunk_sectors % (m->sector_size / 512)) {
+            print("RAID-0: Chunk smaller than a member's sector\n");
+            return 1;
+        }
+        if (m->sectors < member_sectors) member_sectors = m->sectors;
+        if (m->sector_size > sector_size) sector_size = m->sector_size;
+        if (m->physical_sector_size > physical) physical = m->physical_sector_size;
+        depth += m->queue_depth;
+        discard &= m->discard;
+        write_cache |= m->write_cache;
+        fua &= m->fua;
+    }
+
+    member_sectors -= member_sectors % chunk_sectors;
+    if (!member_sectors) {
+        print("RAID-0: Drives smaller than a chunk\n");
+        return 1;
+    }
+
+    for (int i = 0; i < ndrives; i++) {
+        stripe_drives[i] = drives[i];
+        stripe_devs[i] = devs[i];
+    }
+    stripe_count = ndrives;
+    chunk_size = chunk_sectors;
+
+    strlcpy(raid_dev.name, "raid0", sizeof(raid_dev.name));
+    raid_dev.ops = &raid_ops;
+    raid_dev.sectors = member_sectors * ndrives;
+    raid_dev.sector_size = sector_size;
+    raid_dev.physical_sector_size = physical;
+    raid_dev.alignment_offset = 0;
+    raid_dev.queue_depth = depth < RAID0_CHILDREN ? depth : RAID0_CHILDREN;
+    raid_dev.discard = discard;
+    raid_dev.write_cache = write_cache;
+    raid_dev.fua = fua;
+    if (raid_id < 0) {
+        raid_id = blkdev_register(&raid_dev);
+        if (raid_id < 0) {
+            stripe_count = 0;
+            return 1;
+        }
+    } else {
+        // Same device, new layout: nothing cached is valid any more
+        bcache_invalidate(raid_id);
+        bcache_set_geometry(raid_id, physical / 512, 0);
+    }
+
+    raid0_print_info();
+    return 0;
+}
+
+int raid0_active(void) {
+    return stripe_count > 0;
+}
+
+void raid0_print_info(void) {
+    if (!stripe_count) {
+        print("RAID-0: Not configured\n");
+        return;
+    }
+
+    char num_buf[12];
+    print("RAID-0: block device ");
+    itoa(raid_id, num_buf, 10);
+    print(num_buf);
+    print(", ");
+    itoa(stripe_count, num_buf, 10);
+    print(num_buf);
+    print(" drives, chunk ");
+    itoa(chunk_size, num_buf, 10);
+    print(num_buf);
+    print(" sectors, ");
+    itoa((int)(raid_dev.sectors / 2048), num_buf, 10);
+    print(num_buf);
+    print(" MiB, members:");
+    for (int i = 0; i < stripe_count; i++) {
+        print(" ");
+        itoa(stripe_drives[i], num_buf, 10);
+        print(num_buf);
+    }
+    print("\n");
+}
@@ -0,0 +1,171 @@
+#include "include/ramdisk.h"
+#include "include/blkdev.h"
+#include "include/lib.h"
+#include "include/mm.h"
+
+// Memory is attached a page at a time on the first write to it, and
+// discarding a whole page gives it back; pages never written read as
+// zeros.
+typedef struct {
+    blkdev_t dev;
+    uint8_t** pages;
+    size_t size;
+    uint32_t page_count;
+    uint32_t resident;
+} ramdisk_t;
+
+static ramdisk_t ramdisks[2];
+static int ramdisk_count = 0;
+
+static int ramdisk_read(blkdev_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    ramdisk_t* rd = (ramdisk_t*)dev->priv;
+    uint64_t pos = lba * 512;
+    uint64_t end = pos + (uint64_t)count * 512;
+    if (end > rd->size) {
+        return 1;
+    }
+
+    uint8_t* out = (uint8_t*)buffer;
+    while (pos < end) {
+        uint32_t offset = pos % RAMDISK_PAGE_SIZE;
+        uint32_t n = RAMDISK_PAGE_SIZE - offset;
+        if (n > end - pos) {
+            n = (uint32_t)(end - pos);
+        }
+
+        uint8_t* page = rd->pages[pos / RAMDISK_PAGE_SIZE];
+        if (page) {
+            memcpy(out, page + offset, n);
+        } else {
+            memset(out, 0, n);
+        }
+        out += n;
+        pos += n;
+    }
+    return 0;
+}
+
+static int ramdisk_write(blkdev_t* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    ramdisk_t* rd = (ramdisk_t*)dev->priv;
+    uint64_t pos = lba * 512;
+    uint64_t end = pos + (uint64_t)count * 512;
+    if (end > rd->size) {
+        return 1;
+    }
+
+    const uint8_t* in = (const uint8_t*)buffer;
+    while (pos < end) {
+        uint32_t offset = pos % RAMDISK_PAGE_SIZE;
+        uint32_t n = RAMDISK_PAGE_SIZE - offset;
+        if (n > end - pos) {
+            n = (uint32_t)(end - pos);
+        }
+
+        uint8_t** page = &rd->pages[pos / RAMDISK_PAGE_SIZE];
+        if (!*page) {
+            *page = (uint8_t*)kcalloc(1, RAMDISK_PAGE_SIZE);
+            if (!*page) {
+                print("RAM disk: out of memory\n");
+                return 1;
+            }
+            rd->resident++;
+        }
+        memcpy(*page + offset, in, n);
+        in += n;
+        pos += n;
+    }
+    return 0;
+}
+
+// Whole pages are freed, the edges of the range are zeroed so that it
+// reads back the same as a freed page would
+static int ramdisk_discard(blkdev_t* dev, uint64_t lba, uint32_t count) {
+    ramdisk_t* rd = (ramdisk_t*)dev->priv;
+    uint64_t pos = lba * 512;
+    uint64_t end = pos + (uint64_t)count * 512;
+    if (end > rd->size) {
+        return 1;
+    }
+
+    while (pos < end) {
+        uint32_t offset = pos % RAMDISK_PAGE_SIZE;
+        uint32_t n = RAMDISK_PAGE_SIZE - offset;
+        if (n > end - pos) {
+            n = (uint32_t)(end - pos);
+        }
+
+        uint8_t** page = &rd->pages[pos / RAMDISK_PAGE_SIZE];
+        if (*page && n == RAMDISK_PAGE_SIZE) {
+            kfree(*page);
+            *page = NULL;
+            rd->resident--;
+        } else if (*page) {
+            memset(*page + offset, 0, n);
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+static const blkdev_ops_t ramdisk_ops = {
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .flush = NULL,
+    .discard = ramdisk_discard,
+};
+
+int ramdisk_create(size_t size) {
+    if (ramdisk_count >= (int)(sizeof(ramdisks) / sizeof(ramdisks[0]))) {
+        return -1;
+    }
+
+    print("Initializing RAM disk...\n");
+
+    ramdisk_t* rd = &ramdisks[ramdisk_count];
+    rd->size = size & ~511u;
+    rd->page_count = (uint32_t)((rd->size + RAMDISK_PAGE_SIZE - 1) / RAMDISK_PAGE_SIZE);
+    rd->resident = 0;
+    rd->pages = (uint8_t**)kcalloc(rd->page_count, sizeof(uint8_t*));
+    if (!rd->pages) {
+        print("Error: Failed to allocate RAM disk\n");
+        return -1;
+    }
+
+    blkdev_t* dev = &rd->dev;
+    memset(dev, 0, sizeof(blkdev_t));
+    strlcpy(dev->name, ramdisk_count ? "ram1" : "ram0", sizeof(dev->name));
+    dev->ops = &ramdisk_ops;
+    dev->priv = rd;
+    dev->unit = ramdisk_count;
+    dev->sectors = rd->size / 512;
+    dev->sector_size = 512;
+    dev->queue_depth = 1;
+
+    int id = blkdev_register(dev);
+    if (id < 0) {
+        kfree(rd->pages);
+        return -1;
+    }
+    ramdisk_count++;
+
+    print("RAM disk initialized: ");
+    print_hex(rd->size);
+    print(" bytes\n");
+    return id;
+}
+
+void ramdisk_print_info(void) {
+    char num_buf[12];
+
+    for (int i = 0; i < ramdisk_count; i++) {
+        ramdisk_t* rd = &ramdisks[i];
+        print(rd->dev.name);
+        print(": ");
+        itoa((int)(rd->resident * (RAMDISK_PAGE_SIZE / 1024)), num_buf, 10);
+        print(num_buf);
+        print(" of ");
+        itoa((int)(rd->size / 1024), num_buf, 10);
+        print(num_buf);
+        print(" KiB in memory\n");
+    }
+}
@@ -5,6 +5,185 @@
 #include "include/ahci.h"
 #include "include/run.h"
 #include "include/ai.h"
+#include "include/raid0.h"
+#include "include/diskbench.h"
+#include "include/fsbench.h"
+#include "include/iostat.h"
+#include "include/bcache.h"
+#include "include/blkdev.h"
+#include "include/nvme.h"
+#include "include/part.h"
+#include "include/iosched.h"
+#include "include/ramdisk.h"
+
+static void list_disks(void) {
+    int count = ahci_drive_count();
+    char num_buf[12];
+
+    print("Block devices:\n");
+    blkdev_print_list();
+    ramdisk_print_info();
+
+    if (count == 0) {
+        print("No AHCI drives\n");
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const ahci_device_info_t* info = ahci_drive_info(i);
+        print("Drive ");
+        itoa(i, num_buf, 10);
+        print(num_buf);
+        print(": port ");
+        itoa(ahci_drive_port(i), num_buf, 10);
+        print(num_buf);
+        print(", queue depth ");
+        itoa(ahci_drive_queue_depth(i), num_buf, 10);
+        print(num_buf);
+        print("\n  ");
+        print(info->model[0] ? info->model : "(not identified)");
+        if (info->serial[0]) {
+            print(" serial ");
+            print(info->serial);
+        }
+        if (info->firmware[0]) {
+            print(" fw ");
+            print(info->firmware);
+        }
+        print("\n  sectors ");
+        itoa((int)info->logical_sector_size, num_buf, 10);
+        print(num_buf);
+        print("/");
+        itoa((int)info->physical_sector_size, num_buf, 10);
+        print(num_buf);
+        print(" bytes, capacity ");
+        itoa((int)(info->sectors * info->logical_sector_size / (1024 * 1024)), num_buf, 10);
+        print(num_buf);
+        print(" MiB, max transfer ");
+        itoa((int)info->max_transfer, num_buf, 10);
+        print(num_buf);
+        print(" sectors\n  NCQ ");
+        itoa(info->ncq_depth, num_buf, 10);
+        print(info->ncq_depth ? num_buf : "no");
+        print(", TRIM ");
+        print(info->trim ? "yes" : "no");
+        print(", write cache ");
+        print(!info->write_cache ? "none" : (info->write_cache_enabled ? "on" : "off"));
+        print(", FUA ");
+        print(info->fua ? "yes" : "no");
+        print(info->rotational ? ", rotational\n" : ", solid state\n");
+    }
+    raid0_print_info();
+}
+
+// iosched [device policy]
+static void configure_iosched(const char* args) {
+    char name[BLKDEV_NAME_LEN];
+    int n = 0;
+
+    while (*args == ' ') args++;
+    if (*args) {
+        while (args[n] && args[n] != ' ' && n < BLKDEV_NAME_LEN - 1) {
+            name[n] = args[n];
+            n++;
+        }
+        name[n] = '\0';
+
+        const char* policy = args + n;
+        while (*policy == ' ') policy++;
+        int id = blkdev_find(name);
+        if (id < 0 || iosched_set_policy(id, iosched_parse_policy(policy))) {
+            print("Usage: iosched [device none|deadline|elevator]\n");
+            return;
+        }
+    }
+    iosched_print_stats();
+}
+
+// ccc [off | auto [max count] [ms] | <count> <ms>]
+static void configure_ccc(const char* args) {
+    while (*args == ' ') args++;
+    if (*args) {
+        int err;
+        if (strcmp(args, "off") == 0) {
+            err = ahci_set_coalescing(AHCI_CCC_OFF, 0, 0);
+        } else if (strncmp(args, "auto", 4) == 0 && (args[4] == ' ' || args[4] == '\0')) {
+            const char* p = args + 4;
+            while (*p == ' ') p++;
+            int count = *p ? atoi(p) : 8;
+            const char* ms = strchr(p, ' ');
+            int timeout = ms ? atoi(ms + 1) : 1;
+            // The controller takes an 8-bit count and a 16-bit timeout
+            err = count < 0 || count > 255 || timeout < 0 || timeout > 65535 ||
+                  ahci_set_coalescing(AHCI_CCC_ADAPTIVE, count, timeout);
+        } else {
+            const char* ms = strchr(args, ' ');
+            int count = atoi(args);
+            int timeout = ms ? atoi(ms + 1) : 0;
+            err = !ms || count < 0 || count > 255 || timeout < 0 || timeout > 65535 ||
+                  ahci_set_coalescing(AHCI_CCC_FIXED, count, timeout);
+        }
+        if (err) {
+            print("Usage: ccc [off | auto [max count] [ms] | count ms], needs interrupt-driven AHCI\n");
+        }
+    }
+    ahci_print_coalescing();
+}
+
+// raid0 <chunk sectors> <drive> <drive> [...]
+static void configure_raid0(const char* args) {
+    int drives[RAID0_MAX_DRIVES];
+    int ndrives = 0;
+    uint32_t chunk = atoi(args);
+
+    const char* p = strchr(args, ' ');
+    while (p && ndrives < RAID0_MAX_DRIVES) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        drives[ndrives++] = atoi(p);
+        p = strchr(p, ' ');
+    }
+
+    if (raid0_init(drives, ndrives, chunk)) {
+        print("Usage: raid0 [chunk sectors] [drive] [drive] ...\n");
+    }
+}
+
+// diskbench <device> [test] [block sectors] [queue depth] [seconds]
+static void run_diskbench(const char* args) {
+    const char* words[5];
+    int nwords = 0;
+    char test[16];
+
+    const char* p = args;
+    while (nwords < 5) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        words[nwords++] = p;
+        while (*p && *p != ' ') p++;
+    }
+
+    int tests = DISKBENCH_ALL;
+    if (nwords > 1) {
+        int n = 0;
+        while (words[1][n] && words[1][n] != ' ' && n < (int)sizeof(test) - 1) {
+            test[n] = words[1][n];
+            n++;
+        }
+        test[n] = '\0';
+        tests = diskbench_parse_tests(test);
+    }
+
+    if (nwords == 0 || !tests) {
+        print("Usage: diskbench [device] [all|read|write|randread|randwrite] [block] [qd] [seconds]\n");
+        return;
+    }
+
+    diskbench_run(atoi(words[0]), tests,
+                  nwords > 2 ? (uint32_t)atoi(words[2]) : 8,
+                  nwords > 3 ? (uint32_t)atoi(words[3]) : 4,
+                  nwords > 4 ? (uint32_t)atoi(words[4]) : 2);
+}
 
 void shell_main() {
     char input[64];
@@ -38,6 +217,18 @@ void shell_main() {
             print("cd [path]: change directory\n");
             print("list: list of files\n");
             print("tree: show the file system tree\n");
+            print("sync: write pending file system changes to disk now\n");
+            print("cache: show block cache statistics\n");
+            print("readahead [blocks]: set the readahead window limit\n");
+            print("disks: list storage drives\n");
+            print("partitions: show the partition table\n");
+            print("raid0 [chunk] [drives...]: stripe drives together\n");
+            print("nvme [poll|irq]: choose how NVMe completions are collected\n");
+            print("iosched [dev policy]: show or set a disk's I/O scheduler\n");
+            print("ccc [off|auto|count ms]: AHCI interrupt coalescing\n");
+            print("iostat [reset|serial]: show per-disk I/O statistics\n");
+            print("diskbench [dev test bs qd secs]: measure a disk (writes its last 16 MiB)\n");
+            print("fsbench [entries]: time name lookups as a directory grows\n");
         }
         else if (strcmp(input, "clr") == 0) {
             clear_screen();
@@ -120,6 +311,56 @@ void shell_main() {
         else if (strcmp(input, "tree") == 0) {
             fs_tree();
         }
+        else if (strcmp(input, "sync") == 0) {
+            fs_save();
+        }
+        else if (strcmp(input, "cache") == 0) {
+            bcache_print_stats();
+        }
+        else if (strncmp(input, "readahead ", 10) == 0) {
+            bcache_set_readahead(atoi(input + 10));
+        }
+        else if (strcmp(input, "disks") == 0) {
+            list_disks();
+        }
+        else if (strcmp(input, "partitions") == 0) {
+            part_print_table();
+        }
+        else if (strncmp(input, "nvme", 4) == 0 && (input[4] == ' ' || input[4] == '\0')) {
+            if (strcmp(input + 4, " poll") == 0) {
+                nvme_set_polled(1);
+            } else if (strcmp(input + 4, " irq") == 0) {
+                nvme_set_polled(0);
+            }
+            print(nvme_polled() ? "NVMe completions: polled\n" : "NVMe completions: interrupts\n");
+        }
+        else if (strncmp(input, "iosched", 7) == 0 && (input[7] == ' ' || input[7] == '\0')) {
+            configure_iosched(input + 7);
+        }
+        else if (strncmp(input, "ccc", 3) == 0 && (input[3] == ' ' || input[3] == '\0')) {
+            configure_ccc(input + 3);
+        }
+        else if (strcmp(input, "iostat") == 0) {
+            iostat_print();
+            ahci_print_coalescing();
+        }
+        else if (strcmp(input, "iostat reset") == 0) {
+            iostat_reset();
+        }
+        else if (strcmp(input, "iostat serial") == 0) {
+            iostat_dump_serial();
+        }
+        else if (strncmp(input, "diskbench", 9) == 0 && (input[9] == ' ' || input[9] == '\0')) {
+            run_diskbench(input + 9);
+        }
+        else if (strncmp(input, "fsbench", 7) == 0 && (input[7] == ' ' || input[7] == '\0')) {
+            const char* arg = input + 7;
+            while (*arg == ' ') arg++;
+            fsbench_run(*arg ? (uint32_t)atoi(arg) : 1024, FSBENCH_LOOKUPS);
+        }
+        else if (strncmp(input, "raid0 ", 6) == 0) {
+            configure_raid0(input + 6);
+        }
         else if (strncmp(input, "ai ", 3) == 0) {
             ai_handle(input + 3);
         }
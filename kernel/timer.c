@@ -0,0 +1,88 @@
+#include "include/timer.h"
+#include "include/idt.h"
+#include "include/lib.h"
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL0  0x40
+#define PIT_COMMAND   0x43
+
+#define CALIBRATION_TICKS 50
+
+static volatile uint64_t ticks = 0;
+static uint64_t tsc_per_us = 0;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void timer_irq(interrupt_frame_t* frame) {
+    (void)frame;
+    ticks++;
+}
+
+void timer_init(void) {
+    uint16_t divisor = PIT_FREQUENCY / TIMER_HZ;
+
+    outb(PIT_COMMAND, 0x34); // Channel 0, lobyte/hibyte, rate generator
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+    irq_install(0, timer_irq);
+}
+
+uint64_t timer_ticks(void) {
+    return ticks;
+}
+
+// Measures the TSC rate against the PIT tick so that delays and
+// timestamps no longer depend on how fast a nop loop runs.
+void timer_calibrate(void) {
+    uint64_t spins = 0;
+    uint64_t t0 = ticks;
+    while (ticks == t0) {
+        if (++spins > 100000000ULL) {
+            print("Timer: PIT not ticking, delays stay uncalibrated\n");
+            return;
+        }
+        asm volatile ("pause");
+    }
+
+    uint64_t start_tick = ticks;
+    uint64_t start_tsc = rdtsc();
+    while (ticks - start_tick < CALIBRATION_TICKS) {
+        asm volatile ("pause");
+    }
+    uint64_t elapsed = rdtsc() - start_tsc;
+
+    tsc_per_us = elapsed / (CALIBRATION_TICKS * (1000000 / TIMER_HZ));
+    if (tsc_per_us == 0) {
+        tsc_per_us = 1;
+    }
+
+    char num_buf[12];
+    print("Timer: TSC ");
+    itoa((int)tsc_per_us, num_buf, 10);
+    print(num_buf);
+    print(" MHz\n");
+}
+
+int timer_calibrated(void) {
+    return tsc_per_us != 0;
+}
+
+// Microseconds since boot, at tick resolution until calibrated
+uint64_t timer_us(void) {
+    if (tsc_per_us) {
+        return rdtsc() / tsc_per_us;
+    }
+    return ticks * (1000000 / TIMER_HZ);
+}
+
+void udelay(uint32_t us) {
+    uint64_t start = timer_us();
+    while (timer_us() - start < us) {
+        asm volatile ("pause");
+    }
+}
@@ -0,0 +1,418 @@
+#include "include/virtio_blk.h"
+#include "include/virtio.h"
+#include "include/blkdev.h"
+#include "include/lib.h"
+#include "include/mm.h"
+#include "include/pci.h"
+#include "include/idt.h"
+#include "include/timer.h"
+
+#define VIRTIO_BLK_DEVICE_LEGACY 0x1001
+#define VIRTIO_BLK_DEVICE_MODERN 0x1042
+
+#define VIRTIO_BLK_F_RO       (1u << 5)
+#define VIRTIO_BLK_F_BLK_SIZE (1u << 6)
+#define VIRTIO_BLK_F_FLUSH    (1u << 9)
+#define VIRTIO_BLK_F_TOPOLOGY (1u << 10)
+
+// Offsets into the device config
+#define VIRTIO_BLK_CFG_CAPACITY  0
+#define VIRTIO_BLK_CFG_BLK_SIZE  20
+#define VIRTIO_BLK_CFG_PHYS_EXP  24
+#define VIRTIO_BLK_CFG_ALIGN     25
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+
+#define VIRTIO_BLK_MAX_SLOTS 32      // Requests in flight, three descriptors each
+#define VIRTIO_BLK_MAX_SECTORS 256   // Per request
+#define VIRTIO_BLK_TIMEOUT_MS 5000
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;     // Always 512-byte units
+    uint8_t status;      // Written by the device
+    uint8_t pad[15];
+} __attribute__((packed)) virtio_blk_req_t;
+
+typedef struct {
+    blkdev_t dev;
+    uint16_t iobase;
+    uint16_t qsize;
+    uint32_t features;
+    virtq_desc_t* desc;
+    virtq_avail_t* avail;
+    volatile virtq_used_t* used;
+    uint16_t last_used;
+    uint32_t free_slots;
+    uint32_t slots;
+    virtio_blk_req_t* reqs;
+    blk_request_t* owner[VIRTIO_BLK_MAX_SLOTS]; // Block request each slot belongs to
+    blk_request_t* queue_head;    // Not fully posted yet
+    blk_request_t* queue_tail;
+    uint64_t progress;            // Tick of the last completion or first post
+    volatile uint32_t irq_pending;
+    int irq;             // INTx line, -1 = polled
+    int broken;          // A request timed out, the queue state is unknown
+} virtio_blk_t;
+
+static virtio_blk_t vblk[VIRTIO_BLK_MAX_DEVS];
+static int vblk_count = 0;
+
+static void virtio_blk_irq(interrupt_frame_t* frame) {
+    (void)frame;
+    for (int i = 0; i < vblk_count; i++) {
+        // Reading the ISR acknowledges the interrupt
+        if (vblk[i].irq >= 0 && (inb(vblk[i].iobase + VIRTIO_PCI_ISR) & 1)) {
+            vblk[i].irq_pending = 1;
+        }
+    }
+}
+
+static uint32_t cfg_read32(virtio_blk_t* vb, int offset) {
+    return inl(vb->iobase + VIRTIO_PCI_CONFIG + offset);
+}
+
+// Fills a free slot's descriptor chain (header, optional data, status)
+// and makes it available to the device. Returns the slot or -1.
+static int vblk_post(virtio_blk_t* vb, uint32_t type, uint64_t lba, uint32_t count, void* buffer) {
+    if (!vb->free_slots) {
+        return -1;
+    }
+
+    int slot = __builtin_ctz(vb->free_slots);
+    vb->free_slots &= ~(1u << slot);
+
+    virtio_blk_req_t* req = &vb->reqs[slot];
+    req->type = type;
+    req->reserved = 0;
+    req->sector = lba;
+    req->status = 0xFF;
+
+    uint16_t head = slot * 3;
+    virtq_desc_t* d = &vb->desc[head];
+    d[0].addr = (uint64_t)(unsigned long)req;
+    d[0].len = 16;
+    d[0].flags = VIRTQ_DESC_F_NEXT;
+
+    if (count) {
+        d[0].next = head + 1;
+        d[1].addr = (uint64_t)(unsigned long)buffer;
+        d[1].len = count * 512;
+        d[1].flags = VIRTQ_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0);
+        d[1].next = head + 2;
+    } else {
+        d[0].next = head + 2;
+    }
+
+    d[2].addr = (uint64_t)(unsigned long)&req->status;
+    d[2].len = 1;
+    d[2].flags = VIRTQ_DESC_F_WRITE;
+    d[2].next = 0;
+
+    vb->avail->ring[vb->avail->idx % vb->qsize] = head;
+    __sync_synchronize();
+    vb->avail->idx++;
+    return slot;
+}
+
+static uint32_t all_slots(virtio_blk_t* vb) {
+    return vb->slots == 32 ? 0xFFFFFFFF : (1u << vb->slots) - 1;
+}
+
+// A flush is one chain without data, counted as a single issued unit
+static uint32_t req_units(blk_request_t* req) {
+    return req->op == BLK_OP_FLUSH ? 1 : req->count;
+}
+
+static void vblk_finish(blk_request_t* req) {
+    if (req->inflight == 0 && req->issued == req_units(req)) {
+        blk_complete(req);
+    }
+}
+
+// Returns finished slots to the free mask and completes their requests
+static int vblk_reap(virtio_blk_t* vb) {
+    int done = 0;
+    while (vb->last_used != vb->used->idx) {
+        __sync_synchronize();
+        uint32_t id = vb->used->ring[vb->last_used % vb->qsize].id;
+        int slot = id / 3;
+        blk_request_t* req = vb->owner[slot];
+        if (vb->reqs[slot].status != VIRTIO_BLK_S_OK) {
+            req->failed = 1;
+        }
+        vb->owner[slot] = NULL;
+        vb->free_slots |= 1u << slot;
+        vb->last_used++;
+        req->inflight--;
+        vblk_finish(req);
+        done++;
+    }
+
+    if (done) {
+        vb->progress = timer_ticks();
+    }
+    return done;
+}
+
+// Splits queued requests into descriptor chains while slots are free
+// and notifies the device once per refill.
+static void vblk_kick(virtio_blk_t* vb) {
+    int added = 0;
+
+    while (vb->queue_head && vb->free_slots) {
+        blk_request_t* req = vb->queue_head;
+        uint32_t type = req->op == BLK_OP_READ ? VIRTIO_BLK_T_IN :
+                        req->op == BLK_OP_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_FLUSH;
+        uint32_t n = req_units(req) - req->issued;
+        if (n > VIRTIO_BLK_MAX_SECTORS) {
+            n = VIRTIO_BLK_MAX_SECTORS;
+        }
+
+        // The timeout runs from the first command of an idle queue
+        if (vb->free_slots == all_slots(vb)) {
+            vb->progress = timer_ticks();
+        }
+
+        int slot = vblk_post(vb, type, req->lba + req->issued, type == VIRTIO_BLK_T_FLUSH ? 0 : n,
+                             (uint8_t*)req->buffer + (size_t)req->issued * 512);
+        vb->owner[slot] = req;
+        req->issued += n;
+        req->inflight++;
+        added = 1;
+
+        if (req->issued == req_units(req)) {
+            vb->queue_head = req->next;
+            if (!vb->queue_head) {
+                vb->queue_tail = NULL;
+            }
+        }
+    }
+
+    if (added) {
+        __sync_synchronize();
+        outw(vb->iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+    }
+}
+
+// Fails everything queued or in flight. The ring state is unknown after
+// a timeout, so the device takes no further requests.
+static void vblk_fail_all(virtio_blk_t* vb) {
+    print("virtio-blk: request timeout on ");
+    print(vb->dev.name);
+    print("\n");
+    vb->broken = 1;
+
+    for (int slot = 0; slot < VIRTIO_BLK_MAX_SLOTS; slot++) {
+        blk_request_t* req = vb->owner[slot];
+        if (req) {
+            vb->owner[slot] = NULL;
+            req->failed = 1;
+            req->inflight--;
+            vblk_finish(req);
+        }
+    }
+
+    while (vb->queue_head) {
+        blk_request_t* req = vb->queue_head;
+        vb->queue_head = req->next;
+        req->failed = 1;
+        req->issued = req_units(req);
+        vblk_finish(req);
+    }
+    vb->queue_tail = NULL;
+}
+
+static int vblk_submit(blkdev_t* dev, blk_request_t* req) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->priv;
+    if (vb->broken) {
+        return 1;
+    }
+
+    if (req->op == BLK_OP_WRITE && (vb->features & VIRTIO_BLK_F_RO)) {
+        return 1;
+    }
+
+    if (req->op == BLK_OP_FLUSH) {
+        if (!(vb->features & VIRTIO_BLK_F_FLUSH)) {
+            blk_complete(req);
+            return 0;
+        }
+    } else {
+        // The device takes any 512-byte sector, but the data must still
+        // cover whole logical sectors
+        uint32_t spl = dev->sector_size / 512;
+        if ((req->lba % spl) || (req->count % spl)) {
+            return 1;
+        }
+    }
+
+    req->next = NULL;
+    if (vb->queue_tail) vb->queue_tail->next = req;
+    else vb->queue_head = req;
+    vb->queue_tail = req;
+
+    vblk_kick(vb);
+    return 0;
+}
+
+static void vblk_poll(blkdev_t* dev) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->priv;
+    vb->irq_pending = 0;
+
+    if (!vblk_reap(vb) && vb->free_slots != all_slots(vb) &&
+        timer_ticks() - vb->progress >= VIRTIO_BLK_TIMEOUT_MS * TIMER_HZ / 1000) {
+        vblk_fail_all(vb);
+        return;
+    }
+
+    vblk_kick(vb);
+}
+
+static int vblk_ready(blkdev_t* dev) {
+    virtio_blk_t* vb = (virtio_blk_t*)dev->priv;
+    return vb->irq_pending || vb->last_used != vb->used->idx;
+}
+
+static const blkdev_ops_t vblk_ops = {
+    .read = NULL,
+    .write = NULL,
+    .flush = NULL,
+    .discard = NULL,
+    .submit = vblk_submit,
+    .poll = vblk_poll,
+    .ready = vblk_ready,
+};
+
+static int vblk_setup(virtio_blk_t* vb, uint8_t bus, uint8_t slot, uint8_t func) {
+    uint32_t bar0 = pci_read_dword(bus, slot, func, 0x10);
+    if (!(bar0 & 1)) {
+        print("virtio-blk: BAR0 is not an I/O BAR\n");
+        return 1;
+    }
+    vb->iobase = bar0 & 0xFFFC;
+
+    uint32_t command = pci_read_dword(bus, slot, func, 0x04);
+    command |= (1 << 0) | (1 << 2);
+    command &= ~(1u << 10);
+    pci_write_dword(bus, slot, func, 0x04, command);
+
+    outb(vb->iobase + VIRTIO_PCI_STATUS, 0);
+    outb(vb->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(vb->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    uint32_t offered = inl(vb->iobase + VIRTIO_PCI_HOST_FEATURES);
+    vb->features = offered & (VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_TOPOLOGY);
+    outl(vb->iobase + VIRTIO_PCI_GUEST_FEATURES, vb->features);
+
+    outw(vb->iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+    vb->qsize = inw(vb->iobase + VIRTIO_PCI_QUEUE_SIZE);
+    if (vb->qsize == 0) {
+        print("virtio-blk: no request queue\n");
+        outb(vb->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return 1;
+    }
+
+    uint8_t* ring = (uint8_t*)kmalloc_aligned(virtq_size_bytes(vb->qsize), VIRTQ_ALIGN);
+    vb->reqs = (virtio_blk_req_t*)kmalloc_aligned(VIRTIO_BLK_MAX_SLOTS * sizeof(virtio_blk_req_t), 64);
+    if (!ring || !vb->reqs) {
+        print("virtio-blk: out of memory\n");
+        outb(vb->iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return 1;
+    }
+    memset(ring, 0, virtq_size_bytes(vb->qsize));
+
+    vb->desc = (virtq_desc_t*)ring;
+    vb->avail = (virtq_avail_t*)(ring + 16 * vb->qsize);
+    vb->used = (volatile virtq_used_t*)(ring + virtq_used_offset(vb->qsize));
+    vb->last_used = 0;
+    vb->slots = vb->qsize / 3 < VIRTIO_BLK_MAX_SLOTS ? vb->qsize / 3 : VIRTIO_BLK_MAX_SLOTS;
+    vb->free_slots = all_slots(vb);
+    outl(vb->iobase + VIRTIO_PCI_QUEUE_PFN, (uint32_t)((unsigned long)ring / VIRTQ_ALIGN));
+
+    uint8_t line = pci_read_dword(bus, slot, func, 0x3C) & 0xFF;
+    if (line < 16) {
+        vb->irq = line;
+        irq_install(line, virtio_blk_irq);
+    } else {
+        vb->irq = -1;
+        vb->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+
+    outb(vb->iobase + VIRTIO_PCI_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+    blkdev_t* dev = &vb->dev;
+    memset(dev, 0, sizeof(blkdev_t));
+    strlcpy(dev->name, "vd", sizeof(dev->name));
+    char letter[2] = { (char)('a' + vblk_count), '\0' };
+    strlcat(dev->name, letter, sizeof(dev->name));
+    dev->ops = &vblk_ops;
+    dev->priv = vb;
+    dev->unit = vblk_count;
+    dev->sectors = (uint64_t)cfg_read32(vb, VIRTIO_BLK_CFG_CAPACITY) |
+                   ((uint64_t)cfg_read32(vb, VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    dev->sector_size = 512;
+    if (vb->features & VIRTIO_BLK_F_BLK_SIZE) {
+        uint32_t size = cfg_read32(vb, VIRTIO_BLK_CFG_BLK_SIZE);
+        if (size >= 512 && (size % 512) == 0) {
+            dev->sector_size = size;
+        }
+    }
+    dev->physical_sector_size = dev->sector_size;
+    if (vb->features & VIRTIO_BLK_F_TOPOLOGY) {
+        uint8_t exp = inb(vb->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_PHYS_EXP);
+        uint8_t align = inb(vb->iobase + VIRTIO_PCI_CONFIG + VIRTIO_BLK_CFG_ALIGN);
+        if (exp < 8) {
+            dev->physical_sector_size = dev->sector_size << exp;
+            dev->alignment_offset = align * (dev->sector_size / 512);
+        }
+    }
+    dev->queue_depth = vb->slots;
+    dev->polled = vb->irq < 0;
+    // Without the flush feature the device writes through
+    dev->write_cache = (vb->features & VIRTIO_BLK_F_FLUSH) != 0;
+
+    print("virtio-blk: ");
+    print(dev->name);
+    print(", queue size ");
+    print_hex(vb->qsize);
+    print(vb->irq >= 0 ? ", IRQ " : ", polled");
+    if (vb->irq >= 0) print_hex(vb->irq);
+    print("\n");
+
+    return blkdev_register(dev) < 0;
+}
+
+int virtio_blk_init(void) {
+    for (int bus = 0; bus < 256; bus++) {
+        for (int slot = 0; slot < 32; slot++) {
+            for (int func = 0; func < 8; func++) {
+                uint32_t id = pci_read_dword(bus, slot, func, 0);
+                if (id == 0xFFFFFFFF || (id & 0xFFFF) != VIRTIO_PCI_VENDOR) {
+                    continue;
+                }
+
+                uint16_t device = id >> 16;
+                if (device == VIRTIO_BLK_DEVICE_MODERN) {
+                    print("virtio-blk: modern-only device skipped, use a transitional one\n");
+                    continue;
+                }
+                if (device != VIRTIO_BLK_DEVICE_LEGACY || vblk_count == VIRTIO_BLK_MAX_DEVS) {
+                    continue;
+                }
+
+                if (!vblk_setup(&vblk[vblk_count], bus, slot, func)) {
+                    vblk_count++;
+                }
+            }
+        }
+    }
+
+    return vblk_count;
+}